@@ -0,0 +1,300 @@
+/*
+ * Prints the recordings written with MOCKEAGAIN_RECORD set as schedules for
+ * MOCKEAGAIN_SCHEDULE, which is what MOCKEAGAIN_REPLAY makes of them, so
+ * that a run can be looked into and replayed with edits.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mockeagain_trace.h"
+#include "mockeagain_record.h"
+
+
+typedef struct {
+    mockeagain_record_t         rec;
+    uint64_t                    seq;
+} entry_t;
+
+
+/* a step of a connection being repeated, as it is printed */
+typedef struct {
+    long long                   size;
+    unsigned                    repeat;
+} step_t;
+
+
+#define STEP_ALL        -1
+#define STEP_EAGAIN     -2
+
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+    const entry_t       *x = a, *y = b;
+
+    if (x->rec.conn != y->rec.conn) {
+        return x->rec.conn < y->rec.conn ? -1 : 1;
+    }
+
+    if (x->seq != y->seq) {
+        return x->seq < y->seq ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+static void
+print_step(const step_t *st)
+{
+    if (st->size == STEP_ALL) {
+        printf(" all");
+
+    } else if (st->size == STEP_EAGAIN) {
+        printf(" eagain");
+
+    } else {
+        printf(" %lld", st->size);
+    }
+
+    if (st->repeat > 1) {
+        printf("*%u", st->repeat);
+    }
+}
+
+
+/* prints the "read" or "write" clause of a connection, if any */
+
+static int
+print_steps(const entry_t *entries, size_t n, int op, const char *sep)
+{
+    size_t                       i;
+    long long                    size;
+    step_t                       st = { 0, 0 };
+    const mockeagain_record_t   *r;
+
+    for (i = 0; i < n; i++) {
+        r = &entries[i].rec;
+
+        if (r->op != op) {
+            continue;
+        }
+
+        /* the same mapping as the one of MOCKEAGAIN_REPLAY */
+        if ((r->flags & MOCKEAGAIN_TRACE_INJECTED) || r->err == EAGAIN) {
+            size = STEP_EAGAIN;
+
+        } else if (r->value > 0) {
+            size = r->value;
+
+        } else {
+            size = STEP_ALL;
+        }
+
+        if (st.repeat && st.size == size) {
+            st.repeat++;
+            continue;
+        }
+
+        if (st.repeat) {
+            print_step(&st);
+
+        } else {
+            printf("%s %s", sep,
+                   op == MOCKEAGAIN_RECORD_WRITE ? "write" : "read");
+        }
+
+        st.size = size;
+        st.repeat = 1;
+    }
+
+    if (st.repeat == 0) {
+        return 0;
+    }
+
+    print_step(&st);
+
+    return 1;
+}
+
+
+static void
+print_events(uint32_t events)
+{
+    if (events & POLLIN) {
+        printf(" in");
+    }
+
+    if (events & POLLOUT) {
+        printf(" out");
+    }
+
+    if (events & ~(POLLIN | POLLOUT)) {
+        printf(" 0x%x", (unsigned) (events & ~(POLLIN | POLLOUT)));
+    }
+}
+
+
+static void
+print_conn(const entry_t *entries, size_t n)
+{
+    size_t               i;
+    unsigned             calls = 0;
+    uint32_t             conn;
+
+    conn = entries[0].rec.conn;
+
+    printf("%s %u:", (conn & MOCKEAGAIN_RECORD_CONNECTED) ? "connected"
+                                                          : "accepted",
+           (unsigned) (conn & ~MOCKEAGAIN_RECORD_CONNECTED));
+
+    if (print_steps(entries, n, MOCKEAGAIN_RECORD_READ, "")) {
+        (void) print_steps(entries, n, MOCKEAGAIN_RECORD_WRITE, ";");
+
+    } else {
+        (void) print_steps(entries, n, MOCKEAGAIN_RECORD_WRITE, "");
+    }
+
+    printf("\n");
+
+    /* the schedules have no say over the events, unlike the replays */
+    for (i = 0; i < n; i++) {
+        if (entries[i].rec.op != MOCKEAGAIN_RECORD_EVENTS) {
+            calls++;
+            continue;
+        }
+
+        printf("#   withheld");
+        print_events(entries[i].rec.value);
+        printf(" after %u calls\n", calls);
+    }
+}
+
+
+static int
+decode(const char *path)
+{
+    int                          fd;
+    void                        *p;
+    size_t                       size, i, j, n, max;
+    struct stat                  sb;
+    entry_t                     *entries;
+    const mockeagain_record_t   *recs;
+    mockeagain_record_header_t  *h;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "mockeagain-record: %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    size = sb.st_size;
+
+    if (size < sizeof(mockeagain_record_header_t)) {
+        fprintf(stderr, "mockeagain-record: %s: too short\n", path);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mockeagain-record: %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    h = p;
+
+    if (memcmp(h->magic, MOCKEAGAIN_RECORD_MAGIC, sizeof(h->magic)) != 0
+        || h->version != MOCKEAGAIN_RECORD_VERSION
+        || h->rec_size != sizeof(mockeagain_record_t))
+    {
+        fprintf(stderr, "mockeagain-record: %s: not a recording\n", path);
+        munmap(p, size);
+        return -1;
+    }
+
+    max = (size - sizeof(mockeagain_record_header_t))
+          / sizeof(mockeagain_record_t);
+
+    n = h->nrecords < h->max_records ? h->nrecords : h->max_records;
+    if (n > max) {
+        n = max;
+    }
+
+    entries = malloc((n ? n : 1) * sizeof(entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "mockeagain-record: out of memory\n");
+        munmap(p, size);
+        return -1;
+    }
+
+    recs = mockeagain_record_recs(h);
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (recs[i].op == 0 || recs[i].op > MOCKEAGAIN_RECORD_EVENTS
+            || (recs[i].conn & ~MOCKEAGAIN_RECORD_CONNECTED) == 0)
+        {
+            continue;
+        }
+
+        entries[j].rec = recs[i];
+        entries[j].seq = i;
+        j++;
+    }
+
+    n = j;
+
+    qsort(entries, n, sizeof(entry_t), entry_cmp);
+
+    printf("# %s: pid %u, %llu records%s\n", path, (unsigned) h->pid,
+           (unsigned long long) n,
+           h->nrecords > h->max_records ? ", the rest lost" : "");
+
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && entries[j].rec.conn == entries[i].rec.conn;
+             j++)
+        {
+            /* void */
+        }
+
+        print_conn(&entries[i], j - i);
+    }
+
+    free(entries);
+    munmap(p, size);
+
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int                  rc = EXIT_SUCCESS;
+
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "usage: mockeagain-record file...\n");
+        return EXIT_FAILURE;
+    }
+
+    for (argc--, argv++; argc; argc--, argv++) {
+        if (decode(*argv) != 0) {
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    return rc;
+}
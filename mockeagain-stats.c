@@ -0,0 +1,272 @@
+/*
+ * Prints the counters kept in the file given by MOCKEAGAIN_STATS, for every
+ * process and in total. With -i, it prints their rates per second over
+ * every interval instead, while the processes are running.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mockeagain_stats.h"
+
+
+#define NCOUNTERS                                                            \
+    (sizeof(mockeagain_stats_call_t) / sizeof(uint64_t))
+
+
+static const char *counter_names[] = {
+    "calls", "eagain", "short", "cut", "withheld", "dropped", "duped", "held"
+};
+
+
+static void
+print_header()
+{
+    unsigned             i;
+
+    printf("%-8s %-16s", "pid", "call");
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        printf(" %10s", counter_names[i]);
+    }
+
+    printf(" %10s\n", "timeouts");
+}
+
+
+/* prints a row unless it is all zeros, with a negative timeouts not shown */
+static void
+print_row(const char *pid, const char *call, const double *v, double timeouts)
+{
+    unsigned             i;
+    int                  zero = timeouts <= 0;
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        if (v[i] != 0) {
+            zero = 0;
+        }
+    }
+
+    if (zero) {
+        return;
+    }
+
+    printf("%-8s %-16s", pid, call);
+
+    for (i = 0; i < NCOUNTERS; i++) {
+        printf(" %10.*f", v[i] == (uint64_t) v[i] ? 0 : 1, v[i]);
+    }
+
+    if (timeouts >= 0) {
+        printf(" %10.*f", timeouts == (uint64_t) timeouts ? 0 : 1, timeouts);
+    }
+
+    printf("\n");
+}
+
+
+/*
+ * Prints the difference of the slots cur and prev, divided by secs, or the
+ * counters of cur themselves with prev NULL.
+ */
+
+static void
+print_slots(const mockeagain_stats_header_t *h,
+    const mockeagain_stats_slot_t *cur, const mockeagain_stats_slot_t *prev,
+    unsigned nslots, double secs)
+{
+    unsigned             s, c, i;
+    double               v[NCOUNTERS], sum[NCOUNTERS];
+    double               all[MOCKEAGAIN_STATS_NCALLS][NCOUNTERS];
+    double               t, timeouts = 0;
+    char                 pid[16], name[MOCKEAGAIN_STATS_NAME_LEN];
+    const uint64_t      *a, *b;
+
+    memset(all, 0, sizeof(all));
+
+    print_header();
+
+    for (s = 0; s < nslots; s++) {
+        if (cur[s].pid == 0) {
+            /* still being claimed */
+            continue;
+        }
+
+        snprintf(pid, sizeof(pid), "%u", (unsigned) cur[s].pid);
+        memset(sum, 0, sizeof(sum));
+
+        for (c = 0; c < MOCKEAGAIN_STATS_NCALLS; c++) {
+            a = (const uint64_t *) &cur[s].calls[c];
+            b = prev ? (const uint64_t *) &prev[s].calls[c] : NULL;
+
+            for (i = 0; i < NCOUNTERS; i++) {
+                v[i] = (double) (a[i] - (b ? b[i] : 0)) / secs;
+                sum[i] += v[i];
+                all[c][i] += v[i];
+            }
+
+            memcpy(name, h->calls[c], sizeof(name));
+            name[sizeof(name) - 1] = '\0';
+
+            print_row(pid, name[0] ? name : "?", v, -1);
+        }
+
+        t = (double) (cur[s].timeouts - (prev ? prev[s].timeouts : 0)) / secs;
+        timeouts += t;
+
+        print_row(pid, "*", sum, t);
+    }
+
+    memset(sum, 0, sizeof(sum));
+
+    for (c = 0; c < MOCKEAGAIN_STATS_NCALLS; c++) {
+        for (i = 0; i < NCOUNTERS; i++) {
+            sum[i] += all[c][i];
+        }
+
+        memcpy(name, h->calls[c], sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+
+        print_row("all", name[0] ? name : "?", all[c], -1);
+    }
+
+    print_row("all", "*", sum, timeouts);
+}
+
+
+static int
+snapshot(const mockeagain_stats_header_t *h, mockeagain_stats_slot_t *slots)
+{
+    unsigned             n;
+
+    n = __atomic_load_n(&h->nslots, __ATOMIC_ACQUIRE);
+    if (n > MOCKEAGAIN_STATS_MAX_SLOTS) {
+        n = MOCKEAGAIN_STATS_MAX_SLOTS;
+    }
+
+    memcpy(slots, mockeagain_stats_slot(h, 0),
+           n * sizeof(mockeagain_stats_slot_t));
+
+    return n;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int                          c, fd, count = -1;
+    unsigned                     n, prev_n;
+    double                       interval = 0;
+    struct stat                  sb;
+    struct timespec              ts;
+    mockeagain_stats_slot_t     *cur, *prev, *tmp;
+    mockeagain_stats_header_t   *h;
+
+    while ((c = getopt(argc, argv, "i:n:")) != -1) {
+        switch (c) {
+        case 'i':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                goto usage;
+            }
+
+            break;
+
+        case 'n':
+            count = atoi(optarg);
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1) {
+        goto usage;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "mockeagain-stats: %s: %s\n", argv[optind],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (sb.st_size < (off_t) mockeagain_stats_file_size) {
+        fprintf(stderr, "mockeagain-stats: %s: not a counters file\n",
+                argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    h = mmap(NULL, mockeagain_stats_file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (h == MAP_FAILED) {
+        fprintf(stderr, "mockeagain-stats: %s: %s\n", argv[optind],
+                strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    if (memcmp(h->magic, MOCKEAGAIN_STATS_MAGIC, sizeof(h->magic)) != 0
+        || h->version != MOCKEAGAIN_STATS_VERSION
+        || h->slot_size != sizeof(mockeagain_stats_slot_t))
+    {
+        fprintf(stderr, "mockeagain-stats: %s: not a counters file\n",
+                argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    cur = calloc(2 * MOCKEAGAIN_STATS_MAX_SLOTS,
+                 sizeof(mockeagain_stats_slot_t));
+    if (cur == NULL) {
+        fprintf(stderr, "mockeagain-stats: out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    prev = cur + MOCKEAGAIN_STATS_MAX_SLOTS;
+
+    n = snapshot(h, cur);
+
+    if (interval == 0) {
+        print_slots(h, cur, NULL, n, 1);
+        return EXIT_SUCCESS;
+    }
+
+    ts.tv_sec = (time_t) interval;
+    ts.tv_nsec = (long) ((interval - ts.tv_sec) * 1e9);
+
+    while (count < 0 || count-- > 0) {
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+        prev_n = n;
+
+        nanosleep(&ts, NULL);
+
+        n = snapshot(h, cur);
+
+        /* the slots claimed meanwhile start from zero */
+        memset(prev + prev_n, 0,
+               (n - prev_n) * sizeof(mockeagain_stats_slot_t));
+
+        print_slots(h, cur, prev, n, interval);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+
+usage:
+
+    fprintf(stderr, "usage: mockeagain-stats [-i seconds [-n count]] "
+            "file\n");
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,246 @@
+/*
+ * Renders the trace files written with MOCKEAGAIN_TRACE set as text, or as
+ * JSON lines with -j, with the records of all the threads merged in time.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "mockeagain_trace.h"
+
+
+typedef struct {
+    mockeagain_trace_rec_t      rec;
+    uint32_t                    tid;
+} entry_t;
+
+
+static int json = 0;
+
+
+static const char *flag_names[] = {
+    "injected", "short", "withheld", "dropped", "duplicated", "held"
+};
+
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+    const entry_t       *x = a, *y = b;
+
+    if (x->rec.time != y->rec.time) {
+        return x->rec.time < y->rec.time ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+static void
+print_flags(int flags)
+{
+    unsigned             i;
+    int                  first = 1;
+
+    for (i = 0; i < sizeof(flag_names) / sizeof(flag_names[0]); i++) {
+        if (!(flags & (1 << i))) {
+            continue;
+        }
+
+        if (json) {
+            printf("%s\"%s\"", first ? "" : ",", flag_names[i]);
+
+        } else {
+            printf("%s%s", first ? " " : ",", flag_names[i]);
+        }
+
+        first = 0;
+    }
+}
+
+
+static void
+print_entry(const mockeagain_trace_header_t *h, const entry_t *e)
+{
+    uint64_t             t;
+    const char          *call;
+    char                 name[MOCKEAGAIN_TRACE_NAME_LEN];
+
+    if (e->rec.call < MOCKEAGAIN_TRACE_NCALLS
+        && h->calls[e->rec.call][0] != '\0')
+    {
+        memcpy(name, h->calls[e->rec.call], sizeof(name));
+        name[sizeof(name) - 1] = '\0';
+        call = name;
+
+    } else {
+        call = "?";
+    }
+
+    /* the wall clock time of the record */
+    t = h->realtime + (e->rec.time - h->monotonic);
+
+    if (json) {
+        printf("{\"time\":%llu.%09llu,\"pid\":%u,\"tid\":%u,\"call\":\"%s\","
+               "\"fd\":%d,\"requested\":%llu,\"returned\":%lld,"
+               "\"errno\":%u,\"flags\":[",
+               (unsigned long long) (t / 1000000000),
+               (unsigned long long) (t % 1000000000),
+               (unsigned) h->pid, (unsigned) e->tid, call, (int) e->rec.fd,
+               (unsigned long long) e->rec.requested,
+               (long long) e->rec.returned, (unsigned) e->rec.err);
+        print_flags(e->rec.flags);
+        printf("]}\n");
+        return;
+    }
+
+    printf("%llu.%06llu %u/%u %s(%d) %llu = %lld",
+           (unsigned long long) (t / 1000000000),
+           (unsigned long long) (t % 1000000000 / 1000),
+           (unsigned) h->pid, (unsigned) e->tid, call, (int) e->rec.fd,
+           (unsigned long long) e->rec.requested,
+           (long long) e->rec.returned);
+
+    if (e->rec.returned == -1) {
+        printf(" %s", strerror(e->rec.err));
+    }
+
+    print_flags(e->rec.flags);
+    printf("\n");
+}
+
+
+static int
+decode(const char *path)
+{
+    int                          fd;
+    void                        *p;
+    size_t                       size, i, n, nentries = 0;
+    uint32_t                     nrings, r;
+    uint64_t                     head, k;
+    struct stat                  sb;
+    entry_t                     *entries;
+    mockeagain_trace_ring_t     *ring;
+    mockeagain_trace_rec_t      *recs;
+    mockeagain_trace_header_t   *h;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "mockeagain-trace: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    size = sb.st_size;
+
+    if (size < 2 * MOCKEAGAIN_TRACE_PAGE_SIZE) {
+        fprintf(stderr, "mockeagain-trace: %s: too short\n", path);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mockeagain-trace: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    h = p;
+
+    if (memcmp(h->magic, MOCKEAGAIN_TRACE_MAGIC, sizeof(h->magic)) != 0
+        || h->version != MOCKEAGAIN_TRACE_VERSION
+        || h->rec_size != sizeof(mockeagain_trace_rec_t)
+        || h->max_rings > MOCKEAGAIN_TRACE_MAX_RINGS
+        || size < mockeagain_trace_file_size(h->ring_size))
+    {
+        fprintf(stderr, "mockeagain-trace: %s: not a trace file\n", path);
+        munmap(p, size);
+        return -1;
+    }
+
+    nrings = h->nrings < h->max_rings ? h->nrings : h->max_rings;
+
+    for (r = 0; r < nrings; r++) {
+        head = mockeagain_trace_ring(h, r)->head;
+        nentries += head < h->ring_size ? head : h->ring_size;
+    }
+
+    entries = malloc((nentries ? nentries : 1) * sizeof(entry_t));
+    if (entries == NULL) {
+        fprintf(stderr, "mockeagain-trace: out of memory\n");
+        munmap(p, size);
+        return -1;
+    }
+
+    n = 0;
+
+    for (r = 0; r < nrings; r++) {
+        ring = mockeagain_trace_ring(h, r);
+        recs = mockeagain_trace_recs(h, r);
+
+        head = ring->head;
+
+        /* only the last ring_size records are left */
+        k = head < h->ring_size ? 0 : head - h->ring_size;
+
+        for (; k < head && n < nentries; k++) {
+            entries[n].rec = recs[k % h->ring_size];
+            entries[n].tid = ring->tid;
+            n++;
+        }
+    }
+
+    qsort(entries, n, sizeof(entry_t), entry_cmp);
+
+    for (i = 0; i < n; i++) {
+        print_entry(h, &entries[i]);
+    }
+
+    free(entries);
+    munmap(p, size);
+
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int                  c, rc = EXIT_SUCCESS;
+
+    while ((c = getopt(argc, argv, "j")) != -1) {
+        switch (c) {
+        case 'j':
+            json = 1;
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind == argc) {
+        goto usage;
+    }
+
+    for (; optind < argc; optind++) {
+        if (decode(argv[optind]) != 0) {
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    return rc;
+
+usage:
+
+    fprintf(stderr, "usage: mockeagain-trace [-j] file...\n");
+    return EXIT_FAILURE;
+}
@@ -8,15 +8,55 @@
 #include <sys/poll.h>
 #include <sys/uio.h>
 #include <sys/time.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include <dlfcn.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 #if __linux__
 #include <sys/eventfd.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#include "mockeagain.h"
+#include "mockeagain_trace.h"
+#include "mockeagain_stats.h"
+#include "mockeagain_record.h"
+
+#ifndef MOCKEAGAIN_SDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MOCKEAGAIN_SDT  1
+#endif
+#endif
+#endif
+
+#if MOCKEAGAIN_SDT
+#include <sys/sdt.h>
+#endif
+
+#if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
+    (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 27)
+    /* copy_file_range() only appeared in glibc 2.27 */
+#define HAVE_COPY_FILE_RANGE    0
+#else
+#define HAVE_COPY_FILE_RANGE    __linux__
 #endif
 
 #if DDEBUG
@@ -28,49 +68,591 @@
 #   define dd(...)
 #endif
 
+/*
+ * The USDT probes of the mocking decisions, which are a single nop until
+ * perf or bpftrace attaches to them. The decision of the write and read
+ * probes is given in the MOCKEAGAIN_TRACE_* flags of the trace records.
+ */
+#if MOCKEAGAIN_SDT
+#   define probe3(name, a, b, c)                                             \
+        DTRACE_PROBE3(mockeagain, name, a, b, c)
+#   define probe4(name, a, b, c, d)                                          \
+        DTRACE_PROBE4(mockeagain, name, a, b, c, d)
+#   define probe5(name, a, b, c, d, e)                                       \
+        DTRACE_PROBE5(mockeagain, name, a, b, c, d, e)
+#else
+#   define probe3(name, a, b, c)
+#   define probe4(name, a, b, c, d)
+#   define probe5(name, a, b, c, d, e)
+#endif
 
-#define MAX_FD 1024
 
+/*
+ * The per-fd state lives in chunks of FD_CHUNK_SIZE records which are only
+ * allocated when an fd in their range is first seen, so that any fd number
+ * can be mocked while the memory used stays proportional to the fds in use.
+ */
 
-static void *libc_handle = NULL;
-static short active_fds[MAX_FD + 1];
-static char  polled_fds[MAX_FD + 1];
-static char  written_fds[MAX_FD + 1];
-static char  weird_fds[MAX_FD + 1];
-static char  blacklist_fds[MAX_FD + 1];
-static char  snd_timeout_fds[MAX_FD + 1];
-static char **matchbufs = NULL;
-static size_t matchbuf_len = 0;
-static const char *pattern = NULL;
-static int verbose = -1;
-static int mocking_type = -1;
+#define FD_CHUNK_BITS   12
+#define FD_CHUNK_SIZE   (1 << FD_CHUNK_BITS)
+#define FD_CHUNK_MASK   (FD_CHUNK_SIZE - 1)
+#define FD_NCHUNKS      (1 << (31 - FD_CHUNK_BITS))
 
 
 enum {
-    MOCKING_READS = 0x01,
-    MOCKING_WRITES = 0x02
+    FD_POLLED = 0x01,
+    FD_WRITTEN = 0x02,
+    FD_WEIRD = 0x04,
+    FD_BLACKLIST = 0x08,
+    FD_SND_TIMEOUT = 0x10,
+    FD_EPOLL = 0x20,
+    FD_EPOLL_QUEUED = 0x40,
+    FD_RCV_TIMEOUT = 0x80,
+    FD_DGRAM = 0x100
 };
 
 
-#   define init_libc_handle() \
-        if (libc_handle == NULL) { \
-            libc_handle = RTLD_NEXT; \
-        }
+#define CACHE_LINE_SIZE 64
+
+
+/*
+ * The timeout patterns are compiled into a single Aho-Corasick automaton
+ * per direction which is turned into a full DFA, so that every byte written
+ * or read costs a single table lookup however many and however long the
+ * patterns are.
+ */
+typedef struct {
+    char               *spec;       /* as found in the environment */
+    int                 npatterns;
+    char              **patterns;   /* unescaped, not NUL-terminated */
+    size_t             *lens;
+    char              **srcs;       /* the patterns as given, for messages */
+    size_t             *src_lens;
+    int                 nstates;
+    int                *next;       /* nstates x 256 transitions */
+    int                *match;      /* per state, 1 + the pattern found */
+} matcher_t;
+
+
+/*
+ * The distribution of the sizes of the mocked I/O calls, a list of ranges
+ * each picked with its own weight.
+ */
+typedef struct {
+    size_t              min;
+    size_t              max;
+    unsigned            weight;     /* the sum of the weights up to here */
+} chunk_range_t;
+
+
+typedef struct {
+    char               *spec;       /* as found in the environment */
+    int                 nranges;
+    chunk_range_t      *ranges;
+} chunk_conf_t;
+
+
+/*
+ * The rules of MOCKEAGAIN_TARGET, which pick the connections mocked by the
+ * address family, the direction and the local and peer addresses. The
+ * first rule matching an fd decides whether it is mocked.
+ */
+typedef struct {
+    int                 family;     /* AF_INET or AF_INET6, 0 for any */
+    int                 prefix;     /* the leading bits of addr compared */
+    u_char              addr[16];
+    unsigned            port_min;
+    unsigned            port_max;
+} target_addr_t;
+
+
+typedef struct {
+    int                 exclude;    /* a "!" rule, for the fds not mocked */
+    int                 direction;  /* FD_TARGET_ACCEPTED or _CONNECTED */
+    int                 family;     /* AF_INET, AF_INET6 or AF_UNIX */
+    int                 has_local;
+    int                 has_peer;
+    target_addr_t       local;
+    target_addr_t       peer;
+} target_rule_t;
+
+
+typedef struct {
+    char               *spec;       /* as found in the environment */
+    int                 nrules;
+    int                 include;    /* whether any rule is not a "!" one */
+    target_rule_t      *rules;
+} target_conf_t;
+
+
+/*
+ * The steps of MOCKEAGAIN_SCHEDULE or MOCKEAGAIN_REPLAY for the reads or
+ * writes of a single connection, each taken by as many calls as it repeats.
+ */
+
+#define SCHEDULE_ALL        -1  /* the whole call goes through */
+#define SCHEDULE_EAGAIN     -2
+
+#define SCHEDULE_MAX_ORDINAL    65536   /* so the index stays small */
+
+typedef struct {
+    long long           size;       /* bytes, SCHEDULE_ALL or _EAGAIN */
+    unsigned            repeat;
+} schedule_step_t;
+
+
+/* the events withheld once the reads and writes before them are done */
+typedef struct {
+    unsigned            calls;
+    uint32_t            events;
+} schedule_event_t;
+
+
+typedef struct {
+    int                 nsteps[2];  /* of the reads and the writes */
+    schedule_step_t    *steps[2];
+    unsigned            ncalls;     /* the reads and writes recorded */
+    int                 nevents;
+    schedule_event_t   *events;
+} schedule_t;
+
+
+/* the schedules of the nth accepted and the nth connected fds */
+typedef struct {
+    char               *path;       /* as found in the environment */
+    int                 nschedules;
+    unsigned            nindex[2];
+    schedule_t        **index[2];
+} schedule_conf_t;
+
+
+#define MAX_CHUNK_IOVS  16
+
+
+/* the arguments of send() and sendto() besides the data */
+typedef struct {
+    int                      flags;
+    const struct sockaddr   *addr;
+    socklen_t                addrlen;
+} send_args_t;
+
+
+/* the arguments of recvfrom() besides the buffer */
+typedef struct {
+    int                      flags;
+    struct sockaddr         *addr;
+    socklen_t               *addrlen;
+} recv_args_t;
+
+
+/* the arguments of the zero-copy calls besides the destination and size */
+typedef struct {
+    int                      fd_in;
+    void                    *off_in;
+    void                    *off_out;
+    unsigned int             flags;
+} copy_args_t;
+
+
+/*
+ * A datagram held back by the impairment mode, in the queue of its fd. The
+ * datagrams of an fd go out in order, each one once it is due and the
+ * datagrams it has to let pass first have gone out.
+ */
+typedef struct dgram_s  dgram_t;
+
+struct dgram_s {
+    dgram_t                 *next;
+    uint64_t                 due;       /* in ns */
+    int                      fd;        /* the fd it goes out on */
+    int                      after;     /* the datagrams to let pass */
+    int                      flags;
+    socklen_t                addrlen;
+    struct sockaddr_storage  addr;
+    size_t                   len;
+    u_char                   data[1];
+};
+
+
+/* the held datagrams of an fd beyond which its sends are dropped */
+#define DGRAM_QUEUE_SIZE    64
+
+/* the longest a datagram is held back for reordering, in ms */
+#define DGRAM_REORDER_HOLD  100
+
+
+#if __linux__
+/* the arguments of recvmmsg() and sendmmsg() for their first message */
+typedef struct {
+    struct mmsghdr           mmsg;
+    int                      flags;
+    struct timespec         *timeout;
+} mmsg_args_t;
+
+
+/*
+ * The registrations of the fds in an epoll instance, by fd, with the
+ * caller's own epoll data for them. The table only grows, under epoll_lock,
+ * and the tables it outgrows are leaked as epoll_wait() may still read
+ * them.
+ */
+typedef struct {
+    epoll_data_t             data;
+    uint32_t                 events;
+    int                      registered;
+} epoll_reg_t;
+
+typedef struct {
+    int                      nregs;
+    epoll_reg_t              regs[1];
+} epoll_regs_t;
+
+
+/* the fds masked by an epoll_wait() call while their events are withheld */
+typedef struct {
+    int                      fd;
+    uint32_t                 held;
+} epoll_mask_t;
+
+typedef struct {
+    int                      nmasks;
+    int                      nalloc;
+    epoll_mask_t            *masks;
+} epoll_masks_t;
+#endif
+
+
+/*
+ * All the state of a single fd, padded to whole cache lines so that
+ * threads working on different fds never share a line. The record takes
+ * 4 lines on 64-bit systems, the first of which holds what every read and
+ * write touches, so that the other lines are only brought in by the modes
+ * that use them. The fields that can be touched by several threads at once
+ * are only accessed through the atomic fd_*() macros below.
+ */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+    /* the first cache line */
+    short               active;     /* the events seen by the last poll */
+    unsigned short      flags;
+    int                 mocking;    /* FD_MOCKING_SET and its mocking type */
+    int                 wstate;     /* of the write timeout matcher */
+    int                 rstate;     /* of the read timeout matcher */
+    const schedule_t   *schedule;   /* of MOCKEAGAIN_SCHEDULE, if any */
+    mockeagain_split_hook_handle    split_hook;     /* of the API, if any */
+    dgram_t            *dgrams;     /* held back, under dgram_lock */
+    uint64_t            nwritten;   /* bytes written on the fd so far */
+    uint64_t            nread;      /* bytes read from the fd so far */
+    uint64_t            ninjected;  /* EAGAINs injected on the fd */
+
+    uint64_t            nshort;     /* calls cut short on the fd */
+    const matcher_t    *wmatcher;   /* the one wstate belongs to */
+    const matcher_t    *rmatcher;   /* the one rstate belongs to */
+    int                 wmatched;   /* 1 + the write pattern found */
+    int                 rmatched;   /* 1 + the read pattern found */
+    matcher_t          *wpatterns;  /* of the fd itself, over the global */
+    matcher_t          *rpatterns;
+    uint64_t            woffset;    /* of the fd itself + 1, or 0 */
+    uint64_t            roffset;
+#if __linux__
+    int                 epfd;
+    uint32_t            epoll_events;   /* registered by the caller */
+    uint32_t            epoll_pending;  /* to re-deliver to EPOLLET fds */
+    epoll_regs_t       *epoll_regs;     /* epfd only: its registrations */
+    int                 epoll_queue;    /* epfd only: first queued fd + 1 */
+    int                 epoll_next;     /* next queued fd + 1 */
+#endif
+    int                 step[2];    /* the next read and write steps */
+    unsigned            taken[2];   /* the calls taken by those steps */
+    unsigned            ncalls;     /* the reads and writes scheduled */
+    int                 event;      /* the next events to withhold */
+    uint32_t            conn;       /* as in the recordings, or 0 */
+    short               held;       /* the events withheld by the last poll */
+    void               *split_data;
+    uint64_t            rnd;        /* the random number generator state */
+    uint64_t            tokens;     /* bytes in the write token bucket */
+    uint64_t            refilled_at;    /* in ns, 0 for a full bucket */
+    uint64_t            readable_at;    /* in ns, of the data pending */
+    uint64_t            connected_at;   /* in ns, of a connect pending */
+    /* kept last, as fd_state_reset() leaves it to dgram_flush() */
+    int                 dgram_next; /* next fd with held datagrams + 1 */
+} fd_state_t;
+
+
+#define fd_flags(st)                                                         \
+    __atomic_load_n(&(st)->flags, __ATOMIC_ACQUIRE)
+#define fd_set_flags(st, f)                                                  \
+    __atomic_fetch_or(&(st)->flags, (f), __ATOMIC_ACQ_REL)
+#define fd_clear_flags(st, f)                                                \
+    __atomic_fetch_and(&(st)->flags, ~(f), __ATOMIC_ACQ_REL)
+
+#define fd_active(st)                                                        \
+    __atomic_load_n(&(st)->active, __ATOMIC_ACQUIRE)
+#define fd_set_active(st, ev)                                                \
+    __atomic_store_n(&(st)->active, (ev), __ATOMIC_RELEASE)
+#define fd_clear_active(st, ev)                                              \
+    __atomic_fetch_and(&(st)->active, ~(ev), __ATOMIC_ACQ_REL)
+
+/* the fd follows a schedule or a split hook instead of the mocking types */
+#define fd_scheduled(st)                                                     \
+    (__atomic_load_n(&(st)->schedule, __ATOMIC_ACQUIRE) != NULL              \
+     || __atomic_load_n(&(st)->split_hook, __ATOMIC_ACQUIRE) != NULL)
+
+
+static fd_state_t *fd_chunks[FD_NCHUNKS];
+static matcher_t *write_matcher = NULL;
+static matcher_t *read_matcher = NULL;
+static chunk_conf_t *chunk_conf = NULL;
+static target_conf_t *target_conf = NULL;
+static schedule_conf_t *schedule_conf = NULL;
+static schedule_conf_t *replay_conf = NULL;
+static uint64_t fd_seq = 0;
+static unsigned accepted_seq = 0;   /* the fds accepted so far */
+static unsigned connected_seq = 0;  /* the fds connected so far */
+static long long write_timeout_offset = -1;
+static long long read_timeout_offset = -1;
+static long long write_rate = -1;
+static long long write_buffer = -1;
+static uint64_t latency = 0;    /* min and max milliseconds, 32 bits each */
+static uint64_t random_seed = 0;
+static uint32_t eagain_chance = 0;  /* in 1/2^32, as the ones below */
+static uint32_t short_chance = 0;
+static uint32_t udp_loss = 0;   /* in 1/2^32, as the ones below */
+static uint32_t udp_duplicate = 0;
+static uint32_t udp_reorder = 0;
+static uint64_t udp_delay = 0;  /* min and max milliseconds, as latency */
+static int dgram_fds = 0;       /* first fd with held datagrams + 1 */
+static char dgram_lock = 0;
+static mockeagain_trace_header_t *trace_file = NULL;
+static char *trace_path = NULL; /* the MOCKEAGAIN_TRACE it was opened for */
+static pid_t trace_pid = 0;     /* the process it was opened by */
+static mockeagain_stats_header_t *stats_file = NULL;
+static char *stats_path = NULL; /* the MOCKEAGAIN_STATS it was opened for */
+static mockeagain_stats_slot_t *stats_slot = NULL;  /* of this process */
+static mockeagain_record_header_t *record_file = NULL;
+static char *record_path = NULL;    /* the MOCKEAGAIN_RECORD it was for */
+static pid_t record_pid = 0;        /* the process it was opened by */
+static char *control_path = NULL;   /* MOCKEAGAIN_CONTROL */
+static char *control_conf = NULL;   /* the NAME=value lines it holds */
+static struct stat control_stat;    /* the control file last applied */
+static int control_watching = 0;    /* set once the watcher is started */
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;  /* reloads */
+#if __linux__
+static pthread_mutex_t epoll_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* the calls traced and counted, by their indexes in the trace records */
+enum {
+    CALL_READ = 0,
+    CALL_READV,
+    CALL_RECV,
+    CALL_RECVFROM,
+    CALL_RECVMSG,
+    CALL_RECVMMSG,
+    CALL_WRITE,
+    CALL_WRITEV,
+    CALL_SEND,
+    CALL_SENDTO,
+    CALL_SENDMSG,
+    CALL_SENDMMSG,
+    CALL_SENDFILE,
+    CALL_SENDFILE64,
+    CALL_SPLICE,
+    CALL_COPY_FILE_RANGE,
+    CALL_POLL,
+    CALL_PPOLL,
+    CALL_SELECT,
+    CALL_PSELECT,
+    CALL_EPOLL_WAIT
+};
+
+/* their names, in the trace and counters files */
+static const char *trace_calls[] = {
+    [CALL_READ] = "read",
+    [CALL_READV] = "readv",
+    [CALL_RECV] = "recv",
+    [CALL_RECVFROM] = "recvfrom",
+    [CALL_RECVMSG] = "recvmsg",
+    [CALL_RECVMMSG] = "recvmmsg",
+    [CALL_WRITE] = "write",
+    [CALL_WRITEV] = "writev",
+    [CALL_SEND] = "send",
+    [CALL_SENDTO] = "sendto",
+    [CALL_SENDMSG] = "sendmsg",
+    [CALL_SENDMMSG] = "sendmmsg",
+    [CALL_SENDFILE] = "sendfile",
+    [CALL_SENDFILE64] = "sendfile64",
+    [CALL_SPLICE] = "splice",
+    [CALL_COPY_FILE_RANGE] = "copy_file_range",
+    [CALL_POLL] = "poll",
+    [CALL_PPOLL] = "ppoll",
+    [CALL_SELECT] = "select",
+    [CALL_PSELECT] = "pselect",
+    [CALL_EPOLL_WAIT] = "epoll_wait",
+};
+
+/* where the writes and the event calls start among them */
+#define CALL_FIRST_WRITE    CALL_WRITE
+#define CALL_FIRST_EVENT    CALL_POLL
+
+#define call_name(call)     trace_calls[call]
+
+static int verbose = 0;
+static int mocking_type = 0;
+static int fd_mocking = 0;      /* set once any fd may be mocked its way */
+
+/* the ring of the current thread in the trace file it belongs to */
+static __thread mockeagain_trace_header_t *trace_owner;
+static __thread mockeagain_trace_ring_t *trace_ring;
+static __thread mockeagain_trace_rec_t *trace_recs;
+
+
+enum {
+    MOCKING_READS = MOCKEAGAIN_READS,
+    MOCKING_WRITES = MOCKEAGAIN_WRITES
+};
+
+
+/* the mocking of an fd set through the API, over the global one */
+#define FD_MOCKING_SET  0x100
+
+/* the fd has been matched against MOCKEAGAIN_TARGET, and is not mocked */
+#define FD_TARGET_DONE  0x200
+#define FD_TARGET_SKIP  0x400
+
+/* the direction of the connection of the fd */
+#define FD_TARGET_ACCEPTED  0x800
+#define FD_TARGET_CONNECTED 0x1000
+
+#define FD_TARGET_BITS                                                       \
+    (FD_TARGET_DONE | FD_TARGET_SKIP | FD_TARGET_ACCEPTED                    \
+     | FD_TARGET_CONNECTED)
+
+
+/* the settings are read by load_conf() and only ever published as a whole */
+#define get_mocking_type()  __atomic_load_n(&mocking_type, __ATOMIC_RELAXED)
+#define get_fd_mocking()    __atomic_load_n(&fd_mocking, __ATOMIC_RELAXED)
+
+/* whether any fd may be mocked at all */
+#define mocking_any()       (get_mocking_type() || get_fd_mocking())
+#define get_verbose_level() __atomic_load_n(&verbose, __ATOMIC_RELAXED)
+#define get_write_matcher()                                                  \
+    __atomic_load_n(&write_matcher, __ATOMIC_ACQUIRE)
+#define get_read_matcher()                                                   \
+    __atomic_load_n(&read_matcher, __ATOMIC_ACQUIRE)
+#define get_chunk_conf()                                                     \
+    __atomic_load_n(&chunk_conf, __ATOMIC_ACQUIRE)
+#define get_target_conf()                                                    \
+    __atomic_load_n(&target_conf, __ATOMIC_ACQUIRE)
+#define get_schedule_conf()                                                  \
+    __atomic_load_n(&schedule_conf, __ATOMIC_ACQUIRE)
+#define get_replay_conf()                                                    \
+    __atomic_load_n(&replay_conf, __ATOMIC_ACQUIRE)
+#define get_write_timeout_offset()                                           \
+    __atomic_load_n(&write_timeout_offset, __ATOMIC_RELAXED)
+#define get_read_timeout_offset()                                            \
+    __atomic_load_n(&read_timeout_offset, __ATOMIC_RELAXED)
+
+/* the triggers armed on an fd through the API take over the global ones */
+#define fd_write_matcher(st)                                                 \
+    (__atomic_load_n(&(st)->wpatterns, __ATOMIC_ACQUIRE)                     \
+     ? __atomic_load_n(&(st)->wpatterns, __ATOMIC_ACQUIRE)                   \
+     : get_write_matcher())
+#define fd_read_matcher(st)                                                  \
+    (__atomic_load_n(&(st)->rpatterns, __ATOMIC_ACQUIRE)                     \
+     ? __atomic_load_n(&(st)->rpatterns, __ATOMIC_ACQUIRE)                   \
+     : get_read_matcher())
+#define fd_write_timeout_offset(st)                                          \
+    ((st)->woffset ? (long long) (st)->woffset - 1                           \
+                   : get_write_timeout_offset())
+#define fd_read_timeout_offset(st)                                           \
+    ((st)->roffset ? (long long) (st)->roffset - 1                           \
+                   : get_read_timeout_offset())
+#define get_write_rate()                                                     \
+    __atomic_load_n(&write_rate, __ATOMIC_RELAXED)
+#define get_write_buffer()                                                   \
+    __atomic_load_n(&write_buffer, __ATOMIC_RELAXED)
+#define get_latency()                                                        \
+    __atomic_load_n(&latency, __ATOMIC_RELAXED)
+#define get_random_seed()                                                    \
+    __atomic_load_n(&random_seed, __ATOMIC_RELAXED)
+#define get_eagain_chance()                                                  \
+    __atomic_load_n(&eagain_chance, __ATOMIC_RELAXED)
+#define get_short_chance()                                                   \
+    __atomic_load_n(&short_chance, __ATOMIC_RELAXED)
+
+#define get_udp_loss()                                                       \
+    __atomic_load_n(&udp_loss, __ATOMIC_RELAXED)
+#define get_udp_duplicate()                                                  \
+    __atomic_load_n(&udp_duplicate, __ATOMIC_RELAXED)
+#define get_udp_reorder()                                                    \
+    __atomic_load_n(&udp_reorder, __ATOMIC_RELAXED)
+#define get_udp_delay()                                                      \
+    __atomic_load_n(&udp_delay, __ATOMIC_RELAXED)
+
+#define get_trace_file()                                                     \
+    __atomic_load_n(&trace_file, __ATOMIC_ACQUIRE)
+#define get_stats_slot()                                                     \
+    __atomic_load_n(&stats_slot, __ATOMIC_ACQUIRE)
+#define get_record_file()                                                    \
+    __atomic_load_n(&record_file, __ATOMIC_ACQUIRE)
+
+#define CONTROL_INTERVAL    100 /* ms */
+
+/* whether the datagrams are impaired at all */
+#define dgram_mode()                                                         \
+    (get_udp_loss() || get_udp_duplicate() || get_udp_reorder()              \
+     || get_udp_delay())
+
+/* the queues of held datagrams are only ever touched under this lock */
+#define dgram_lock_acquire()                                                 \
+    while (__atomic_test_and_set(&dgram_lock, __ATOMIC_ACQUIRE)) {           \
+        /* void */                                                           \
+    }
+#define dgram_lock_release()                                                 \
+    __atomic_clear(&dgram_lock, __ATOMIC_RELEASE)
+
+/* whether the random mode is on, where the mocked calls only fail by chance */
+#define random_mode()   (get_eagain_chance() || get_short_chance())
+
+
+#define DEFAULT_WRITE_BUFFER    65536
 
 
 typedef int (*socket_handle) (int domain, int type, int protocol);
 
-typedef int (*poll_handle) (struct pollfd *ufds, unsigned int nfds,
-    int timeout);
+typedef int (*connect_handle) (int sockfd, const struct sockaddr *addr,
+    socklen_t addrlen);
+
+typedef int (*poll_handle) (struct pollfd *ufds, nfds_t nfds, int timeout);
+
+typedef int (*select_handle) (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, struct timeval *timeout);
+
+typedef int (*pselect_handle) (int nfds, fd_set *readfds, fd_set *writefds,
+    fd_set *exceptfds, const struct timespec *timeout,
+    const sigset_t *sigmask);
 
 typedef ssize_t (*writev_handle) (int fildes, const struct iovec *iov,
     int iovcnt);
 
+typedef ssize_t (*write_handle) (int fd, const void *buf, size_t count);
+
 typedef int (*close_handle) (int fd);
 
 typedef ssize_t (*send_handle) (int sockfd, const void *buf, size_t len,
     int flags);
 
+typedef ssize_t (*sendto_handle) (int sockfd, const void *buf, size_t len,
+    int flags, const struct sockaddr *dest_addr, socklen_t addrlen);
+
+typedef ssize_t (*sendmsg_handle) (int sockfd, const struct msghdr *msg,
+    int flags);
+
+/* issues the original call of a write wrapper on the data given */
+typedef ssize_t (*write_op_handle) (int fd, const struct iovec *iov,
+    int iovcnt, void *data);
+
 typedef ssize_t (*read_handle) (int fd, void *buf, size_t count);
 
 typedef ssize_t (*recv_handle) (int sockfd, void *buf, size_t len,
@@ -79,12 +661,70 @@ typedef ssize_t (*recv_handle) (int sockfd, void *buf, size_t len,
 typedef ssize_t (*recvfrom_handle) (int sockfd, void *buf, size_t len,
     int flags, struct sockaddr *src_addr, socklen_t *addrlen);
 
+typedef ssize_t (*readv_handle) (int fd, const struct iovec *iov,
+    int iovcnt);
+
+typedef ssize_t (*recvmsg_handle) (int sockfd, struct msghdr *msg,
+    int flags);
+
+/* issues the original call of a read wrapper into the buffers given */
+typedef ssize_t (*read_op_handle) (int fd, const struct iovec *iov,
+    int iovcnt, void *data);
+
+typedef int (*setenv_handle) (const char *name, const char *value,
+    int overwrite);
+
+typedef int (*unsetenv_handle) (const char *name);
+
+typedef int (*putenv_handle) (char *string);
+
 #if __linux__
 typedef int (*accept4_handle) (int socket, struct sockaddr *address,
     socklen_t *address_len, int flags);
 
+typedef int (*ppoll_handle) (struct pollfd *ufds, nfds_t nfds,
+    const struct timespec *tmo_p, const sigset_t *sigmask);
+
 typedef int (*signalfd_handle) (int fd, const sigset_t *mask, int flags);
 
+typedef int (*epoll_create_handle) (int size);
+
+typedef int (*epoll_create1_handle) (int flags);
+
+typedef int (*epoll_ctl_handle) (int epfd, int op, int fd,
+    struct epoll_event *event);
+
+typedef int (*epoll_pwait_handle) (int epfd, struct epoll_event *events,
+    int maxevents, int timeout, const sigset_t *sigmask);
+
+typedef ssize_t (*sendfile_handle) (int out_fd, int in_fd, off_t *offset,
+    size_t count);
+
+typedef ssize_t (*sendfile64_handle) (int out_fd, int in_fd,
+    off64_t *offset, size_t count);
+
+typedef ssize_t (*splice_handle) (int fd_in, loff_t *off_in, int fd_out,
+    loff_t *off_out, size_t len, unsigned int flags);
+
+typedef int (*sendmmsg_handle) (int sockfd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags);
+
+#if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
+    (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 21)
+    /* glibc < 2.21 used different signature */
+typedef int (*recvmmsg_handle) (int sockfd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags, const struct timespec *timeout);
+
+#else
+typedef int (*recvmmsg_handle) (int sockfd, struct mmsghdr *msgvec,
+    unsigned int vlen, int flags, struct timespec *timeout);
+#endif
+
+#if (HAVE_COPY_FILE_RANGE)
+typedef ssize_t (*copy_file_range_handle) (int fd_in, loff_t *off_in,
+    int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+#endif
+
 #if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
     (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 21)
     /* glibc < 2.21 used different signature */
@@ -97,69 +737,563 @@ typedef int (*eventfd_handle) (unsigned int initval, int flags);
 #endif
 
 
-static int get_verbose_level();
-static void init_matchbufs();
+static fd_state_t *fd_state(int fd);
+static fd_state_t *fd_state_alloc(int fd);
+static void fd_state_reset(fd_state_t *st);
+static void load_conf();
+static long long parse_size(const char *name);
+static uint64_t parse_delay(const char *name);
+static void load_matcher(const char *name, matcher_t **matcher,
+    const char *what, int level);
+static matcher_t *matcher_create(const char *spec);
+static int parse_escape(const char **p);
+static int hex_value(char c);
+static size_t matcher_feed(const matcher_t *m, int *state, const u_char *p,
+    size_t len, int *which);
+static void load_chunk_conf(int level);
+static chunk_conf_t *chunk_conf_create(const char *spec);
+static void load_target_conf(int level);
+static target_conf_t *target_conf_create(const char *spec);
+static int parse_target_addr(const char *p, target_addr_t *a);
+static int target_decide(int fd, fd_state_t *st, const struct sockaddr *peer,
+    socklen_t peerlen);
+static int target_addr_match(const target_addr_t *a,
+    const struct sockaddr *sa);
+static void load_schedule_conf(int level);
+static schedule_conf_t *schedule_conf_create(const char *path);
+static int parse_schedule_line(char *line, schedule_conf_t *conf);
+static int parse_schedule_steps(char *p, schedule_t *s);
+static schedule_t **schedule_slot(schedule_conf_t *conf, int connected,
+    unsigned ordinal);
+static void schedule_conf_free(schedule_conf_t *conf);
+static void load_replay_conf(int level);
+static schedule_conf_t *replay_conf_create(const char *path);
+static void conn_assign(int fd, int direction);
+static int schedule_revents(fd_state_t *st, int revents, int *wait);
+static ssize_t mock_scheduled(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, write_op_handle op, void *data,
+    int write);
+static uint64_t fd_random(fd_state_t *st);
+static size_t chunk_size(fd_state_t *st, size_t len);
+static size_t mock_write_size(fd_state_t *st, const struct iovec *iov,
+    int iovcnt, size_t len);
+static size_t mock_read_size(fd_state_t *st, size_t len);
+static void account_write(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, size_t len);
+static int fd_match(const matcher_t *m, const matcher_t **fdm, int *state,
+    const void *p, size_t len);
+static void account_read(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, size_t len);
 static int now();
-static int get_mocking_type();
+static int ms_since(int begin);
+static uint64_t now_ns();
+static int time_left(int timeout, int begin);
+static int timespec_to_ms(const struct timespec *ts);
+static struct timespec *ms_to_timespec(int ms, struct timespec *ts);
+static void count_timeout(unsigned call, int fd);
+static void emulate_timeout(unsigned call, int timeout, int elapsed,
+    int fd);
+static int wait_withheld(unsigned call, int timeout, int begin, int wait,
+    int fd, int *due);
+static uint64_t bucket_refill(fd_state_t *st);
+static int write_shaping_wait(fd_state_t *st);
+static int mock_write_blocked(fd_state_t *st);
+static uint64_t delay_ns(fd_state_t *st, uint64_t conf);
+static int ms_until(uint64_t t);
+static void mock_write_done(fd_state_t *st, ssize_t n, size_t len);
+static int mock_read_blocked(fd_state_t *st, short events);
+static void mock_read_done(fd_state_t *st, ssize_t n, size_t len);
+static void fd_seed(fd_state_t *st);
+static int fd_chance(fd_state_t *st, uint32_t chance);
+static uint32_t parse_chance(const char *name);
+static void load_seed(int level);
+static ssize_t mock_write(unsigned call, int fd, const struct iovec *iov,
+    int iovcnt, write_op_handle op, void *data);
+static ssize_t writev_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t write_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t send_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t sendto_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t sendmsg_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static fd_state_t *dgram_state(int fd);
+static ssize_t dgram_send(unsigned call, int fd, fd_state_t *st,
+    const struct msghdr *msg, int flags);
+static dgram_t *dgram_create(int fd, const struct msghdr *msg, size_t len,
+    int flags, uint64_t due, int after);
+static int dgram_hold(int fd, fd_state_t *st, dgram_t *d);
+static void dgram_passed(fd_state_t *st, int n);
+static uint64_t dgram_release(fd_state_t *st, uint64_t now,
+    dgram_t ***last);
+static int dgram_flush();
+static void dgram_wait(int fd, fd_state_t *st);
+static void dgram_close(int fd, fd_state_t *st);
+static int event_timeout(int timeout, int begin, int due);
+static void fork_prepare();
+static void fork_parent();
+static void fork_child();
+static void load_trace(int level);
+static void load_stats(int level);
+static void load_record(int level);
+static void record(mockeagain_record_header_t *h, int fd, unsigned call,
+    uint64_t requested, ssize_t returned, int flags, int err);
+static void load_control(int level);
+static int control_read(const char *path);
+static void control_watch();
+static void *control_watcher(void *data);
+static const char *conf_getenv(const char *name);
+static void stats_claim(mockeagain_stats_header_t *h, int level);
+static int fd_mocking_type(int fd);
+static void matcher_free(matcher_t *m);
+static int trace_claim(mockeagain_trace_header_t *h);
+static void trace(unsigned call, int fd, uint64_t requested,
+    ssize_t returned, int flags);
+static void trace_iov(unsigned call, int fd, const struct iovec *iov,
+    int iovcnt, ssize_t returned, int flags);
+static size_t iov_total(const struct iovec *iov, int iovcnt);
+static size_t iov_head(const struct iovec *iov, int iovcnt, size_t n,
+    struct iovec *head, int *nhead);
+static ssize_t mock_read(unsigned call, int fd, short events,
+    const struct iovec *iov, int iovcnt, read_op_handle op, void *data);
+static ssize_t read_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t recv_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t recvfrom_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t readv_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t recvmsg_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+#if __linux__
+static void epoll_rearm(int fd, uint32_t events);
+static epoll_reg_t *epoll_reg(fd_state_t *epst, int fd);
+static epoll_reg_t *epoll_reg_alloc(fd_state_t *epst, int fd);
+static void epoll_queue_push(fd_state_t *epst, int fd, fd_state_t *st);
+static void epoll_mask(int epfd, fd_state_t *epst, epoll_masks_t *m,
+    struct epoll_event *events, int n, int ms);
+static void epoll_unmask(int epfd, fd_state_t *epst, epoll_masks_t *m);
+static void epoll_mask_drop(epoll_masks_t *m, int fd);
+static ssize_t sendfile_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t sendfile64_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t splice_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static unsigned int mock_batch_size(fd_state_t *st, unsigned int vlen);
+static ssize_t recvmmsg_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+static ssize_t sendmmsg_op(int fd, const struct iovec *iov, int iovcnt,
+    void *data);
+#endif
+#if (HAVE_COPY_FILE_RANGE)
+static ssize_t copy_file_range_op(int fd, const struct iovec *iov,
+    int iovcnt, void *data);
+#endif
+
+
+/*
+ * The original functions are all looked up by the library constructor.
+ * The constructors of other libraries may still call into us before that
+ * though, so until then the pointers refer to stubs doing the lookup on
+ * the spot; this keeps any NULL checks out of the wrappers.
+ */
+
+static void resolve_origs();
+
+#define orig_stub(name, ret, params, args)                                   \
+    static ret name##_stub params                                            \
+    {                                                                        \
+        resolve_origs();                                                     \
+        return orig_##name args;                                             \
+    }
+
+static socket_handle orig_socket;
+static connect_handle orig_connect;
+static poll_handle orig_poll;
+static select_handle orig_select;
+static pselect_handle orig_pselect;
+static writev_handle orig_writev;
+static write_handle orig_write;
+static close_handle orig_close;
+static send_handle orig_send;
+static sendto_handle orig_sendto;
+static sendmsg_handle orig_sendmsg;
+static read_handle orig_read;
+static recv_handle orig_recv;
+static recvfrom_handle orig_recvfrom;
+static readv_handle orig_readv;
+static recvmsg_handle orig_recvmsg;
+static setenv_handle orig_setenv;
+static unsetenv_handle orig_unsetenv;
+static putenv_handle orig_putenv;
+#if __linux__
+static accept4_handle orig_accept4;
+static ppoll_handle orig_ppoll;
+static signalfd_handle orig_signalfd;
+static eventfd_handle orig_eventfd;
+static epoll_create_handle orig_epoll_create;
+static epoll_create1_handle orig_epoll_create1;
+static epoll_ctl_handle orig_epoll_ctl;
+static epoll_pwait_handle orig_epoll_pwait;
+static sendfile_handle orig_sendfile;
+static sendfile64_handle orig_sendfile64;
+static splice_handle orig_splice;
+static recvmmsg_handle orig_recvmmsg;
+static sendmmsg_handle orig_sendmmsg;
+#endif
+#if (HAVE_COPY_FILE_RANGE)
+static copy_file_range_handle orig_copy_file_range;
+#endif
+
+orig_stub(socket, int, (int domain, int type, int protocol),
+          (domain, type, protocol))
+orig_stub(connect, int, (int fd, const struct sockaddr *addr,
+          socklen_t addrlen), (fd, addr, addrlen))
+orig_stub(poll, int, (struct pollfd *ufds, nfds_t nfds, int timeout),
+          (ufds, nfds, timeout))
+orig_stub(select, int, (int nfds, fd_set *readfds, fd_set *writefds,
+          fd_set *exceptfds, struct timeval *timeout),
+          (nfds, readfds, writefds, exceptfds, timeout))
+orig_stub(pselect, int, (int nfds, fd_set *readfds, fd_set *writefds,
+          fd_set *exceptfds, const struct timespec *timeout,
+          const sigset_t *sigmask),
+          (nfds, readfds, writefds, exceptfds, timeout, sigmask))
+orig_stub(writev, ssize_t, (int fd, const struct iovec *iov, int iovcnt),
+          (fd, iov, iovcnt))
+orig_stub(write, ssize_t, (int fd, const void *buf, size_t len),
+          (fd, buf, len))
+orig_stub(close, int, (int fd), (fd))
+orig_stub(send, ssize_t, (int fd, const void *buf, size_t len, int flags),
+          (fd, buf, len, flags))
+orig_stub(sendto, ssize_t, (int fd, const void *buf, size_t len, int flags,
+          const struct sockaddr *dest_addr, socklen_t addrlen),
+          (fd, buf, len, flags, dest_addr, addrlen))
+orig_stub(sendmsg, ssize_t, (int fd, const struct msghdr *msg, int flags),
+          (fd, msg, flags))
+orig_stub(read, ssize_t, (int fd, void *buf, size_t len), (fd, buf, len))
+orig_stub(recv, ssize_t, (int fd, void *buf, size_t len, int flags),
+          (fd, buf, len, flags))
+orig_stub(recvfrom, ssize_t, (int fd, void *buf, size_t len, int flags,
+          struct sockaddr *src_addr, socklen_t *addrlen),
+          (fd, buf, len, flags, src_addr, addrlen))
+orig_stub(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt),
+          (fd, iov, iovcnt))
+orig_stub(recvmsg, ssize_t, (int fd, struct msghdr *msg, int flags),
+          (fd, msg, flags))
+orig_stub(setenv, int, (const char *name, const char *value, int overwrite),
+          (name, value, overwrite))
+orig_stub(unsetenv, int, (const char *name), (name))
+orig_stub(putenv, int, (char *string), (string))
+#if __linux__
+orig_stub(accept4, int, (int socket, struct sockaddr *address,
+          socklen_t *address_len, int flags),
+          (socket, address, address_len, flags))
+orig_stub(ppoll, int, (struct pollfd *ufds, nfds_t nfds,
+          const struct timespec *tmo_p, const sigset_t *sigmask),
+          (ufds, nfds, tmo_p, sigmask))
+orig_stub(signalfd, int, (int fd, const sigset_t *mask, int flags),
+          (fd, mask, flags))
+#if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
+    (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 21)
+orig_stub(eventfd, int, (int initval, int flags), (initval, flags))
+#else
+orig_stub(eventfd, int, (unsigned int initval, int flags), (initval, flags))
+#endif
+orig_stub(epoll_create, int, (int size), (size))
+orig_stub(epoll_create1, int, (int flags), (flags))
+orig_stub(epoll_ctl, int, (int epfd, int op, int fd,
+          struct epoll_event *event), (epfd, op, fd, event))
+orig_stub(epoll_pwait, int, (int epfd, struct epoll_event *events,
+          int maxevents, int timeout, const sigset_t *sigmask),
+          (epfd, events, maxevents, timeout, sigmask))
+orig_stub(sendfile, ssize_t, (int out_fd, int in_fd, off_t *offset,
+          size_t count), (out_fd, in_fd, offset, count))
+orig_stub(sendfile64, ssize_t, (int out_fd, int in_fd, off64_t *offset,
+          size_t count), (out_fd, in_fd, offset, count))
+orig_stub(splice, ssize_t, (int fd_in, loff_t *off_in, int fd_out,
+          loff_t *off_out, size_t len, unsigned int flags),
+          (fd_in, off_in, fd_out, off_out, len, flags))
+#if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
+    (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 21)
+orig_stub(recvmmsg, int, (int fd, struct mmsghdr *msgvec, unsigned int vlen,
+          int flags, const struct timespec *timeout),
+          (fd, msgvec, vlen, flags, timeout))
+#else
+orig_stub(recvmmsg, int, (int fd, struct mmsghdr *msgvec, unsigned int vlen,
+          int flags, struct timespec *timeout),
+          (fd, msgvec, vlen, flags, timeout))
+#endif
+orig_stub(sendmmsg, int, (int fd, struct mmsghdr *msgvec, unsigned int vlen,
+          int flags), (fd, msgvec, vlen, flags))
+#endif
+#if (HAVE_COPY_FILE_RANGE)
+orig_stub(copy_file_range, ssize_t, (int fd_in, loff_t *off_in, int fd_out,
+          loff_t *off_out, size_t len, unsigned int flags),
+          (fd_in, off_in, fd_out, off_out, len, flags))
+#endif
+
+
+#define resolve_orig(name)                                                   \
+    do {                                                                     \
+        void    *sym = dlsym(RTLD_NEXT, #name);                              \
+                                                                             \
+        if (sym == NULL) {                                                   \
+            fprintf(stderr, "mockeagain: could not find the underlying "     \
+                    #name ": %s\n", dlerror());                              \
+            exit(1);                                                         \
+        }                                                                    \
+                                                                             \
+        __atomic_store_n((void **) &orig_##name, sym, __ATOMIC_RELEASE);     \
+    } while (0)
+
+
+static void
+resolve_origs()
+{
+    resolve_orig(socket);
+    resolve_orig(connect);
+    resolve_orig(poll);
+    resolve_orig(select);
+    resolve_orig(pselect);
+    resolve_orig(writev);
+    resolve_orig(write);
+    resolve_orig(close);
+    resolve_orig(send);
+    resolve_orig(sendto);
+    resolve_orig(sendmsg);
+    resolve_orig(read);
+    resolve_orig(recv);
+    resolve_orig(recvfrom);
+    resolve_orig(readv);
+    resolve_orig(recvmsg);
+    resolve_orig(setenv);
+    resolve_orig(unsetenv);
+    resolve_orig(putenv);
+#if __linux__
+    resolve_orig(accept4);
+    resolve_orig(ppoll);
+    resolve_orig(signalfd);
+    resolve_orig(eventfd);
+    resolve_orig(epoll_create);
+    resolve_orig(epoll_create1);
+    resolve_orig(epoll_ctl);
+    resolve_orig(epoll_pwait);
+    resolve_orig(sendfile);
+    resolve_orig(sendfile64);
+    resolve_orig(splice);
+    resolve_orig(recvmmsg);
+    resolve_orig(sendmmsg);
+#endif
+#if (HAVE_COPY_FILE_RANGE)
+    resolve_orig(copy_file_range);
+#endif
+}
+
+
+/* until the constructor has run */
+static socket_handle orig_socket = socket_stub;
+static connect_handle orig_connect = connect_stub;
+static poll_handle orig_poll = poll_stub;
+static select_handle orig_select = select_stub;
+static pselect_handle orig_pselect = pselect_stub;
+static writev_handle orig_writev = writev_stub;
+static write_handle orig_write = write_stub;
+static close_handle orig_close = close_stub;
+static send_handle orig_send = send_stub;
+static sendto_handle orig_sendto = sendto_stub;
+static sendmsg_handle orig_sendmsg = sendmsg_stub;
+static read_handle orig_read = read_stub;
+static recv_handle orig_recv = recv_stub;
+static recvfrom_handle orig_recvfrom = recvfrom_stub;
+static readv_handle orig_readv = readv_stub;
+static recvmsg_handle orig_recvmsg = recvmsg_stub;
+static setenv_handle orig_setenv = setenv_stub;
+static unsetenv_handle orig_unsetenv = unsetenv_stub;
+static putenv_handle orig_putenv = putenv_stub;
+#if __linux__
+static accept4_handle orig_accept4 = accept4_stub;
+static ppoll_handle orig_ppoll = ppoll_stub;
+static signalfd_handle orig_signalfd = signalfd_stub;
+static eventfd_handle orig_eventfd = eventfd_stub;
+static epoll_create_handle orig_epoll_create = epoll_create_stub;
+static epoll_create1_handle orig_epoll_create1 = epoll_create1_stub;
+static epoll_ctl_handle orig_epoll_ctl = epoll_ctl_stub;
+static epoll_pwait_handle orig_epoll_pwait = epoll_pwait_stub;
+static sendfile_handle orig_sendfile = sendfile_stub;
+static sendfile64_handle orig_sendfile64 = sendfile64_stub;
+static splice_handle orig_splice = splice_stub;
+static recvmmsg_handle orig_recvmmsg = recvmmsg_stub;
+static sendmmsg_handle orig_sendmmsg = sendmmsg_stub;
+#endif
+#if (HAVE_COPY_FILE_RANGE)
+static copy_file_range_handle orig_copy_file_range = copy_file_range_stub;
+#endif
+
+
+static void mockeagain_init() __attribute__((constructor));
+
+
+static void
+mockeagain_init()
+{
+    resolve_origs();
+    load_conf();
+
+    (void) pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+
+static void
+fork_prepare()
+{
+    /* no settings are reloaded halfway through a fork */
+    pthread_mutex_lock(&conf_lock);
+}
+
+
+static void
+fork_parent()
+{
+    pthread_mutex_unlock(&conf_lock);
+}
 
 
+static void
+fork_child()
+{
+    pthread_mutex_init(&conf_lock, NULL);
 #if __linux__
+    pthread_mutex_init(&epoll_lock, NULL);
+#endif
+
+    /* a forked child writes to a trace file of its own */
+    __atomic_store_n(&trace_file, NULL, __ATOMIC_RELEASE);
+    trace_owner = NULL;
+
+    load_trace(get_verbose_level());
+
+    /* and counts into a slot of its own */
+    stats_claim(stats_file, get_verbose_level());
+
+    /* and records into a file of its own */
+    __atomic_store_n(&record_file, NULL, __ATOMIC_RELEASE);
+
+    load_record(get_verbose_level());
+
+    /* and watches the control file with a thread of its own */
+    pthread_mutex_init(&control_lock, NULL);
+    __atomic_store_n(&control_watching, 0, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&control_path, __ATOMIC_ACQUIRE)) {
+        control_watch();
+    }
+}
+
+
+/*
+ * The settings are read once by the library constructor. Changes that the
+ * process itself makes to our environment variables afterwards, like test
+ * harnesses do, are picked up right away.
+ */
+
+#define is_conf_env(name)                                                    \
+    (strncmp(name, "MOCKEAGAIN", sizeof("MOCKEAGAIN") - 1) == 0)
+
+
 int
-accept4(int socket, struct sockaddr *address,
-    socklen_t *address_len, int flags)
+setenv(const char *name, const char *value, int overwrite)
 {
-    int fd;
+    int                 rc;
 
-    static accept4_handle       orig_accept4 = NULL;
+    rc = (*orig_setenv)(name, value, overwrite);
 
-    init_libc_handle();
+    if (rc == 0 && is_conf_env(name)) {
+        load_conf();
+    }
 
-    if (orig_accept4 == NULL) {
-        orig_accept4 = dlsym(libc_handle, "accept4");
-        if (orig_accept4 == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying accept4: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+    return rc;
+}
+
+
+int
+unsetenv(const char *name)
+{
+    int                 rc;
+
+    rc = (*orig_unsetenv)(name);
+
+    if (rc == 0 && is_conf_env(name)) {
+        load_conf();
+    }
+
+    return rc;
+}
+
+
+int
+putenv(char *string)
+{
+    int                 rc;
+
+    rc = (*orig_putenv)(string);
+
+    if (rc == 0 && is_conf_env(string)) {
+        load_conf();
     }
 
+    return rc;
+}
+
+
+#if __linux__
+int
+accept4(int socket, struct sockaddr *address,
+    socklen_t *address_len, int flags)
+{
+    int                         fd;
+    fd_state_t                 *st;
+
     fd = orig_accept4(socket, address, address_len, flags);
     if (fd < 0) {
         return fd;
     }
 
     if (flags & SOCK_NONBLOCK) {
-        if (matchbufs && matchbufs[fd]) {
-            free(matchbufs[fd]);
-            matchbufs[fd] = NULL;
+        st = fd_state_alloc(fd);
+        if (st) {
+            fd_state_reset(st);
+            fd_seed(st);
+            fd_set_flags(st, FD_POLLED);
         }
+    }
 
-        active_fds[fd] = 0;
-        polled_fds[fd] = 1;
-        snd_timeout_fds[fd] = 0;
+    if (get_target_conf()) {
+        st = fd_state_alloc(fd);
+        if (st) {
+            __atomic_fetch_or(&st->mocking, FD_TARGET_ACCEPTED,
+                              __ATOMIC_RELAXED);
+            (void) target_decide(fd, st, NULL, 0);
+        }
     }
 
+    conn_assign(fd, FD_TARGET_ACCEPTED);
+
     return fd;
 }
 
 
 int signalfd(int fd, const sigset_t *mask, int flags)
 {
-    static signalfd_handle       orig_signalfd = NULL;
-
-    init_libc_handle();
-
-    if (orig_signalfd == NULL) {
-        orig_signalfd = dlsym(libc_handle, "signalfd");
-        if (orig_signalfd == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying"
-                    " signalfd: %s\n", dlerror());
-            exit(1);
-        }
-    }
+    fd_state_t                  *st;
 
     fd = orig_signalfd(fd, mask, flags);
-    if (fd < 0) {
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
         return fd;
     }
 
@@ -167,7 +1301,8 @@ int signalfd(int fd, const sigset_t *mask, int flags)
         fprintf(stderr, "mockeagain: signalfd: blacklist fd %d\n", fd);
     }
 
-    blacklist_fds[fd] = 1;
+    fd_state_reset(st);
+    fd_set_flags(st, FD_BLACKLIST);
 
     return fd;
 }
@@ -182,21 +1317,12 @@ int eventfd(unsigned int initval, int flags)
 #endif
 {
     int                         fd;
-    static eventfd_handle       orig_eventfd = NULL;
-
-    init_libc_handle();
-
-    if (orig_eventfd == NULL) {
-        orig_eventfd = dlsym(libc_handle, "eventfd");
-        if (orig_eventfd == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying"
-                    " eventfd: %s\n", dlerror());
-            exit(1);
-        }
-    }
+    fd_state_t                 *st;
 
     fd = orig_eventfd(initval, flags);
-    if (fd < 0) {
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
         return fd;
     }
 
@@ -204,7 +1330,8 @@ int eventfd(unsigned int initval, int flags)
         fprintf(stderr, "mockeagain: eventfd: blacklist fd %d\n", fd);
     }
 
-    blacklist_fds[fd] = 1;
+    fd_state_reset(st);
+    fd_set_flags(st, FD_BLACKLIST);
 
     return fd;
 }
@@ -214,47 +1341,29 @@ int eventfd(unsigned int initval, int flags)
 int socket(int domain, int type, int protocol)
 {
     int                        fd;
-    static socket_handle       orig_socket = NULL;
+    fd_state_t                *st;
 
     dd("calling my socket");
 
-    init_libc_handle();
-
-    if (orig_socket == NULL) {
-        orig_socket = dlsym(libc_handle, "socket");
-        if (orig_socket == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying socket: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
-    }
-
-    init_matchbufs();
-
     fd = (*orig_socket)(domain, type, protocol);
 
     dd("socket with type %d (SOCK_STREAM %d, SOCK_DGRAM %d)", type,
             SOCK_STREAM, SOCK_DGRAM);
 
-    if (fd <= MAX_FD) {
+    st = fd_state_alloc(fd);
+    if (st) {
+        fd_state_reset(st);
+        fd_seed(st);
+
         if (!(type & SOCK_STREAM)) {
             dd("socket: the current fd is weird: %d", fd);
-            weird_fds[fd] = 1;
-
-        } else {
-            weird_fds[fd] = 0;
+            fd_set_flags(st, FD_WEIRD);
         }
 
-#if 1
-        if (matchbufs && matchbufs[fd]) {
-            free(matchbufs[fd]);
-            matchbufs[fd] = NULL;
+        /* without the SOCK_NONBLOCK and SOCK_CLOEXEC flags of Linux */
+        if ((type & 0xf) == SOCK_DGRAM) {
+            fd_set_flags(st, FD_DGRAM);
         }
-#endif
-
-        active_fds[fd] = 0;
-        polled_fds[fd] = 0;
-        snd_timeout_fds[fd] = 0;
     }
 
     dd("socket returning %d", fd);
@@ -263,705 +1372,6586 @@ int socket(int domain, int type, int protocol)
 }
 
 
+/*
+ * In the latency mode a connect completes one round trip after it was
+ * made, which is when the fd can be reported writable.
+ */
+
 int
-poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+connect(int fd, const struct sockaddr *addr, socklen_t addrlen)
 {
-    static void             *libc_handle;
-    int                      retval;
-    static poll_handle       orig_poll = NULL;
-    struct pollfd           *p;
-    int                      i;
-    int                      fd = -1;
-    int                      begin = 0;
-    int                      elapsed = 0;
+    int                        rc;
+    fd_state_t                *st;
+
+    rc = (*orig_connect)(fd, addr, addrlen);
+
+    if ((rc == 0 || errno == EINPROGRESS) && get_target_conf()) {
+        st = fd_state_alloc(fd);
+        if (st) {
+            /* the peer is not known to the kernel until connected */
+            __atomic_fetch_or(&st->mocking, FD_TARGET_CONNECTED,
+                              __ATOMIC_RELAXED);
+            (void) target_decide(fd, st, addr, addrlen);
+        }
+    }
 
-    dd("calling my poll");
+    if (rc == 0 || errno == EINPROGRESS) {
+        st = fd_state(fd);
+
+        if (st == NULL || !(fd_flags(st) & FD_WEIRD)) {
+            conn_assign(fd, FD_TARGET_CONNECTED);
+        }
+    }
 
-    init_libc_handle();
+    if ((rc == 0 || errno == EINPROGRESS)
+        && (fd_mocking_type(fd) & MOCKING_WRITES)
+        && get_latency())
+    {
+        st = fd_state_alloc(fd);
 
-    if (orig_poll == NULL) {
-        orig_poll = dlsym(libc_handle, "poll");
-        if (orig_poll == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying poll: "
-                    "%s\n", dlerror());
-            exit(1);
+        if (st && !(fd_flags(st) & FD_WEIRD)) {
+            st->connected_at = now_ns() + delay_ns(st, get_latency());
         }
     }
 
-    init_matchbufs();
+    return rc;
+}
+
 
-    dd("calling the original poll");
+/*
+ * Applies the poll() bookkeeping to the events reported for a single fd by
+ * any of the event interfaces and returns the events that should be passed
+ * on to the caller. The events withheld only for a while lower *wait to the
+ * number of milliseconds until they can be reported. All the events withheld
+ * are left in st->held, for the event wrappers to mask them while they wait
+ * for the others.
+ */
+
+static int
+mock_revents(unsigned call, int fd, int revents, int *wait)
+{
+    int                  ms, type, in;
+    fd_state_t          *st;
+
+    type = fd_mocking_type(fd);
+
+    if (type == 0) {
+        return revents;
+    }
 
-    if (pattern) {
-        begin = now();
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        return revents;
     }
 
-    retval = (*orig_poll)(ufds, nfds, timeout);
+    in = revents;
 
-    if (pattern) {
-        elapsed = now() - begin;
+    if (fd_flags(st) & FD_WEIRD) {
+        dd("skipping fd %d", fd);
+        goto done;
     }
 
-    if (retval > 0) {
-        struct timeval  tm;
+    if ((revents & POLLOUT) && (fd_flags(st) & FD_SND_TIMEOUT)) {
 
-        p = ufds;
-        for (i = 0; i < nfds; i++, p++) {
-            fd = p->fd;
-            if (fd > MAX_FD || weird_fds[fd]) {
-                dd("skipping fd %d", fd);
-                continue;
-            }
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: %s: should suppress write "
+                    "event on fd %d.\n", call_name(call), fd);
+        }
 
-            if (pattern && (p->revents & POLLOUT) && snd_timeout_fds[fd]) {
+        revents &= ~POLLOUT;
 
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: poll: should suppress write "
-                            "event on fd %d.\n", fd);
-                }
+        if (revents == 0) {
+            goto done;
+        }
+    }
 
-                p->revents &= ~POLLOUT;
+    if ((revents & POLLIN) && (fd_flags(st) & FD_RCV_TIMEOUT)) {
 
-                if (p->revents == 0) {
-                    retval--;
-                    continue;
-                }
-            }
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: %s: should suppress read "
+                    "event on fd %d.\n", call_name(call), fd);
+        }
 
-            if (blacklist_fds[fd]) {
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: poll: skip fd %d because it "
-                            "is in blacklist\n", fd);
-                }
+        revents &= ~POLLIN;
 
-                continue;
-            }
+        if (revents == 0) {
+            goto done;
+        }
+    }
 
-            active_fds[fd] = p->revents;
-            polled_fds[fd] = 1;
+    if (fd_scheduled(st)) {
+        revents = schedule_revents(st, revents, wait);
+        goto done;
+    }
 
-            if (get_verbose_level()) {
-                fprintf(stderr, "mockeagain: poll: fd %d polled with events "
-                        "%d\n", fd, p->revents);
-            }
+    if (fd_flags(st) & FD_BLACKLIST) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: %s: skip fd %d because it "
+                    "is in blacklist\n", call_name(call), fd);
+        }
+
+        goto done;
+    }
+
+    if ((revents & POLLIN)
+        && (type & MOCKING_READS)
+        && get_latency())
+    {
+        /* the data pending has arrived just now as far as we know */
+        if (st->readable_at == 0) {
+            st->readable_at = now_ns() + delay_ns(st, get_latency());
+        }
+
+        ms = ms_until(st->readable_at);
+
+        if (ms > 0) {
+            if (get_verbose_level()) {
+                fprintf(stderr, "mockeagain: %s: withholding read event "
+                        "on fd %d for %d ms.\n", call_name(call), fd, ms);
+            }
+
+            revents &= ~POLLIN;
+
+            if (*wait < 0 || ms < *wait) {
+                *wait = ms;
+            }
+
+            if (revents == 0) {
+                goto done;
+            }
+        }
+    }
+
+    if ((revents & POLLOUT) && (type & MOCKING_WRITES)) {
+        ms = 0;
+
+        if (st->connected_at) {
+            ms = ms_until(st->connected_at);
+
+            if (ms == 0) {
+                st->connected_at = 0;
+            }
+        }
+
+        if (ms == 0) {
+            ms = write_shaping_wait(st);
+        }
+
+        if (ms > 0) {
+            if (get_verbose_level()) {
+                fprintf(stderr, "mockeagain: %s: withholding write event "
+                        "on fd %d for %d ms.\n", call_name(call), fd, ms);
+            }
+
+            revents &= ~POLLOUT;
+
+            if (*wait < 0 || ms < *wait) {
+                *wait = ms;
+            }
+
+            if (revents == 0) {
+                goto done;
+            }
+        }
+    }
+
+    fd_set_active(st, (short) revents);
+    fd_set_flags(st, FD_POLLED);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: %s: fd %d polled with events "
+                "%d\n", call_name(call), fd, revents);
+    }
+
+done:
+
+    st->held = (short) (in & ~revents);
+
+    return revents;
+}
+
+
+static int
+mock_poll_events(unsigned call, struct pollfd *ufds, nfds_t nfds,
+    int retval, int *last_fd, int *wait)
+{
+    short                    revents;
+    struct pollfd           *p;
+    nfds_t                   i;
+
+    p = ufds;
+    for (i = 0; i < nfds; i++, p++) {
+        *last_fd = p->fd;
+
+        if (p->revents == 0) {
+            /* mark the fd as polled but not ready */
+            mock_revents(call, p->fd, 0, wait);
+            continue;
+        }
+
+        revents = p->revents;
+        p->revents = (short) mock_revents(call, p->fd, revents, wait);
+
+        if (p->revents != revents) {
+            probe4(poll, call_name(call), p->fd, revents, p->revents);
+            trace(call, p->fd, revents, p->revents,
+                  MOCKEAGAIN_TRACE_WITHHELD);
+        }
+
+        if (p->revents == 0) {
+            retval--;
+        }
+    }
+
+    return retval;
+}
+
+
+/*
+ * Masks the events withheld by the last poll in a copy of the pollfds, on
+ * which the original call waits for the other events until the withheld
+ * ones are due in ms milliseconds.
+ */
+
+static struct pollfd *
+poll_mask(struct pollfd *ufds, struct pollfd *pfds, nfds_t nfds, int ms)
+{
+    nfds_t                   i;
+    fd_state_t              *st;
+    struct timespec          ts;
+
+    if (pfds == ufds) {
+        pfds = malloc(nfds * sizeof(struct pollfd));
+
+        if (pfds == NULL) {
+            /* too bad, the other events can only wait as well */
+            nanosleep(ms_to_timespec(ms, &ts), NULL);
+            return ufds;
+        }
+
+        memcpy(pfds, ufds, nfds * sizeof(struct pollfd));
+    }
+
+    for (i = 0; i < nfds; i++) {
+        if (fd_mocking_type(ufds[i].fd) == 0) {
+            continue;
+        }
+
+        st = fd_state(ufds[i].fd);
+        if (st) {
+            pfds[i].events &= ~st->held;
+        }
+    }
+
+    return pfds;
+}
+
+
+/* copies the events reported on the masked pollfds back to the caller's */
+
+static void
+poll_unmask(struct pollfd *ufds, struct pollfd *pfds, nfds_t nfds)
+{
+    nfds_t                   i;
+
+    for (i = 0; i < nfds; i++) {
+        ufds[i].revents = pfds[i].revents;
+    }
+}
+
+
+int
+poll(struct pollfd *ufds, nfds_t nfds, int timeout)
+{
+    int                      retval;
+    int                      fd = -1;
+    int                      begin, due;
+    int                      wait;
+    struct pollfd           *pfds;
+
+    dd("calling my poll");
+
+    if (!mocking_any()) {
+        return (*orig_poll)(ufds, nfds, timeout);
+    }
+
+    dd("calling the original poll");
+
+    begin = now();
+    due = -1;
+    pfds = ufds;
+
+    for ( ;; ) {
+        if (due >= 0 && ms_since(begin) >= due) {
+            /* the withheld events are due, so poll for them again */
+            if (pfds != ufds) {
+                free(pfds);
+                pfds = ufds;
+            }
+
+            due = -1;
+        }
+
+        retval = (*orig_poll)(pfds, nfds, event_timeout(timeout, begin, due));
+
+        if (pfds != ufds) {
+            poll_unmask(ufds, pfds, nfds);
+        }
+
+        if (retval == 0 && time_left(timeout, begin)) {
+            /* woken up for the held datagrams or the withheld events */
+            continue;
+        }
+
+        if (retval <= 0) {
+            if (retval == 0 && due >= 0) {
+                count_timeout(CALL_POLL, fd);
+            }
+
+            break;
+        }
+
+        wait = -1;
+        retval = mock_poll_events(CALL_POLL, ufds, nfds, retval, &fd, &wait);
+
+        if (retval > 0
+            || !wait_withheld(CALL_POLL, timeout, begin, wait, fd, &due))
+        {
+            break;
+        }
+
+        pfds = poll_mask(ufds, pfds, nfds, event_timeout(timeout, begin, due));
+    }
+
+    if (pfds != ufds) {
+        free(pfds);
+    }
+
+    return retval;
+}
+
+
+#if __linux__
+int
+ppoll(struct pollfd *ufds, nfds_t nfds, const struct timespec *tmo_p,
+    const sigset_t *sigmask)
+{
+    int                      retval;
+    int                      fd = -1;
+    int                      begin, timeout, due;
+    int                      wait;
+    struct pollfd           *pfds;
+    struct timespec          ts;
+
+    dd("calling my ppoll");
+
+    if (!mocking_any()) {
+        return (*orig_ppoll)(ufds, nfds, tmo_p, sigmask);
+    }
+
+    begin = now();
+    timeout = timespec_to_ms(tmo_p);
+    due = -1;
+    pfds = ufds;
+
+    for ( ;; ) {
+        if (due >= 0 && ms_since(begin) >= due) {
+            if (pfds != ufds) {
+                free(pfds);
+                pfds = ufds;
+            }
+
+            due = -1;
+        }
+
+        retval = (*orig_ppoll)(pfds, nfds,
+                               ms_to_timespec(event_timeout(timeout, begin,
+                                                            due),
+                                              &ts),
+                               sigmask);
+
+        if (pfds != ufds) {
+            poll_unmask(ufds, pfds, nfds);
+        }
+
+        if (retval == 0 && time_left(timeout, begin)) {
+            continue;
+        }
+
+        if (retval <= 0) {
+            if (retval == 0 && due >= 0) {
+                count_timeout(CALL_PPOLL, fd);
+            }
+
+            break;
+        }
+
+        wait = -1;
+        retval = mock_poll_events(CALL_PPOLL, ufds, nfds, retval, &fd, &wait);
+
+        if (retval > 0
+            || !wait_withheld(CALL_PPOLL, timeout, begin, wait, fd, &due))
+        {
+            break;
+        }
+
+        pfds = poll_mask(ufds, pfds, nfds, event_timeout(timeout, begin, due));
+    }
+
+    if (pfds != ufds) {
+        free(pfds);
+    }
+
+    return retval;
+}
+#endif
+
+
+static int
+mock_select_events(unsigned call, int nfds, fd_set *readfds,
+    fd_set *writefds, fd_set *exceptfds, int retval, int *last_fd, int *wait,
+    fd_set *rmask, fd_set *wmask)
+{
+    int                      fd;
+    int                      revents, passed;
+
+    for (fd = 0; fd < nfds; fd++) {
+        revents = 0;
+
+        if (readfds && FD_ISSET(fd, readfds)) {
+            revents |= POLLIN;
+        }
+
+        if (writefds && FD_ISSET(fd, writefds)) {
+            revents |= POLLOUT;
+        }
+
+        if (exceptfds && FD_ISSET(fd, exceptfds)) {
+            revents |= POLLPRI;
+        }
+
+        if (revents == 0) {
+            continue;
+        }
+
+        *last_fd = fd;
+
+        /* the events suppressed, each of them counted in retval */
+        passed = mock_revents(call, fd, revents, wait);
+
+        if (passed != revents) {
+            probe4(poll, call_name(call), fd, revents, passed);
+            trace(call, fd, revents, passed, MOCKEAGAIN_TRACE_WITHHELD);
+        }
+
+        revents &= ~passed;
+
+        if (revents & POLLIN) {
+            FD_CLR(fd, readfds);
+            FD_CLR(fd, rmask);
+            retval--;
+        }
+
+        if (revents & POLLOUT) {
+            FD_CLR(fd, writefds);
+            FD_CLR(fd, wmask);
+            retval--;
+        }
+    }
+
+    return retval;
+}
+
+
+/*
+ * The fd sets are updated in place, so we need a copy to poll again, and
+ * another one with the events withheld masked until they are due.
+ */
+
+#define save_fd_sets()                                                       \
+    if (readfds) { rfds = *readfds; mrfds = rfds; }                          \
+    if (writefds) { wfds = *writefds; mwfds = wfds; }                        \
+    if (exceptfds) { efds = *exceptfds; }
+
+#define restore_fd_sets()                                                    \
+    if (due >= 0 && ms_since(begin) >= due) {                                \
+        if (readfds) { mrfds = rfds; }                                       \
+        if (writefds) { mwfds = wfds; }                                      \
+        due = -1;                                                            \
+    }                                                                        \
+    if (readfds) { *readfds = mrfds; }                                       \
+    if (writefds) { *writefds = mwfds; }                                     \
+    if (exceptfds) { *exceptfds = efds; }
+
+
+int
+select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+    struct timeval *timeout)
+{
+    int                      retval;
+    int                      fd = -1;
+    int                      begin, ms, left, due;
+    int                      wait;
+    fd_set                   rfds, wfds, efds, mrfds, mwfds;
+    struct timeval           tv;
+
+    dd("calling my select");
+
+    if (!mocking_any()) {
+        return (*orig_select)(nfds, readfds, writefds, exceptfds, timeout);
+    }
+
+    begin = now();
+    ms = -1;
+
+    if (timeout) {
+        /* Linux updates the timeout in place */
+        ms = timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+    }
+
+    due = -1;
+
+    save_fd_sets();
+
+    for ( ;; ) {
+        left = event_timeout(ms, begin, due);
+
+        if (left >= 0) {
+            tv.tv_sec = left / 1000;
+            tv.tv_usec = left % 1000 * 1000;
+        }
+
+        retval = (*orig_select)(nfds, readfds, writefds, exceptfds,
+                                left >= 0 ? &tv : NULL);
+
+        if (retval == 0 && time_left(ms, begin)) {
+            /* woken up for the held datagrams or the withheld events */
+            restore_fd_sets();
+            continue;
+        }
+
+        if (retval <= 0) {
+            if (retval == 0 && due >= 0) {
+                count_timeout(CALL_SELECT, fd);
+            }
+
+            break;
+        }
+
+        wait = -1;
+        retval = mock_select_events(CALL_SELECT, nfds, readfds, writefds,
+                                    exceptfds, retval, &fd, &wait,
+                                    &mrfds, &mwfds);
+
+        if (retval > 0
+            || !wait_withheld(CALL_SELECT, ms, begin, wait, fd, &due))
+        {
+            break;
+        }
+
+        restore_fd_sets();
+    }
+
+#if __linux__
+    if (timeout) {
+        left = time_left(ms, begin);
+
+        timeout->tv_sec = left / 1000;
+        timeout->tv_usec = left % 1000 * 1000;
+    }
+#endif
+
+    return retval;
+}
+
+
+int
+pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+    const struct timespec *timeout, const sigset_t *sigmask)
+{
+    int                      retval;
+    int                      fd = -1;
+    int                      begin, ms, due;
+    int                      wait;
+    fd_set                   rfds, wfds, efds, mrfds, mwfds;
+    struct timespec          ts;
+
+    dd("calling my pselect");
+
+    if (!mocking_any()) {
+        return (*orig_pselect)(nfds, readfds, writefds, exceptfds, timeout,
+                               sigmask);
+    }
+
+    begin = now();
+    ms = timespec_to_ms(timeout);
+    due = -1;
+
+    save_fd_sets();
+
+    for ( ;; ) {
+        retval = (*orig_pselect)(nfds, readfds, writefds, exceptfds,
+                                 ms_to_timespec(event_timeout(ms, begin, due),
+                                                &ts),
+                                 sigmask);
+
+        if (retval == 0 && time_left(ms, begin)) {
+            restore_fd_sets();
+            continue;
+        }
+
+        if (retval <= 0) {
+            if (retval == 0 && due >= 0) {
+                count_timeout(CALL_PSELECT, fd);
+            }
+
+            return retval;
+        }
+
+        wait = -1;
+        retval = mock_select_events(CALL_PSELECT, nfds, readfds, writefds,
+                                    exceptfds, retval, &fd, &wait,
+                                    &mrfds, &mwfds);
+
+        if (retval > 0
+            || !wait_withheld(CALL_PSELECT, ms, begin, wait, fd, &due))
+        {
+            return retval;
+        }
+
+        restore_fd_sets();
+    }
+}
+
+
+#if __linux__
+int
+epoll_create(int size)
+{
+    int                          fd;
+    fd_state_t                  *st;
+
+    fd = orig_epoll_create(size);
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        return fd;
+    }
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: epoll_create: blacklist fd %d\n", fd);
+    }
+
+    fd_state_reset(st);
+    fd_set_flags(st, FD_BLACKLIST);
+
+    return fd;
+}
+
+
+int
+epoll_create1(int flags)
+{
+    int                          fd;
+    fd_state_t                  *st;
+
+    fd = orig_epoll_create1(flags);
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        return fd;
+    }
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: epoll_create1: blacklist fd %d\n", fd);
+    }
+
+    fd_state_reset(st);
+    fd_set_flags(st, FD_BLACKLIST);
+
+    return fd;
+}
+
+
+/*
+ * We always register the fd itself as the epoll data in the kernel so that
+ * epoll_wait() can map the events back to our per-fd state. The caller's
+ * own data is kept in the registrations of the epoll instance, and restored
+ * before returning, so an fd can be in several instances at once. The
+ * events withheld from an edge-triggered fd are re-delivered through the
+ * instance it was last added to or modified in.
+ */
+
+int
+epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    int                      rc;
+    fd_state_t              *st, *epst;
+    epoll_reg_t             *reg;
+    struct epoll_event       ev;
+
+    if (op == EPOLL_CTL_DEL || event == NULL) {
+        rc = orig_epoll_ctl(epfd, op, fd, event);
+
+        if (rc != 0 || op != EPOLL_CTL_DEL) {
+            return rc;
+        }
+
+        epst = fd_state(epfd);
+        reg = epst ? epoll_reg(epst, fd) : NULL;
+
+        if (reg) {
+            reg->registered = 0;
+        }
+
+        st = fd_state(fd);
+        if (st && st->epfd == epfd) {
+            fd_clear_flags(st, FD_EPOLL);
+            st->epoll_events = 0;
+            __atomic_store_n(&st->epoll_pending, 0, __ATOMIC_RELEASE);
+        }
+
+        return rc;
+    }
+
+    st = fd_state_alloc(fd);
+    epst = fd_state_alloc(epfd);
+
+    if (st == NULL || epst == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ev.events = event->events;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+
+    pthread_mutex_lock(&epoll_lock);
+
+    reg = epoll_reg_alloc(epst, fd);
+    if (reg == NULL) {
+        pthread_mutex_unlock(&epoll_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    rc = orig_epoll_ctl(epfd, op, fd, &ev);
+    if (rc != 0) {
+        pthread_mutex_unlock(&epoll_lock);
+        return rc;
+    }
+
+    reg->data = event->data;
+    reg->events = event->events;
+    reg->registered = 1;
+
+    pthread_mutex_unlock(&epoll_lock);
+
+    st->epoll_events = event->events;
+    st->epfd = epfd;
+    fd_set_flags(st, FD_EPOLL);
+
+    /* EPOLL_CTL_MOD makes the kernel re-evaluate the readiness by itself */
+    __atomic_store_n(&st->epoll_pending, 0, __ATOMIC_RELEASE);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: epoll_ctl: fd %d registered in epoll "
+                "fd %d with events %u%s\n", fd, epfd,
+                (unsigned) event->events,
+                (event->events & EPOLLET) ? " (edge-triggered)" : "");
+    }
+
+    return rc;
+}
+
+
+/* the registration of the fd in the epoll instance, if any */
+
+static epoll_reg_t *
+epoll_reg(fd_state_t *epst, int fd)
+{
+    epoll_regs_t        *regs;
+
+    regs = __atomic_load_n(&epst->epoll_regs, __ATOMIC_ACQUIRE);
+
+    if (regs == NULL || fd < 0 || fd >= regs->nregs
+        || !regs->regs[fd].registered)
+    {
+        return NULL;
+    }
+
+    return &regs->regs[fd];
+}
+
+
+/* the same, grown to hold the fd if need be, under epoll_lock */
+
+static epoll_reg_t *
+epoll_reg_alloc(fd_state_t *epst, int fd)
+{
+    int                  n;
+    epoll_regs_t        *regs, *old;
+
+    old = epst->epoll_regs;
+
+    if (old && fd < old->nregs) {
+        return &old->regs[fd];
+    }
+
+    n = old ? old->nregs * 2 : 64;
+    if (n <= fd) {
+        n = fd + 1;
+    }
+
+    regs = calloc(1, offsetof(epoll_regs_t, regs) + n * sizeof(epoll_reg_t));
+    if (regs == NULL) {
+        return NULL;
+    }
+
+    regs->nregs = n;
+
+    if (old) {
+        memcpy(regs->regs, old->regs, old->nregs * sizeof(epoll_reg_t));
+    }
+
+    /* the old table is leaked, as other threads may still read it */
+    __atomic_store_n(&epst->epoll_regs, regs, __ATOMIC_RELEASE);
+
+    return &regs->regs[fd];
+}
+
+
+static uint32_t
+mock_epoll_event(int epfd, int fd, uint32_t registered, uint32_t events,
+    int *wait)
+{
+    int             w;
+    uint32_t        mask, revents;
+    struct epoll_event  ev;
+
+    /* the EPOLL* event bits share their values with the POLL* ones */
+    mask = POLLIN|POLLPRI|POLLOUT|POLLERR|POLLHUP|POLLRDHUP;
+
+    w = -1;
+    revents = (events & ~mask)
+              | (uint32_t) mock_revents(CALL_EPOLL_WAIT, fd, events & mask,
+                                        &w);
+
+    if (revents != events) {
+        probe4(poll, "epoll_wait", fd, events, revents);
+        trace(CALL_EPOLL_WAIT, fd, events, revents, MOCKEAGAIN_TRACE_WITHHELD);
+    }
+
+    if (w >= 0) {
+        /* an edge-triggered fd will not see these events again otherwise */
+        epoll_rearm(fd, events & ~revents & mask);
+
+        if (*wait < 0 || w < *wait) {
+            *wait = w;
+        }
+
+        /*
+         * Nor will a oneshot fd that the kernel has disarmed on reporting
+         * the events, which are withheld again until they are due.
+         */
+        if (revents == 0 && (registered & EPOLLONESHOT)) {
+            ev.events = registered;
+            ev.data.u64 = 0;
+            ev.data.fd = fd;
+
+            (void) orig_epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+        }
+    }
+
+    return revents;
+}
+
+
+static int
+mock_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+    int timeout, const sigset_t *sigmask)
+{
+    int                         i, j, n, fd = -1;
+    int                         queued, suppressed;
+    int                         begin, wait, due;
+    uint32_t                    revents;
+    fd_state_t                 *st, *epst;
+    epoll_reg_t                *reg;
+    epoll_masks_t               masks;
+
+    epst = fd_state_alloc(epfd);
+
+    begin = now();
+    due = -1;
+
+    masks.nmasks = 0;
+    masks.nalloc = 0;
+    masks.masks = NULL;
+
+    for ( ;; ) {
+        suppressed = 0;
+        wait = -1;
+
+        if (due >= 0 && ms_since(begin) >= due) {
+            /* the withheld events are due, so wait for them again */
+            epoll_unmask(epfd, epst, &masks);
+            due = -1;
+        }
+
+        /*
+         * Take over all the fds queued for re-delivery at once, unless
+         * their events are still withheld.
+         */
+        queued = (epst && due < 0)
+                 ? __atomic_exchange_n(&epst->epoll_queue, 0, __ATOMIC_ACQ_REL)
+                 : 0;
+
+        n = orig_epoll_pwait(epfd, events, maxevents,
+                             queued ? 0 : event_timeout(timeout, begin, due),
+                             sigmask);
+
+        if (n < 0) {
+            while (queued) {
+                fd = queued - 1;
+                st = fd_state(fd);
+                queued = st->epoll_next;
+                epoll_queue_push(epst, fd, st);
+            }
+
+            break;
+        }
+
+        j = 0;
+
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+
+            reg = epst ? epoll_reg(epst, fd) : NULL;
+            if (reg == NULL) {
+                /* not registered through us */
+                events[j++] = events[i];
+                continue;
+            }
+
+            st = fd_state(fd);
+
+            if (st == NULL || !(fd_flags(st) & FD_EPOLL)) {
+                /*
+                 * The fd has been closed while its file stays registered
+                 * through another fd, which is left alone.
+                 */
+                events[j].events = events[i].events;
+                events[j].data = reg->data;
+                j++;
+                continue;
+            }
+
+            revents = events[i].events;
+
+            if (st->epfd == epfd) {
+                revents |= __atomic_exchange_n(&st->epoll_pending, 0,
+                                               __ATOMIC_ACQ_REL);
+            }
+
+            revents = mock_epoll_event(epfd, fd, reg->events, revents,
+                                       &wait);
+
+            if (revents == 0) {
+                suppressed = 1;
+                continue;
+            }
+
+            if (masks.nmasks && (reg->events & EPOLLONESHOT)) {
+                epoll_mask_drop(&masks, fd);
+            }
+
+            events[j].events = revents;
+            events[j].data = reg->data;
+            j++;
+        }
+
+        if (n == 0 && !queued) {
+            if (time_left(timeout, begin)) {
+                /* woken up for the held datagrams or the withheld events */
+                continue;
+            }
+
+            if (due >= 0) {
+                count_timeout(CALL_EPOLL_WAIT, fd);
+            }
+
+            break;
+        }
+
+        /* re-deliver the readiness we have hidden from edge-triggered fds */
+
+        while (queued) {
+            fd = queued - 1;
+            st = fd_state(fd);
+
+            /* the fd may be queued again as soon as we clear the flag */
+            queued = st->epoll_next;
+
+            if (j == maxevents) {
+                epoll_queue_push(epst, fd, st);
+                continue;
+            }
+
+            fd_clear_flags(st, FD_EPOLL_QUEUED);
+
+            revents = __atomic_exchange_n(&st->epoll_pending, 0,
+                                          __ATOMIC_ACQ_REL);
+
+            reg = epoll_reg(epst, fd);
+
+            if (revents == 0
+                || !(fd_flags(st) & FD_EPOLL)
+                || st->epfd != epfd
+                || reg == NULL)
+            {
+                continue;
+            }
+
+            revents = mock_epoll_event(epfd, fd, reg->events, revents, &wait);
+
+            if (revents == 0) {
+                suppressed = 1;
+                continue;
+            }
+
+            if (get_verbose_level()) {
+                fprintf(stderr, "mockeagain: epoll_wait: re-delivering "
+                        "events %u to edge-triggered fd %d\n",
+                        (unsigned) revents, fd);
+            }
+
+            events[j].events = revents;
+            events[j].data = reg->data;
+            j++;
+        }
+
+        if (j > 0) {
+            n = j;
+            break;
+        }
+
+        if (suppressed) {
+            if (!wait_withheld(CALL_EPOLL_WAIT, timeout, begin, wait, fd,
+                               &due))
+            {
+                n = 0;
+                break;
+            }
+
+            /* nothing was passed on, so events holds all the kernel gave */
+            epoll_mask(epfd, epst, &masks, events, n,
+                       event_timeout(timeout, begin, due));
+            continue;
+        }
+
+        /* all the queued events were stale, wait for the kernel this time */
+    }
+
+    if (masks.nmasks) {
+        epoll_unmask(epfd, epst, &masks);
+    }
+
+    free(masks.masks);
+
+    return n;
+}
+
+
+int
+epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    dd("calling my epoll_wait");
+
+    return mock_epoll_wait(epfd, events, maxevents, timeout, NULL);
+}
+
+
+int
+epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+    const sigset_t *sigmask)
+{
+    dd("calling my epoll_pwait");
+
+    return mock_epoll_wait(epfd, events, maxevents, timeout, sigmask);
+}
+
+
+/*
+ * An edge-triggered fd only gets a new event from the kernel when its
+ * readiness changes. When we turn a call into EAGAIN while the fd is still
+ * ready, the caller would wait for an edge that never comes, so we queue the
+ * event for re-delivery by the next epoll_wait() on the same epoll instance.
+ * A oneshot fd is left alone, since the caller re-arms it with
+ * EPOLL_CTL_MOD after the EAGAIN, which makes the kernel report it again.
+ */
+
+static void
+epoll_rearm(int fd, uint32_t events)
+{
+    fd_state_t          *st, *epst;
+
+    st = fd_state(fd);
+
+    if (st == NULL
+        || !(fd_flags(st) & FD_EPOLL)
+        || !(st->epoll_events & EPOLLET)
+        || (st->epoll_events & EPOLLONESHOT))
+    {
+        return;
+    }
+
+    events &= st->epoll_events;
+    if (events == 0) {
+        return;
+    }
+
+    __atomic_fetch_or(&st->epoll_pending, events, __ATOMIC_ACQ_REL);
+
+    if (fd_set_flags(st, FD_EPOLL_QUEUED) & FD_EPOLL_QUEUED) {
+        return;
+    }
+
+    epst = fd_state_alloc(st->epfd);
+    if (epst == NULL) {
+        fd_clear_flags(st, FD_EPOLL_QUEUED);
+        return;
+    }
+
+    epoll_queue_push(epst, fd, st);
+}
+
+
+/*
+ * The fds to re-deliver events to form a lock-free stack linked through
+ * the fd states and headed by the state of the epoll fd. The consumer
+ * always takes the whole stack at once so there is no ABA problem.
+ */
+
+static void
+epoll_queue_push(fd_state_t *epst, int fd, fd_state_t *st)
+{
+    int                  head;
+
+    head = __atomic_load_n(&epst->epoll_queue, __ATOMIC_RELAXED);
+
+    do {
+        st->epoll_next = head;
+
+    } while (!__atomic_compare_exchange_n(&epst->epoll_queue, &head, fd + 1,
+                                          1, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Masks the events withheld from the level-triggered and the oneshot fds
+ * reported by the last call in their registrations, for the original call
+ * to wait for the other events until they are due in ms milliseconds. The
+ * edge-triggered fds are not reported again by the kernel anyway.
+ */
+
+static void
+epoll_mask(int epfd, fd_state_t *epst, epoll_masks_t *m,
+    struct epoll_event *events, int n, int ms)
+{
+    int                  i, k, fd;
+    fd_state_t          *st;
+    epoll_reg_t         *reg;
+    epoll_mask_t        *masks;
+    struct timespec      ts;
+    struct epoll_event   ev;
+
+    for (i = 0; i < n; i++) {
+        fd = events[i].data.fd;
+
+        st = fd_state(fd);
+        if (st == NULL || st->held == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&epoll_lock);
+
+        reg = epoll_reg(epst, fd);
+
+        if (reg == NULL
+            || (reg->events & (EPOLLET|EPOLLONESHOT)) == EPOLLET)
+        {
+            pthread_mutex_unlock(&epoll_lock);
+            continue;
+        }
+
+        for (k = 0; k < m->nmasks; k++) {
+            if (m->masks[k].fd == fd) {
+                break;
+            }
+        }
+
+        if (k == m->nalloc) {
+            masks = realloc(m->masks, (k ? k * 2 : 16) * sizeof(epoll_mask_t));
+
+            if (masks == NULL) {
+                pthread_mutex_unlock(&epoll_lock);
+
+                /* too bad, the other events can only wait as well */
+                nanosleep(ms_to_timespec(ms, &ts), NULL);
+                return;
+            }
+
+            m->masks = masks;
+            m->nalloc = k ? k * 2 : 16;
+        }
+
+        if (k == m->nmasks) {
+            m->masks[k].fd = fd;
+            m->masks[k].held = 0;
+            m->nmasks++;
+        }
+
+        m->masks[k].held |= (unsigned short) st->held;
+
+        ev.events = reg->events & ~m->masks[k].held;
+        ev.data.u64 = 0;
+        ev.data.fd = fd;
+
+        (void) orig_epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+
+        pthread_mutex_unlock(&epoll_lock);
+    }
+}
+
+
+/* gives the fds masked back all the events they are registered for */
+
+static void
+epoll_unmask(int epfd, fd_state_t *epst, epoll_masks_t *m)
+{
+    int                  k;
+    epoll_reg_t         *reg;
+    struct epoll_event   ev;
+
+    for (k = 0; k < m->nmasks; k++) {
+        pthread_mutex_lock(&epoll_lock);
+
+        reg = epoll_reg(epst, m->masks[k].fd);
+
+        if (reg) {
+            ev.events = reg->events;
+            ev.data.u64 = 0;
+            ev.data.fd = m->masks[k].fd;
+
+            (void) orig_epoll_ctl(epfd, EPOLL_CTL_MOD, m->masks[k].fd, &ev);
+        }
+
+        pthread_mutex_unlock(&epoll_lock);
+    }
+
+    m->nmasks = 0;
+}
+
+
+/* forgets a oneshot fd masked, which the kernel has disarmed on reporting */
+
+static void
+epoll_mask_drop(epoll_masks_t *m, int fd)
+{
+    int                  k;
+
+    for (k = 0; k < m->nmasks; k++) {
+        if (m->masks[k].fd == fd) {
+            m->masks[k] = m->masks[--m->nmasks];
+            return;
+        }
+    }
+}
+#endif
+
+
+/*
+ * Accounts for the data that the write calls have actually emitted on a
+ * polled fd. Once the write timeout offset is reached or any of the write
+ * timeout patterns is found, the write events on the fd are suppressed for
+ * good.
+ */
+
+static void
+account_write(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, size_t len)
+{
+    int                  i, which;
+    size_t               n;
+    long long            offset;
+    const matcher_t     *m;
+
+    if (fd_flags(st) & FD_SND_TIMEOUT) {
+        return;
+    }
+
+    st->nwritten += len;
+
+    offset = fd_write_timeout_offset(st);
+
+    if (offset >= 0 && st->nwritten >= (uint64_t) offset) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" has reached the write "
+                    "timeout offset %lld on fd %d.\n", call_name(call),
+                    offset, fd);
+        }
+
+        probe4(write_timeout, call_name(call), fd, 0, st->nwritten);
+
+        fd_set_flags(st, FD_SND_TIMEOUT);
+        return;
+    }
+
+    m = fd_write_matcher(st);
+    if (m == NULL) {
+        return;
+    }
+
+    for (i = 0; i < iovcnt && len; i++, iov++) {
+        n = iov->iov_len < len ? iov->iov_len : len;
+        len -= n;
+
+        if (iov->iov_base == NULL) {
+            /* the data of a zero-copy call */
+            continue;
+        }
+
+        which = fd_match(m, &st->wmatcher, &st->wstate, iov->iov_base, n);
+        if (which == 0) {
+            continue;
+        }
+
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" has found a match for "
+                    "the timeout pattern %d \"%.*s\" on fd %d.\n",
+                    call_name(call), which, (int) m->src_lens[which - 1],
+                    m->srcs[which - 1], fd);
+        }
+
+        probe4(write_timeout, call_name(call), fd, which, st->nwritten);
+
+        st->wmatched = which;
+        fd_set_flags(st, FD_SND_TIMEOUT);
+        return;
+    }
+}
+
+
+/*
+ * The same for the data that the read calls have returned. Once the read
+ * timeout offset is reached or any of the read timeout patterns is found,
+ * no more data is ever returned on the fd.
+ */
+
+static void
+account_read(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, size_t len)
+{
+    int                  i, which, avail;
+    size_t               n;
+    long long            offset;
+    const matcher_t     *m;
+
+    if (st->readable_at
+        && ioctl(fd, FIONREAD, &avail) == 0
+        && avail == 0)
+    {
+        /* all the data has been read, the next data gets its own delay */
+        st->readable_at = 0;
+    }
+
+    if (fd_flags(st) & FD_RCV_TIMEOUT) {
+        return;
+    }
+
+    st->nread += len;
+
+    offset = fd_read_timeout_offset(st);
+
+    if (offset >= 0 && st->nread >= (uint64_t) offset) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" has reached the read "
+                    "timeout offset %lld on fd %d.\n", call_name(call),
+                    offset, fd);
+        }
+
+        probe4(read_timeout, call_name(call), fd, 0, st->nread);
+
+        fd_set_flags(st, FD_RCV_TIMEOUT);
+        return;
+    }
+
+    m = fd_read_matcher(st);
+    if (m == NULL) {
+        return;
+    }
+
+    for (i = 0; i < iovcnt && len; i++, iov++) {
+        n = iov->iov_len < len ? iov->iov_len : len;
+        len -= n;
+
+        which = fd_match(m, &st->rmatcher, &st->rstate, iov->iov_base, n);
+        if (which == 0) {
+            continue;
+        }
+
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" has found a match for "
+                    "the read timeout pattern %d \"%.*s\" on fd %d.\n",
+                    call_name(call), which, (int) m->src_lens[which - 1],
+                    m->srcs[which - 1], fd);
+        }
+
+        probe4(read_timeout, call_name(call), fd, which, st->nread);
+
+        st->rmatched = which;
+        fd_set_flags(st, FD_RCV_TIMEOUT);
+        return;
+    }
+}
+
+
+/*
+ * Feeds data to the matcher, keeping its state in the fd state. Returns
+ * 1 + the pattern found, or 0 if none.
+ */
+
+static int
+fd_match(const matcher_t *m, const matcher_t **fdm, int *state,
+    const void *p, size_t len)
+{
+    int                  which;
+
+    if (*fdm != m) {
+        *fdm = m;
+        *state = 0;
+    }
+
+    if (matcher_feed(m, state, p, len, &which) == 0) {
+        return 0;
+    }
+
+    return which + 1;
+}
+
+
+/*
+ * Tells whether a write on a polled fd should fail with EAGAIN: after a
+ * write timeout, or when the fd has been written to since the last time it
+ * was reported writable, or when its token bucket is empty, or by chance in
+ * the random mode.
+ */
+
+static int
+mock_write_blocked(fd_state_t *st)
+{
+    unsigned short       flags;
+
+    flags = fd_flags(st);
+
+    if (!(flags & FD_POLLED)) {
+        return 0;
+    }
+
+    if (flags & FD_SND_TIMEOUT) {
+        return 1;
+    }
+
+    if ((flags & FD_WRITTEN) && !(fd_active(st) & POLLOUT)) {
+        return 1;
+    }
+
+    if (get_write_rate() > 0 && bucket_refill(st) == 0) {
+        fd_clear_active(st, POLLOUT);
+        return 1;
+    }
+
+    if (get_eagain_chance() && fd_chance(st, get_eagain_chance())) {
+        fd_clear_active(st, POLLOUT);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Called after a mocked write of n out of len bytes. The fd has to be
+ * reported writable again before the next write, except in the shaping
+ * mode, where it only has to once it has used up its token bucket, and in
+ * the random mode, where it only has to after a short write.
+ */
+
+static void
+mock_write_done(fd_state_t *st, ssize_t n, size_t len)
+{
+    if (get_write_rate() > 0 && n > 0) {
+        st->tokens -= (uint64_t) n < st->tokens ? (uint64_t) n : st->tokens;
+
+        if (st->tokens) {
+            return;
+        }
+
+    } else if (random_mode() && n > 0 && (size_t) n == len) {
+        return;
+    }
+
+    fd_clear_active(st, POLLOUT);
+}
+
+
+/*
+ * The same for reads, where the events the fd must have been reported
+ * with are given by the caller.
+ */
+
+static int
+mock_read_blocked(fd_state_t *st, short events)
+{
+    unsigned short       flags;
+
+    flags = fd_flags(st);
+
+    if (!(flags & FD_POLLED)) {
+        return 0;
+    }
+
+    if (flags & FD_RCV_TIMEOUT) {
+        return 1;
+    }
+
+    if (!(fd_active(st) & events)) {
+        return 1;
+    }
+
+    if (get_eagain_chance() && fd_chance(st, get_eagain_chance())) {
+        fd_clear_active(st, POLLIN);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void
+mock_read_done(fd_state_t *st, ssize_t n, size_t len)
+{
+    if (random_mode() && n > 0 && (size_t) n == len) {
+        return;
+    }
+
+    fd_clear_active(st, POLLIN);
+}
+
+
+/*
+ * The shaping mode gives every fd a token bucket of MOCKEAGAIN_WRITE_BUFFER
+ * bytes, refilled at MOCKEAGAIN_WRITE_RATE bytes per second, which models
+ * the socket send buffer of a client on a slow link. Returns the number of
+ * bytes the bucket holds.
+ */
+
+static uint64_t
+bucket_refill(fd_state_t *st)
+{
+    uint64_t             now, elapsed, n, rate, depth;
+
+    rate = get_write_rate();
+    depth = get_write_buffer();
+    now = now_ns();
+
+    if (st->refilled_at == 0 || st->tokens > depth) {
+        st->tokens = depth;
+        st->refilled_at = now;
+        return depth;
+    }
+
+    elapsed = now - st->refilled_at;
+
+    if (elapsed >= (depth - st->tokens) * 1000000000 / rate + 1) {
+        st->tokens = depth;
+        st->refilled_at = now;
+        return depth;
+    }
+
+    /* keep the fraction of a byte earned for the next time */
+
+    n = elapsed * rate / 1000000000;
+
+    if (n) {
+        st->tokens += n;
+        st->refilled_at += n * 1000000000 / rate;
+    }
+
+    return st->tokens;
+}
+
+
+/*
+ * Returns the number of milliseconds until the fd may be reported writable
+ * in the shaping mode, which is when its bucket is a third full like the
+ * send buffer of a Linux TCP socket, or 0 if it can be right now.
+ */
+
+static int
+write_shaping_wait(fd_state_t *st)
+{
+    uint64_t             tokens, lowat, rate;
+
+    rate = get_write_rate();
+    if ((long long) rate <= 0) {
+        return 0;
+    }
+
+    tokens = bucket_refill(st);
+
+    lowat = get_write_buffer() / 3;
+    if (lowat == 0) {
+        lowat = 1;
+    }
+
+    if (tokens >= lowat) {
+        return 0;
+    }
+
+    return (int) (((lowat - tokens) * 1000 + rate - 1) / rate);
+}
+
+
+/*
+ * Returns the size of the next mocked write out of the len bytes of data,
+ * which ends right where the write timeout offset or a write timeout
+ * pattern is hit, so that nothing goes out beyond that point.
+ */
+
+static size_t
+mock_write_size(fd_state_t *st, const struct iovec *iov, int iovcnt,
+    size_t len)
+{
+    int                  i, state, which;
+    size_t               n, k, size, found;
+    long long            offset;
+    const matcher_t     *m;
+
+    if (get_write_rate() > 0) {
+        /* mock_write_blocked() has just refilled the bucket */
+        n = st->tokens < len ? st->tokens : len;
+
+    } else if (random_mode()) {
+        n = fd_chance(st, get_short_chance()) ? chunk_size(st, len) : len;
+
+    } else {
+        n = chunk_size(st, len);
+    }
+
+    offset = fd_write_timeout_offset(st);
+
+    if (offset >= 0
+        && st->nwritten < (uint64_t) offset
+        && st->nwritten + n > (uint64_t) offset)
+    {
+        n = offset - st->nwritten;
+    }
+
+    m = fd_write_matcher(st);
+    if (m == NULL || n == 1) {
+        return n;
+    }
+
+    /* look ahead with a copy of the matcher state */
+
+    state = st->wmatcher == m ? st->wstate : 0;
+    size = 0;
+
+    for (i = 0; i < iovcnt && size < n; i++, iov++) {
+        k = iov->iov_len < n - size ? iov->iov_len : n - size;
+
+        if (iov->iov_base == NULL) {
+            break;
+        }
+
+        found = matcher_feed(m, &state, iov->iov_base, k, &which);
+        if (found) {
+            return size + found;
+        }
+
+        size += k;
+    }
+
+    return n;
+}
+
+
+/*
+ * The same for reads, which can only stop at the read timeout offset since
+ * the data is not known in advance.
+ */
+
+static size_t
+mock_read_size(fd_state_t *st, size_t len)
+{
+    size_t               n;
+    long long            offset;
+
+    if (random_mode()) {
+        n = fd_chance(st, get_short_chance()) ? chunk_size(st, len) : len;
+
+    } else {
+        n = chunk_size(st, len);
+    }
+
+    offset = fd_read_timeout_offset(st);
+
+    if (offset >= 0
+        && st->nread < (uint64_t) offset
+        && st->nread + n > (uint64_t) offset)
+    {
+        n = offset - st->nread;
+    }
+
+    return n;
+}
+
+
+/* picks a delay in the range conf for the fd, in nanoseconds */
+
+static uint64_t
+delay_ns(fd_state_t *st, uint64_t conf)
+{
+    uint64_t             min, max;
+
+    min = conf >> 32;
+    max = conf & 0xffffffff;
+
+    if (max > min) {
+        min += fd_random(st) % (max - min + 1);
+    }
+
+    return min * 1000000;
+}
+
+
+/* returns the milliseconds until the monotonic time t, rounded up */
+
+static int
+ms_until(uint64_t t)
+{
+    uint64_t             now;
+
+    now = now_ns();
+
+    if (t <= now) {
+        return 0;
+    }
+
+    return (int) ((t - now + 999999) / 1000000);
+}
+
+
+/* picks the size of a mocked call out of the len bytes asked for */
+
+static size_t
+chunk_size(fd_state_t *st, size_t len)
+{
+    int                  i;
+    size_t               size;
+    unsigned             w;
+    chunk_range_t       *range;
+    chunk_conf_t        *conf;
+
+    conf = get_chunk_conf();
+    if (conf == NULL) {
+        return 1;
+    }
+
+    range = conf->ranges;
+
+    if (conf->nranges > 1) {
+        w = fd_random(st) % conf->ranges[conf->nranges - 1].weight;
+
+        for (i = 0; range->weight <= w; i++) {
+            range++;
+        }
+    }
+
+    size = range->min;
+
+    if (range->max > range->min) {
+        size += fd_random(st) % (range->max - range->min + 1);
+    }
+
+    return size < len ? size : len;
+}
+
+
+/*
+ * A xorshift64* generator per fd, so that the sequence seen by an fd does
+ * not depend on the I/O done on the other fds.
+ */
+
+static uint64_t
+fd_random(fd_state_t *st)
+{
+    uint64_t             x;
+
+    if (st->rnd == 0) {
+        /* an fd we have not seen created */
+        fd_seed(st);
+    }
+
+    x = st->rnd;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+
+    st->rnd = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+/*
+ * Seeds the generator of a new fd with the splitmix64 hash of the random
+ * seed and the number of fds created so far, so that every connection of a
+ * run gets the same sequence when the run is repeated with the same seed.
+ */
+
+static void
+fd_seed(fd_state_t *st)
+{
+    uint64_t             x;
+
+    x = get_random_seed()
+        + __atomic_add_fetch(&fd_seq, 1, __ATOMIC_RELAXED)
+          * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x = (x ^ (x >> 31)) | 1;
+
+    st->rnd = x;
+}
+
+
+/* returns 1 with the given chance in 1/2^32 */
+
+static int
+fd_chance(fd_state_t *st, uint32_t chance)
+{
+    return (uint32_t) (fd_random(st) >> 32) < chance;
+}
+
+
+/*
+ * All the write wrappers share this core, which decides whether the call
+ * fails with EAGAIN and how much of the data goes out, and accounts for
+ * the data emitted. The op issues the original call on the data given,
+ * which is a prefix of the caller's iovec when the write is mocked.
+ */
+
+static ssize_t
+mock_write(unsigned call, int fd, const struct iovec *iov, int iovcnt,
+    write_op_handle op, void *data)
+{
+    ssize_t                  retval;
+    fd_state_t              *st;
+    struct iovec             new_iov[MAX_CHUNK_IOVS];
+    const struct iovec      *p;
+    int                      i, new_iovcnt;
+    size_t                   n, size, len = 0;
+
+    st = fd_state_alloc(fd);
+
+    if (get_verbose_level() && st) {
+        fprintf(stderr, "mockeagain: %s(%d): polled=%d, written=%d, "
+                "active=%d\n", call_name(call), fd,
+                !!(fd_flags(st) & FD_POLLED), !!(fd_flags(st) & FD_WRITTEN),
+                (int) fd_active(st));
+    }
+
+    if (st && fd_scheduled(st)) {
+        return mock_scheduled(call, fd, st, iov, iovcnt, op, data, 1);
+    }
+
+    if (st && mock_write_blocked(st)) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: mocking \"%s\" on fd %d to "
+                    "signal EAGAIN.\n", call_name(call), fd);
+        }
+
+#if __linux__
+        epoll_rearm(fd, EPOLLOUT);
+#endif
+
+        probe5(write, call_name(call), fd, iov_total(iov, iovcnt), -1,
+               MOCKEAGAIN_TRACE_INJECTED);
+
+        st->ninjected++;
+
+        errno = EAGAIN;
+        trace_iov(call, fd, iov, iovcnt, -1, MOCKEAGAIN_TRACE_INJECTED);
+        return -1;
+    }
+
+    if (st) {
+        fd_set_flags(st, FD_WRITTEN);
+    }
+
+    if (st && (fd_flags(st) & FD_POLLED)) {
+        p = iov;
+        for (i = 0; i < iovcnt; i++, p++) {
+            len += p->iov_len;
+        }
+    }
+
+    if (len == 0) {
+        retval = op(fd, iov, iovcnt, data);
+
+        trace_iov(call, fd, iov, iovcnt, retval, 0);
+
+        /* the fds never polled, like files and pipes, are left alone */
+        if (retval > 0 && st && (fd_flags(st) & FD_POLLED)) {
+            account_write(call, fd, st, iov, iovcnt, retval);
+        }
+
+        return retval;
+    }
+
+    n = mock_write_size(st, iov, iovcnt, len);
+
+    size = iov_head(iov, iovcnt, n, new_iov, &new_iovcnt);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: mocking \"%s\" on fd %d to emit "
+                "%llu of %llu bytes.\n", call_name(call), fd,
+                (unsigned long long) size, (unsigned long long) len);
+    }
+
+    dd("calling the original %s on fd %d", call, fd);
+
+    retval = op(fd, new_iov, new_iovcnt, data);
+    mock_write_done(st, retval, len);
+
+    if (retval >= 0 && size < len) {
+        st->nshort++;
+    }
+
+    probe5(write, call_name(call), fd, len, retval,
+           size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+    trace(call, fd, len, retval, size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+    if (retval > 0) {
+        account_write(call, fd, st, new_iov, new_iovcnt, retval);
+    }
+
+    return retval;
+}
+
+
+ssize_t
+writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    fd_state_t              *st;
+    struct msghdr            msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_writev)(fd, iov, iovcnt);
+    }
+
+    st = dgram_state(fd);
+    if (st) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec *) iov;
+        msg.msg_iovlen = iovcnt;
+
+        return dgram_send(CALL_WRITEV, fd, st, &msg, 0);
+    }
+
+    return mock_write(CALL_WRITEV, fd, iov, iovcnt, writev_op, NULL);
+}
+
+
+static ssize_t
+writev_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_writev)(fd, iov, iovcnt);
+}
+
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+    fd_state_t              *st;
+    struct iovec             iov;
+    struct msghdr            msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_write)(fd, buf, len);
+    }
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+
+    /* the datagrams of a connected socket, as for send() */
+    st = dgram_state(fd);
+    if (st) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        return dgram_send(CALL_WRITE, fd, st, &msg, 0);
+    }
+
+    return mock_write(CALL_WRITE, fd, &iov, 1, write_op, NULL);
+}
+
+
+static ssize_t
+write_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_write)(fd, iov->iov_base, iov->iov_len);
+}
+
+
+int
+close(int fd)
+{
+    int                     retval;
+    fd_state_t             *st;
+
+    st = fd_state(fd);
+    if (st) {
+#if (DDEBUG)
+        if (fd_flags(st) & FD_POLLED) {
+            dd("calling the original close on fd %d", fd);
+        }
+#endif
+
+        if (__atomic_load_n(&st->dgrams, __ATOMIC_RELAXED)) {
+            dgram_close(fd, st);
+        }
+
+        /* the kernel drops any epoll registration along with the fd */
+        fd_state_reset(st);
+    }
+
+    retval = (*orig_close)(fd);
+
+    return retval;
+}
+
+
+ssize_t
+send(int fd, const void *buf, size_t len, int flags)
+{
+    fd_state_t              *st;
+    struct iovec             iov;
+    struct msghdr            msg;
+
+    dd("calling my send");
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_send)(fd, buf, len, flags);
+    }
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+
+    st = dgram_state(fd);
+    if (st) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        return dgram_send(CALL_SEND, fd, st, &msg, flags);
+    }
+
+    return mock_write(CALL_SEND, fd, &iov, 1, send_op, &flags);
+}
+
+
+static ssize_t
+send_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_send)(fd, iov->iov_base, iov->iov_len, *(int *) data);
+}
+
+
+ssize_t
+sendto(int fd, const void *buf, size_t len, int flags,
+    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    fd_state_t              *st;
+    struct iovec             iov;
+    struct msghdr            msg;
+    send_args_t              args;
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_sendto)(fd, buf, len, flags, dest_addr, addrlen);
+    }
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+
+    st = dgram_state(fd);
+    if (st) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *) dest_addr;
+        msg.msg_namelen = addrlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        return dgram_send(CALL_SENDTO, fd, st, &msg, flags);
+    }
+
+    args.flags = flags;
+    args.addr = dest_addr;
+    args.addrlen = addrlen;
+
+    return mock_write(CALL_SENDTO, fd, &iov, 1, sendto_op, &args);
+}
+
+
+static ssize_t
+sendto_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    send_args_t         *args = data;
+
+    return (*orig_sendto)(fd, iov->iov_base, iov->iov_len, args->flags,
+                          args->addr, args->addrlen);
+}
+
+
+ssize_t
+sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+    fd_state_t              *st;
+    struct msghdr            new_msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_sendmsg)(fd, msg, flags);
+    }
+
+    st = dgram_state(fd);
+    if (st) {
+        return dgram_send(CALL_SENDMSG, fd, st, msg, flags);
+    }
+
+    /* the control data and the address go with whatever part is sent */
+
+    new_msg = *msg;
+    new_msg.msg_flags = flags;
+
+    return mock_write(CALL_SENDMSG, fd, msg->msg_iov, (int) msg->msg_iovlen,
+                      sendmsg_op, &new_msg);
+}
+
+
+/*
+ * The flags of the call are passed in the msg_flags field of the copy of
+ * the header, which sendmsg() itself ignores.
+ */
+
+static ssize_t
+sendmsg_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    struct msghdr       *msg = data;
+
+    msg->msg_iov = (struct iovec *) iov;
+    msg->msg_iovlen = iovcnt;
+
+    return (*orig_sendmsg)(fd, msg, msg->msg_flags);
+}
+
+
+#if __linux__
+
+/*
+ * The zero-copy calls are mocked like the other write calls when their
+ * destination is a polled fd. Their data never passes through our memory,
+ * so it is described by a single iovec with a NULL base, which only counts
+ * towards the write timeout offset and is not seen by the timeout patterns.
+ * The kernel advances the offsets by what was actually transferred.
+ */
+
+ssize_t
+sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    struct iovec             iov;
+    copy_args_t              args;
+
+    if (!(fd_mocking_type(out_fd) & MOCKING_WRITES)) {
+        return (*orig_sendfile)(out_fd, in_fd, offset, count);
+    }
+
+    iov.iov_base = NULL;
+    iov.iov_len = count;
+
+    args.fd_in = in_fd;
+    args.off_in = offset;
+
+    return mock_write(CALL_SENDFILE, out_fd, &iov, 1, sendfile_op, &args);
+}
+
+
+static ssize_t
+sendfile_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    copy_args_t         *args = data;
+
+    return (*orig_sendfile)(fd, args->fd_in, args->off_in, iov->iov_len);
+}
+
+
+ssize_t
+sendfile64(int out_fd, int in_fd, off64_t *offset, size_t count)
+{
+    struct iovec             iov;
+    copy_args_t              args;
+
+    if (!(fd_mocking_type(out_fd) & MOCKING_WRITES)) {
+        return (*orig_sendfile64)(out_fd, in_fd, offset, count);
+    }
+
+    iov.iov_base = NULL;
+    iov.iov_len = count;
+
+    args.fd_in = in_fd;
+    args.off_in = offset;
+
+    return mock_write(CALL_SENDFILE64, out_fd, &iov, 1, sendfile64_op, &args);
+}
+
+
+static ssize_t
+sendfile64_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    copy_args_t         *args = data;
+
+    return (*orig_sendfile64)(fd, args->fd_in, args->off_in, iov->iov_len);
+}
+
+
+ssize_t
+splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len,
+    unsigned int flags)
+{
+    struct iovec             iov;
+    copy_args_t              args;
+
+    if (!(fd_mocking_type(fd_out) & MOCKING_WRITES)) {
+        return (*orig_splice)(fd_in, off_in, fd_out, off_out, len, flags);
+    }
+
+    iov.iov_base = NULL;
+    iov.iov_len = len;
+
+    args.fd_in = fd_in;
+    args.off_in = off_in;
+    args.off_out = off_out;
+    args.flags = flags;
+
+    return mock_write(CALL_SPLICE, fd_out, &iov, 1, splice_op, &args);
+}
+
+
+static ssize_t
+splice_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    copy_args_t         *args = data;
+
+    return (*orig_splice)(args->fd_in, args->off_in, fd, args->off_out,
+                          iov->iov_len, args->flags);
+}
+
+#endif
+
+
+#if (HAVE_COPY_FILE_RANGE)
+
+ssize_t
+copy_file_range(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out,
+    size_t len, unsigned int flags)
+{
+    struct iovec             iov;
+    copy_args_t              args;
+
+    if (!(fd_mocking_type(fd_out) & MOCKING_WRITES)) {
+        return (*orig_copy_file_range)(fd_in, off_in, fd_out, off_out, len,
+                                       flags);
+    }
+
+    iov.iov_base = NULL;
+    iov.iov_len = len;
+
+    args.fd_in = fd_in;
+    args.off_in = off_in;
+    args.off_out = off_out;
+    args.flags = flags;
+
+    return mock_write(CALL_COPY_FILE_RANGE, fd_out, &iov, 1,
+                      copy_file_range_op, &args);
+}
+
+
+static ssize_t
+copy_file_range_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    copy_args_t         *args = data;
+
+    return (*orig_copy_file_range)(args->fd_in, args->off_in, fd,
+                                   args->off_out, iov->iov_len, args->flags);
+}
+
+#endif
+
+
+/*
+ * All the read wrappers share this core, the counterpart of mock_write().
+ * The read events that the fd must have been reported with are given by
+ * the caller.
+ */
+
+static ssize_t
+mock_read(unsigned call, int fd, short events, const struct iovec *iov,
+    int iovcnt, read_op_handle op, void *data)
+{
+    ssize_t                  retval;
+    fd_state_t              *st;
+    struct iovec             new_iov[MAX_CHUNK_IOVS];
+    const struct iovec      *p;
+    int                      i, new_iovcnt;
+    size_t                   n, size, len = 0;
+
+    st = fd_state(fd);
+
+    if (st && __atomic_load_n(&st->dgrams, __ATOMIC_RELAXED)) {
+        dgram_wait(fd, st);
+    }
+
+    if (st && fd_scheduled(st)) {
+        return mock_scheduled(call, fd, st, iov, iovcnt, op, data, 0);
+    }
+
+    if (st && mock_read_blocked(st, events)) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: mocking \"%s\" on fd %d to "
+                    "signal EAGAIN\n", call_name(call), fd);
+        }
+
+#if __linux__
+        epoll_rearm(fd, EPOLLIN);
+#endif
+
+        probe5(read, call_name(call), fd, iov_total(iov, iovcnt), -1,
+               MOCKEAGAIN_TRACE_INJECTED);
+
+        st->ninjected++;
+
+        errno = EAGAIN;
+        trace_iov(call, fd, iov, iovcnt, -1, MOCKEAGAIN_TRACE_INJECTED);
+        return -1;
+    }
+
+    if (st && (fd_flags(st) & FD_POLLED)) {
+        p = iov;
+        for (i = 0; i < iovcnt; i++, p++) {
+            len += p->iov_len;
+        }
+    }
+
+    if (len == 0) {
+        retval = op(fd, iov, iovcnt, data);
+
+        trace_iov(call, fd, iov, iovcnt, retval, 0);
+
+        if (retval > 0 && st && (fd_flags(st) & FD_POLLED)) {
+            account_read(call, fd, st, iov, iovcnt, retval);
+        }
+
+        return retval;
+    }
+
+    n = mock_read_size(st, len);
+
+    size = iov_head(iov, iovcnt, n, new_iov, &new_iovcnt);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: mocking \"%s\" on fd %d to read "
+                "%llu of %llu bytes.\n", call_name(call), fd,
+                (unsigned long long) size, (unsigned long long) len);
+    }
+
+    dd("calling the original %s on fd %d", call, fd);
+
+    retval = op(fd, new_iov, new_iovcnt, data);
+    mock_read_done(st, retval, len);
+
+    if (retval >= 0 && size < len) {
+        st->nshort++;
+    }
+
+    probe5(read, call_name(call), fd, len, retval,
+           size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+    trace(call, fd, len, retval, size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+    if (retval > 0) {
+        account_read(call, fd, st, new_iov, new_iovcnt, retval);
+    }
+
+    return retval;
+}
+
+
+/*
+ * The reads and writes of an fd with a schedule take its steps in turn,
+ * instead of any of the other mocking, and those of an fd with a split hook
+ * are cut as the hook says. A timeout triggered on the fd still fails them
+ * all.
+ */
+
+static ssize_t
+mock_scheduled(unsigned call, int fd, fd_state_t *st,
+    const struct iovec *iov, int iovcnt, write_op_handle op, void *data,
+    int write)
+{
+    int                      i, new_iovcnt;
+    ssize_t                  retval;
+    size_t                   size, len;
+    long long                cut = SCHEDULE_ALL;
+    struct iovec             new_iov[MAX_CHUNK_IOVS];
+    const schedule_t        *s;
+    const schedule_step_t   *step;
+    mockeagain_split_hook_handle     hook;
+
+    s = __atomic_load_n(&st->schedule, __ATOMIC_ACQUIRE);
+    hook = __atomic_load_n(&st->split_hook, __ATOMIC_ACQUIRE);
+
+    if (fd_flags(st) & (write ? FD_SND_TIMEOUT : FD_RCV_TIMEOUT)) {
+        goto eagain;
+    }
+
+    st->ncalls++;
+
+    if (hook) {
+        cut = hook(fd, write, iov_total(iov, iovcnt), st->split_data);
+
+        if (cut < 0) {
+            cut = SCHEDULE_EAGAIN;
+
+        } else if (cut == 0) {
+            cut = SCHEDULE_ALL;
+        }
+
+    } else if (s && (i = st->step[write]) < s->nsteps[write]) {
+        step = &s->steps[write][i];
+        cut = step->size;
+
+        if (++st->taken[write] == step->repeat) {
+            st->step[write]++;
+            st->taken[write] = 0;
+        }
+    }
+
+    if (cut == SCHEDULE_EAGAIN) {
+        goto eagain;
+    }
+
+    if (cut == SCHEDULE_ALL) {
+        retval = op(fd, iov, iovcnt, data);
+
+        trace_iov(call, fd, iov, iovcnt, retval, 0);
+
+        if (retval > 0) {
+            if (write) {
+                account_write(call, fd, st, iov, iovcnt, retval);
+
+            } else {
+                account_read(call, fd, st, iov, iovcnt, retval);
+            }
+        }
+
+        return retval;
+    }
+
+    len = iov_total(iov, iovcnt);
+    size = iov_head(iov, iovcnt, cut, new_iov, &new_iovcnt);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: scheduling \"%s\" on fd %d to %s "
+                "%llu of %llu bytes.\n", call_name(call), fd,
+                write ? "emit" : "read", (unsigned long long) size,
+                (unsigned long long) len);
+    }
+
+    retval = op(fd, new_iov, new_iovcnt, data);
+
+    if (retval >= 0 && size < len) {
+        st->nshort++;
+    }
+
+    if (write) {
+        probe5(write, call_name(call), fd, len, retval,
+               size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+    } else {
+        probe5(read, call_name(call), fd, len, retval,
+               size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+    }
+
+    trace(call, fd, len, retval, size < len ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+    if (retval > 0) {
+        if (write) {
+            account_write(call, fd, st, new_iov, new_iovcnt, retval);
+
+        } else {
+            account_read(call, fd, st, new_iov, new_iovcnt, retval);
+        }
+    }
+
+    return retval;
+
+eagain:
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: scheduling \"%s\" on fd %d to "
+                "signal EAGAIN.\n", call_name(call), fd);
+    }
+
+#if __linux__
+    epoll_rearm(fd, write ? EPOLLOUT : EPOLLIN);
+#endif
+
+    if (write) {
+        probe5(write, call_name(call), fd, iov_total(iov, iovcnt), -1,
+               MOCKEAGAIN_TRACE_INJECTED);
+
+    } else {
+        probe5(read, call_name(call), fd, iov_total(iov, iovcnt), -1,
+               MOCKEAGAIN_TRACE_INJECTED);
+    }
+
+    st->ninjected++;
+
+    errno = EAGAIN;
+    trace_iov(call, fd, iov, iovcnt, -1, MOCKEAGAIN_TRACE_INJECTED);
+    return -1;
+}
+
+
+/*
+ * The events withheld from an fd replaying a recording, as many times as
+ * recorded once the reads and writes before them are done. The caller is
+ * woken up again right away instead of after the delays of the recording.
+ */
+
+static int
+schedule_revents(fd_state_t *st, int revents, int *wait)
+{
+    const schedule_t            *s;
+    const schedule_event_t      *e;
+
+    s = __atomic_load_n(&st->schedule, __ATOMIC_ACQUIRE);
+
+    if (s == NULL) {
+        /* a split hook has no say over the events */
+        return revents;
+    }
+
+    /* the events of the calls already done cannot be withheld any more */
+    while (st->event < s->nevents
+           && s->events[st->event].calls < st->ncalls)
+    {
+        st->event++;
+    }
+
+    if (st->event == s->nevents) {
+        return revents;
+    }
+
+    e = &s->events[st->event];
+
+    if (e->calls != st->ncalls || !(revents & e->events)) {
+        return revents;
+    }
+
+    st->event++;
+
+    *wait = 0;
+
+    return revents & ~e->events;
+}
+
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+    struct iovec             iov;
+
+    dd("calling my read");
+
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_read)(fd, buf, len);
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    return mock_read(CALL_READ, fd, POLLIN | POLLHUP, &iov, 1, read_op, NULL);
+}
+
+
+static ssize_t
+read_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_read)(fd, iov->iov_base, iov->iov_len);
+}
+
+
+ssize_t
+recv(int fd, void *buf, size_t len, int flags)
+{
+    struct iovec             iov;
+
+    dd("calling my recv");
+
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_recv)(fd, buf, len, flags);
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    return mock_read(CALL_RECV, fd, POLLIN, &iov, 1, recv_op, &flags);
+}
+
+
+static ssize_t
+recv_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_recv)(fd, iov->iov_base, iov->iov_len, *(int *) data);
+}
+
+
+ssize_t
+recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    struct iovec             iov;
+    recv_args_t              args;
+
+    dd("calling my recvfrom");
+
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_recvfrom)(fd, buf, len, flags, src_addr, addrlen);
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    args.flags = flags;
+    args.addr = src_addr;
+    args.addrlen = addrlen;
+
+    return mock_read(CALL_RECVFROM, fd, POLLIN, &iov, 1, recvfrom_op, &args);
+}
+
+
+static ssize_t
+recvfrom_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    recv_args_t         *args = data;
+
+    return (*orig_recvfrom)(fd, iov->iov_base, iov->iov_len, args->flags,
+                            args->addr, args->addrlen);
+}
+
+
+ssize_t
+readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_readv)(fd, iov, iovcnt);
+    }
+
+    return mock_read(CALL_READV, fd, POLLIN | POLLHUP, iov, iovcnt, readv_op,
+                     NULL);
+}
+
+
+static ssize_t
+readv_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    return (*orig_readv)(fd, iov, iovcnt);
+}
+
+
+ssize_t
+recvmsg(int fd, struct msghdr *msg, int flags)
+{
+    ssize_t                  retval;
+    struct msghdr            new_msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_recvmsg)(fd, msg, flags);
+    }
+
+    new_msg = *msg;
+    new_msg.msg_flags = flags;
+
+    retval = mock_read(CALL_RECVMSG, fd, POLLIN, msg->msg_iov,
+                       (int) msg->msg_iovlen, recvmsg_op, &new_msg);
+
+    if (retval >= 0) {
+        msg->msg_namelen = new_msg.msg_namelen;
+        msg->msg_controllen = new_msg.msg_controllen;
+        msg->msg_flags = new_msg.msg_flags;
+    }
+
+    return retval;
+}
+
+
+/*
+ * The flags of the call are passed in the msg_flags field of the copy of
+ * the header, which recvmsg() only ever writes to.
+ */
+
+static ssize_t
+recvmsg_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    struct msghdr       *msg = data;
+
+    msg->msg_iov = (struct iovec *) iov;
+    msg->msg_iovlen = iovcnt;
+
+    return (*orig_recvmsg)(fd, msg, msg->msg_flags);
+}
+
+
+#if __linux__
+
+/*
+ * On a polled fd, a batch of messages is cut to its first message, which
+ * is mocked just like by recvmsg() or sendmsg() and so may be partially
+ * filled. The datagram sockets are never polled as far as we are concerned,
+ * so their batches are only ever cut short: to a single message, or in the
+ * random mode to any number of messages up to the one requested.
+ */
+
+static unsigned int
+mock_batch_size(fd_state_t *st, unsigned int vlen)
+{
+    if (vlen <= 1) {
+        return vlen;
+    }
+
+    if (!random_mode()) {
+        return 1;
+    }
+
+    return 1 + (unsigned int) (fd_random(st) % vlen);
+}
+
+
+#if (defined(__GLIBC__) && __GLIBC__ <= 2) && \
+    (defined(__GLIBC_MINOR__) && __GLIBC_MINOR__ < 21)
+int
+recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+    const struct timespec *timeout)
+#else
+int
+recvmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+    struct timespec *timeout)
+#endif
+{
+    int                      i, rc;
+    ssize_t                  retval;
+    unsigned int             n;
+    fd_state_t              *st;
+    mmsg_args_t              args;
+    struct msghdr           *msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_READS)) {
+        return (*orig_recvmmsg)(fd, msgvec, vlen, flags, timeout);
+    }
+
+    st = fd_state(fd);
+
+    if (st == NULL || vlen == 0) {
+        return (*orig_recvmmsg)(fd, msgvec, vlen, flags, timeout);
+    }
+
+    if (__atomic_load_n(&st->dgrams, __ATOMIC_RELAXED)) {
+        dgram_wait(fd, st);
+    }
+
+    if (!(fd_flags(st) & FD_POLLED)) {
+        n = (fd_flags(st) & FD_WEIRD) ? mock_batch_size(st, vlen) : vlen;
+
+        if (get_verbose_level() && n < vlen) {
+            fprintf(stderr, "mockeagain: mocking \"recvmmsg\" on fd %d to "
+                    "receive up to %u of %u messages.\n", fd, n, vlen);
+        }
+
+        rc = (*orig_recvmmsg)(fd, msgvec, n, flags, timeout);
+
+        if (n < vlen) {
+            probe5(read, "recvmmsg", fd, vlen, rc, MOCKEAGAIN_TRACE_SHORT);
+        }
+
+        trace(CALL_RECVMMSG, fd, vlen, rc,
+              n < vlen ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+        for (i = 0; i < rc; i++) {
+            msg = &msgvec[i].msg_hdr;
+            account_read(CALL_RECVMMSG, fd, st, msg->msg_iov,
+                         (int) msg->msg_iovlen, msgvec[i].msg_len);
+        }
+
+        return rc;
+    }
+
+    msg = &msgvec[0].msg_hdr;
+
+    args.mmsg = msgvec[0];
+    args.flags = flags;
+    args.timeout = (struct timespec *) timeout;
+
+    retval = mock_read(CALL_RECVMMSG, fd, POLLIN, msg->msg_iov,
+                       (int) msg->msg_iovlen, recvmmsg_op, &args);
+
+    if (retval == -1) {
+        return -1;
+    }
+
+    msg->msg_namelen = args.mmsg.msg_hdr.msg_namelen;
+    msg->msg_controllen = args.mmsg.msg_hdr.msg_controllen;
+    msg->msg_flags = args.mmsg.msg_hdr.msg_flags;
+    msgvec[0].msg_len = (unsigned int) retval;
+
+    return 1;
+}
+
+
+static ssize_t
+recvmmsg_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    int                  rc;
+    mmsg_args_t         *args = data;
+
+    args->mmsg.msg_hdr.msg_iov = (struct iovec *) iov;
+    args->mmsg.msg_hdr.msg_iovlen = iovcnt;
+
+    rc = (*orig_recvmmsg)(fd, &args->mmsg, 1, args->flags, args->timeout);
+
+    return rc == 1 ? (ssize_t) args->mmsg.msg_len : rc;
+}
+
+
+int
+sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    int                      i, rc;
+    ssize_t                  retval;
+    unsigned int             n;
+    fd_state_t              *st;
+    mmsg_args_t              args;
+    struct msghdr           *msg;
+
+    if (!(fd_mocking_type(fd) & MOCKING_WRITES)) {
+        return (*orig_sendmmsg)(fd, msgvec, vlen, flags);
+    }
+
+    st = fd_state_alloc(fd);
+
+    if (st == NULL || vlen == 0) {
+        return (*orig_sendmmsg)(fd, msgvec, vlen, flags);
+    }
+
+    if (!(fd_flags(st) & FD_POLLED)) {
+        n = (fd_flags(st) & FD_WEIRD) ? mock_batch_size(st, vlen) : vlen;
+
+        if (get_verbose_level() && n < vlen) {
+            fprintf(stderr, "mockeagain: mocking \"sendmmsg\" on fd %d to "
+                    "send %u of %u messages.\n", fd, n, vlen);
+        }
+
+        if (dgram_state(fd)) {
+            for (i = 0; i < (int) n; i++) {
+                retval = dgram_send(CALL_SENDMMSG, fd, st, &msgvec[i].msg_hdr,
+                                    flags);
+                if (retval == -1) {
+                    return i ? i : -1;
+                }
+
+                msgvec[i].msg_len = (unsigned int) retval;
+            }
+
+            return n;
+        }
+
+        rc = (*orig_sendmmsg)(fd, msgvec, n, flags);
+
+        if (n < vlen) {
+            probe5(write, "sendmmsg", fd, vlen, rc, MOCKEAGAIN_TRACE_SHORT);
+        }
+
+        trace(CALL_SENDMMSG, fd, vlen, rc,
+              n < vlen ? MOCKEAGAIN_TRACE_SHORT : 0);
+
+        for (i = 0; i < rc; i++) {
+            msg = &msgvec[i].msg_hdr;
+            account_write(CALL_SENDMMSG, fd, st, msg->msg_iov,
+                          (int) msg->msg_iovlen, msgvec[i].msg_len);
+        }
+
+        return rc;
+    }
+
+    msg = &msgvec[0].msg_hdr;
+
+    args.mmsg = msgvec[0];
+    args.flags = flags;
+
+    retval = mock_write(CALL_SENDMMSG, fd, msg->msg_iov, (int) msg->msg_iovlen,
+                        sendmmsg_op, &args);
+
+    if (retval == -1) {
+        return -1;
+    }
+
+    msgvec[0].msg_len = (unsigned int) retval;
+
+    return 1;
+}
+
+
+static ssize_t
+sendmmsg_op(int fd, const struct iovec *iov, int iovcnt, void *data)
+{
+    int                  rc;
+    mmsg_args_t         *args = data;
+
+    args->mmsg.msg_hdr.msg_iov = (struct iovec *) iov;
+    args->mmsg.msg_hdr.msg_iovlen = iovcnt;
+
+    rc = (*orig_sendmmsg)(fd, &args->mmsg, 1, args->flags);
+
+    return rc == 1 ? (ssize_t) args->mmsg.msg_len : rc;
+}
+
+#endif
+
+
+/*
+ * The datagram sockets are never mocked like the stream ones. With any of
+ * the MOCKEAGAIN_UDP_* settings, the datagrams sent on them are impaired
+ * instead: dropped, duplicated, reordered or delayed, like by the netem
+ * qdisc of Linux. Returns the state of the fd if it is such a socket.
+ */
+
+static fd_state_t *
+dgram_state(int fd)
+{
+    fd_state_t          *st;
+
+    if (!dgram_mode()) {
+        return NULL;
+    }
+
+    st = fd_state(fd);
+    if (st == NULL || !(fd_flags(st) & FD_DGRAM)) {
+        return NULL;
+    }
+
+    return st;
+}
+
+
+static ssize_t
+dgram_send(unsigned call, int fd, fd_state_t *st, const struct msghdr *msg,
+    int flags)
+{
+    int                  i, copies, after, held[2];
+    size_t               len = 0;
+    ssize_t              rc;
+    uint64_t             delay, now, due[2];
+    dgram_t             *d[2];
+
+    for (i = 0; i < (int) msg->msg_iovlen; i++) {
+        len += msg->msg_iov[i].iov_len;
+    }
+
+    if (get_udp_loss() && fd_chance(st, get_udp_loss())) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" on fd %d: dropping a "
+                    "datagram of %llu bytes.\n", call_name(call), fd,
+                    (unsigned long long) len);
+        }
+
+        probe5(write, call_name(call), fd, len, len, MOCKEAGAIN_TRACE_DROPPED);
+        trace(call, fd, len, len, MOCKEAGAIN_TRACE_DROPPED);
+        return len;
+    }
+
+    copies = 1;
+
+    if (get_udp_duplicate() && fd_chance(st, get_udp_duplicate())) {
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" on fd %d: duplicating a "
+                    "datagram of %llu bytes.\n", call_name(call), fd,
+                    (unsigned long long) len);
+        }
+
+        copies = 2;
+    }
+
+    after = get_udp_reorder() && fd_chance(st, get_udp_reorder());
+    delay = get_udp_delay() ? delay_ns(st, get_udp_delay()) : 0;
+
+    if (delay == 0 && !after) {
+        rc = (*orig_sendmsg)(fd, msg, flags);
+
+        if (rc >= 0 && copies == 2) {
+            (void) (*orig_sendmsg)(fd, msg, flags);
+        }
+
+        if (copies == 2) {
+            probe5(write, call_name(call), fd, len, rc,
+                   MOCKEAGAIN_TRACE_DUPLICATED);
+        }
+
+        trace(call, fd, len, rc,
+              copies == 2 ? MOCKEAGAIN_TRACE_DUPLICATED : 0);
+
+        if (rc >= 0 && __atomic_load_n(&st->dgrams, __ATOMIC_RELAXED)) {
+            dgram_lock_acquire();
+            dgram_passed(st, copies);
+            dgram_lock_release();
+
+            (void) dgram_flush();
+        }
+
+        return rc;
+    }
+
+    now = now_ns();
+
+    /* the copies are made before the lock is taken */
+    for (i = 0; i < copies; i++) {
+        /* a duplicate is never reordered along with the original */
+        due[i] = now + delay
+                 + (i == 0 && after ? DGRAM_REORDER_HOLD * 1000000 : 0);
+        d[i] = dgram_create(fd, msg, len, flags, due[i], i == 0 && after);
+    }
+
+    dgram_lock_acquire();
+
+    for (i = 0; i < copies; i++) {
+        held[i] = d[i] && dgram_hold(fd, st, d[i]) == 0;
+    }
+
+    dgram_lock_release();
+
+    for (i = 0; i < copies; i++) {
+        if (d[i] == NULL) {
+            continue;
+        }
+
+        if (!held[i]) {
+            if (get_verbose_level()) {
+                fprintf(stderr, "mockeagain: \"%s\" on fd %d: dropping a "
+                        "datagram of %llu bytes for the queue is full.\n",
+                        call_name(call), fd, (unsigned long long) len);
+            }
+
+            free(d[i]);
+            continue;
+        }
+
+        if (get_verbose_level()) {
+            fprintf(stderr, "mockeagain: \"%s\" on fd %d: holding back a "
+                    "datagram of %llu bytes for %d ms%s.\n", call_name(call),
+                    fd, (unsigned long long) len, ms_until(due[i]),
+                    i == 0 && after ? " to reorder it" : "");
+        }
+    }
+
+    probe5(write, call_name(call), fd, len, len,
+           MOCKEAGAIN_TRACE_HELD
+           | (copies == 2 ? MOCKEAGAIN_TRACE_DUPLICATED : 0));
+    trace(call, fd, len, len,
+          MOCKEAGAIN_TRACE_HELD
+          | (copies == 2 ? MOCKEAGAIN_TRACE_DUPLICATED : 0));
+
+    /* a datagram sent right away still lets the reordered ones go */
+    (void) dgram_flush();
+
+    return len;
+}
+
+
+/* a copy of a datagram to hold back, made before dgram_lock is taken */
+
+static dgram_t *
+dgram_create(int fd, const struct msghdr *msg, size_t len, int flags,
+    uint64_t due, int after)
+{
+    int                  i;
+    u_char              *p;
+    dgram_t             *d;
+
+    d = malloc(offsetof(dgram_t, data) + len);
+    if (d == NULL) {
+        return NULL;
+    }
+
+    d->next = NULL;
+    d->due = due;
+    d->fd = fd;
+    d->after = after;
+    d->flags = flags | MSG_DONTWAIT;
+    d->addrlen = 0;
+    d->len = len;
+
+    if (msg->msg_name && msg->msg_namelen <= sizeof(d->addr)) {
+        memcpy(&d->addr, msg->msg_name, msg->msg_namelen);
+        d->addrlen = msg->msg_namelen;
+    }
+
+    p = d->data;
+
+    for (i = 0; i < (int) msg->msg_iovlen; i++) {
+        memcpy(p, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        p += msg->msg_iov[i].iov_len;
+    }
+
+    return d;
+}
+
+
+/*
+ * Links a datagram into the queue of the fd, under dgram_lock, to go out
+ * once it is due and the given number of datagrams sent after it have
+ * gone out. Returns -1 for the datagrams beyond DGRAM_QUEUE_SIZE, which
+ * are dropped like by a full qdisc.
+ */
+
+static int
+dgram_hold(int fd, fd_state_t *st, dgram_t *d)
+{
+    int                  n;
+    dgram_t            **last;
+
+    n = 0;
+
+    for (last = &st->dgrams; *last; last = &(*last)->next) {
+        n++;
+    }
+
+    if (n == DGRAM_QUEUE_SIZE) {
+        return -1;
+    }
+
+    if (st->dgrams == NULL) {
+        /* link the fd into the list of the fds with held datagrams */
+        st->dgram_next = dgram_fds;
+        __atomic_store_n(&dgram_fds, fd + 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(last, d, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+
+/* n more datagrams of the fd have gone out, which may be due for others */
+
+static void
+dgram_passed(fd_state_t *st, int n)
+{
+    dgram_t             *d;
+
+    for (d = st->dgrams; d; d = d->next) {
+        if (d->after == 0) {
+            continue;
+        }
+
+        d->after -= n < d->after ? n : d->after;
+
+        if (d->after == 0) {
+            d->due = 0;
+        }
+    }
+}
+
+
+/*
+ * Unlinks the held datagrams of the fd that are due by now, in order, onto
+ * the list ending at *last, under dgram_lock. Returns when the next one
+ * left is due, or 0 if none is left.
+ */
+
+static uint64_t
+dgram_release(fd_state_t *st, uint64_t now, dgram_t ***last)
+{
+    uint64_t             next;
+    dgram_t             *d, **prev;
+
+    prev = &st->dgrams;
+
+    while (*prev) {
+        d = *prev;
+
+        if (d->due > now) {
+            prev = &d->next;
+            continue;
+        }
+
+        __atomic_store_n(prev, d->next, __ATOMIC_RELAXED);
+
+        d->next = NULL;
+        **last = d;
+        *last = &d->next;
+
+        dgram_passed(st, 1);
+
+        /* the datagrams before it may have just become due */
+        prev = &st->dgrams;
+    }
+
+    next = 0;
+
+    for (d = st->dgrams; d; d = d->next) {
+        if (next == 0 || d->due < next) {
+            next = d->due;
+        }
+    }
+
+    return next;
+}
+
+
+/*
+ * Sends out all the held datagrams that are due by now, after releasing
+ * dgram_lock. Returns the number of milliseconds until the next one is
+ * due, or -1 if none is held.
+ */
+
+static int
+dgram_flush()
+{
+    int                  fd, *link;
+    uint64_t             now, due, next;
+    dgram_t             *d, *due_list, **last;
+    fd_state_t          *st;
+    struct iovec         iov;
+    struct msghdr        msg;
+
+    if (__atomic_load_n(&dgram_fds, __ATOMIC_RELAXED) == 0) {
+        return -1;
+    }
+
+    now = now_ns();
+    next = 0;
+
+    due_list = NULL;
+    last = &due_list;
+
+    dgram_lock_acquire();
+
+    link = &dgram_fds;
+
+    while (*link) {
+        fd = *link - 1;
+        st = fd_state(fd);
+
+        due = dgram_release(st, now, &last);
+
+        if (st->dgrams == NULL) {
+            __atomic_store_n(link, st->dgram_next, __ATOMIC_RELAXED);
+            st->dgram_next = 0;
+            continue;
+        }
+
+        if (next == 0 || due < next) {
+            next = due;
+        }
+
+        link = &st->dgram_next;
+    }
+
+    dgram_lock_release();
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    while (due_list) {
+        d = due_list;
+        due_list = d->next;
+
+        iov.iov_base = d->data;
+        iov.iov_len = d->len;
+        msg.msg_name = d->addrlen ? &d->addr : NULL;
+        msg.msg_namelen = d->addrlen;
+
+        if ((*orig_sendmsg)(d->fd, &msg, d->flags) == -1
+            && get_verbose_level())
+        {
+            fprintf(stderr, "mockeagain: failed to send a held datagram of "
+                    "%llu bytes on fd %d: %s\n",
+                    (unsigned long long) d->len, d->fd, strerror(errno));
+        }
+
+        free(d);
+    }
+
+    return next ? ms_until(next) : -1;
+}
+
+
+/*
+ * Called before a read on an fd with held datagrams. A blocking read
+ * cannot return before they would have gone out, like a reply to them,
+ * so it waits for them first.
+ */
+
+static void
+dgram_wait(int fd, fd_state_t *st)
+{
+    int                  ms;
+    struct timespec      ts;
+
+    for ( ;; ) {
+        ms = dgram_flush();
+
+        if (ms < 0
+            || __atomic_load_n(&st->dgrams, __ATOMIC_RELAXED) == NULL
+            || (fcntl(fd, F_GETFL) & O_NONBLOCK))
+        {
+            return;
+        }
+
+        nanosleep(ms_to_timespec(ms, &ts), NULL);
+    }
+}
+
+
+/* the datagrams still held when the fd is closed go out right away */
+
+static void
+dgram_close(int fd, fd_state_t *st)
+{
+    dgram_t             *d;
+
+    dgram_lock_acquire();
+
+    for (d = st->dgrams; d; d = d->next) {
+        d->due = 0;
+    }
+
+    dgram_lock_release();
+
+    (void) dgram_flush();
+}
+
+
+static fd_state_t *
+fd_state(int fd)
+{
+    fd_state_t          *chunk;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    chunk = __atomic_load_n(&fd_chunks[fd >> FD_CHUNK_BITS],
+                            __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    return &chunk[fd & FD_CHUNK_MASK];
+}
+
+
+static fd_state_t *
+fd_state_alloc(int fd)
+{
+    void                *chunk;
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (fd_state(fd) == NULL) {
+        void            *expected = NULL;
+
+        if (posix_memalign(&chunk, CACHE_LINE_SIZE,
+                           FD_CHUNK_SIZE * sizeof(fd_state_t))
+            != 0)
+        {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+            return NULL;
+        }
+
+        memset(chunk, 0, FD_CHUNK_SIZE * sizeof(fd_state_t));
+
+        if (!__atomic_compare_exchange_n(&fd_chunks[fd >> FD_CHUNK_BITS],
+                                         &expected, chunk, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            /* another thread has won the race */
+            free(chunk);
+        }
+    }
+
+    return fd_state(fd);
+}
+
+
+static void
+fd_state_reset(fd_state_t *st)
+{
+    dgram_t             *d, *dgrams;
+#if __linux__
+    int                  queue, next;
+    unsigned short       queued;
+
+    /* the fd or the fds queued on it may still be linked into a queue */
+    queue = st->epoll_queue;
+    next = st->epoll_next;
+    queued = fd_flags(st) & FD_EPOLL_QUEUED;
+#endif
+
+    /*
+     * So may it be into the list of fds with held datagrams, which is left
+     * to dgram_flush() to unlink it from, so the lock is only needed when
+     * it holds some.
+     */
+
+    dgrams = NULL;
+
+    if (__atomic_load_n(&st->dgrams, __ATOMIC_RELAXED)) {
+        dgram_lock_acquire();
+
+        dgrams = st->dgrams;
+        __atomic_store_n(&st->dgrams, NULL, __ATOMIC_RELAXED);
+
+        dgram_lock_release();
+    }
+
+    while (dgrams) {
+        d = dgrams;
+        dgrams = d->next;
+        free(d);
+    }
+
+    matcher_free(st->wpatterns);
+    matcher_free(st->rpatterns);
+#if __linux__
+    free(st->epoll_regs);
+#endif
+
+    /* dgram_next comes last, and is left alone */
+    memset(st, 0, offsetof(fd_state_t, dgram_next));
+
+#if __linux__
+    st->epoll_queue = queue;
+    st->epoll_next = next;
+    st->flags = queued;
+#endif
+}
+
+
+static void
+load_conf()
+{
+    const char          *p;
+    int                  type, level;
+    long long            size;
+
+    /*
+     * The setenv() family and the control file watcher may both reload,
+     * and the settings opening files must not race each other.
+     */
+    pthread_mutex_lock(&conf_lock);
+
+    /* the control file overrides the environment, so it goes first */
+    load_control(get_verbose_level());
+
+    p = conf_getenv("MOCKEAGAIN_VERBOSE");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_VERBOSE env empty");
+        level = 0;
+
+    } else if (*p >= '0' && *p <= '9') {
+        dd("MOCKEAGAIN_VERBOSE env value: %s", p);
+        level = *p - '0';
+
+    } else {
+        dd("bad verbose env value: %s", p);
+        level = 0;
+    }
+
+    __atomic_store_n(&verbose, level, __ATOMIC_RELAXED);
+
+    type = 0;
+
+    p = conf_getenv("MOCKEAGAIN");
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN env empty");
+        /* type = MOCKING_WRITES; */
+
+    } else {
+        while (*p) {
+            if (*p == 'r' || *p == 'R') {
+                type |= MOCKING_READS;
+
+            } else if (*p == 'w' || *p == 'W') {
+                type |= MOCKING_WRITES;
+            }
+
+            p++;
+        }
+
+        if (type == 0) {
+            type = MOCKING_WRITES;
+        }
+    }
+
+    dd("mocking_type %d", type);
+
+    __atomic_store_n(&mocking_type, type, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&write_timeout_offset,
+                     parse_size("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&read_timeout_offset,
+                     parse_size("MOCKEAGAIN_READ_TIMEOUT_OFFSET"),
+                     __ATOMIC_RELAXED);
+
+    size = parse_size("MOCKEAGAIN_WRITE_BUFFER");
+
+    __atomic_store_n(&write_buffer, size > 0 ? size : DEFAULT_WRITE_BUFFER,
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&write_rate, parse_size("MOCKEAGAIN_WRITE_RATE"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&latency, parse_delay("MOCKEAGAIN_LATENCY"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&eagain_chance,
+                     parse_chance("MOCKEAGAIN_EAGAIN_PROBABILITY"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&short_chance,
+                     parse_chance("MOCKEAGAIN_SHORT_PROBABILITY"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&udp_loss, parse_chance("MOCKEAGAIN_UDP_LOSS"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&udp_duplicate, parse_chance("MOCKEAGAIN_UDP_DUPLICATE"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&udp_reorder, parse_chance("MOCKEAGAIN_UDP_REORDER"),
+                     __ATOMIC_RELAXED);
+
+    __atomic_store_n(&udp_delay, parse_delay("MOCKEAGAIN_UDP_DELAY"),
+                     __ATOMIC_RELAXED);
+
+    load_seed(level);
+
+    load_trace(level);
+
+    load_stats(level);
+
+    load_record(level);
+
+    load_matcher("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN", &write_matcher,
+                 "write timeout pattern", level);
+
+    load_matcher("MOCKEAGAIN_READ_TIMEOUT_PATTERN", &read_matcher,
+                 "read timeout pattern", level);
+
+    load_chunk_conf(level);
+
+    load_target_conf(level);
+
+    load_schedule_conf(level);
+
+    load_replay_conf(level);
+
+    pthread_mutex_unlock(&conf_lock);
+}
+
+
+static void
+load_matcher(const char *name, matcher_t **matcher, const char *what,
+    int level)
+{
+    int                  i;
+    const char          *p;
+    matcher_t           *m;
+
+    p = conf_getenv(name);
+    m = __atomic_load_n(matcher, __ATOMIC_ACQUIRE);
+
+    if (p == NULL || *p == '\0') {
+        dd("%s env empty", name);
+
+        if (m) {
+            __atomic_store_n(matcher, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    if (m && strcmp(m->spec, p) == 0) {
+        return;
+    }
+
+    /* a bad pattern list disables the timeouts */
+    m = matcher_create(p);
+
+    /*
+     * Other threads may still be running the old matcher, so it is never
+     * freed; the fds it was used on start over with the new one.
+     */
+    __atomic_store_n(matcher, m, __ATOMIC_RELEASE);
+
+    if (m && level) {
+        for (i = 0; i < m->npatterns; i++) {
+            fprintf(stderr, "mockeagain: reading %s %d: %.*s\n", what,
+                    i + 1, (int) m->src_lens[i], m->srcs[i]);
+        }
+    }
+}
+
+
+static void
+load_chunk_conf(int level)
+{
+    const char          *p;
+    chunk_conf_t        *conf;
+
+    p = conf_getenv("MOCKEAGAIN_CHUNK_SIZE");
+    conf = get_chunk_conf();
+
+    if (p == NULL || *p == '\0') {
+        dd("MOCKEAGAIN_CHUNK_SIZE env empty");
+
+        if (conf) {
+            __atomic_store_n(&chunk_conf, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    if (conf && strcmp(conf->spec, p) == 0) {
+        return;
+    }
+
+    /* a bad value falls back to 1 byte; the old one is never freed */
+    conf = chunk_conf_create(p);
+
+    __atomic_store_n(&chunk_conf, conf, __ATOMIC_RELEASE);
+
+    if (conf && level) {
+        fprintf(stderr, "mockeagain: reading chunk sizes: %s\n", conf->spec);
+    }
+}
+
+
+/*
+ * Parses a list of chunk sizes separated by ",", each of which is either
+ * a fixed size or a range like "1400-1460", optionally followed by its
+ * weight like in "1:90,1400-1460:10".
+ */
+
+static chunk_conf_t *
+chunk_conf_create(const char *spec)
+{
+    int                  i, n;
+    char                *end;
+    const char          *p;
+    unsigned long        weight, total;
+    chunk_range_t       *range;
+    chunk_conf_t        *conf;
+
+    n = 1;
+    for (p = spec; *p; p++) {
+        if (*p == ',') {
+            n++;
+        }
+    }
+
+    conf = calloc(1, sizeof(chunk_conf_t));
+    if (conf == NULL) {
+        goto nomem;
+    }
+
+    conf->spec = strdup(spec);
+    conf->ranges = calloc(n, sizeof(chunk_range_t));
+
+    if (conf->spec == NULL || conf->ranges == NULL) {
+        goto nomem;
+    }
+
+    conf->nranges = n;
+
+    total = 0;
+    p = spec;
+
+    for (i = 0; i < n; i++) {
+        range = &conf->ranges[i];
+
+        if (*p < '0' || *p > '9') {
+            goto invalid;
+        }
+
+        range->min = strtoul(p, &end, 10);
+        range->max = range->min;
+        p = end;
+
+        if (*p == '-') {
+            p++;
+
+            if (*p < '0' || *p > '9') {
+                goto invalid;
+            }
+
+            range->max = strtoul(p, &end, 10);
+            p = end;
+        }
+
+        weight = 1;
+
+        if (*p == ':') {
+            p++;
+
+            if (*p < '0' || *p > '9') {
+                goto invalid;
+            }
+
+            weight = strtoul(p, &end, 10);
+            p = end;
+        }
+
+        if (range->min == 0 || range->max < range->min
+            || weight == 0 || weight > 1000000)
+        {
+            goto invalid;
+        }
+
+        total += weight;
+        range->weight = total;
+
+        if (*p != (i == n - 1 ? '\0' : ',')) {
+            goto invalid;
+        }
+
+        p++;
+    }
+
+    return conf;
+
+invalid:
+
+    fprintf(stderr, "mockeagain: ignoring bad MOCKEAGAIN_CHUNK_SIZE value: "
+            "%s\n", spec);
+    goto failed;
+
+nomem:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+
+failed:
+
+    if (conf) {
+        free(conf->spec);
+        free(conf->ranges);
+        free(conf);
+    }
+
+    return NULL;
+}
+
+
+static void
+load_target_conf(int level)
+{
+    const char          *p;
+    target_conf_t       *conf;
+
+    p = conf_getenv("MOCKEAGAIN_TARGET");
+    conf = get_target_conf();
+
+    if (p == NULL || *p == '\0') {
+        if (conf) {
+            __atomic_store_n(&target_conf, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    if (conf && strcmp(conf->spec, p) == 0) {
+        return;
+    }
+
+    /* a bad value mocks every fd; the old one is never freed */
+    conf = target_conf_create(p);
+
+    if (conf) {
+        __atomic_store_n(&fd_mocking, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&target_conf, conf, __ATOMIC_RELEASE);
+
+    if (conf && level) {
+        fprintf(stderr, "mockeagain: reading target rules: %s\n", conf->spec);
+    }
+}
+
+
+/*
+ * The rules are separated by commas and their conditions by spaces, like
+ * in "accepted local=:8080, !peer=[::1]:9125, connected peer=10.0.0.0/8".
+ */
+
+static target_conf_t *
+target_conf_create(const char *spec)
+{
+    int                  n;
+    char                *buf, *rule, *cond, *r, *c;
+    const char          *p;
+    target_rule_t       *tr;
+    target_conf_t       *conf;
+
+    n = 1;
+    for (p = spec; *p; p++) {
+        if (*p == ',') {
+            n++;
+        }
+    }
+
+    buf = strdup(spec);
+    conf = calloc(1, sizeof(target_conf_t));
+
+    if (buf == NULL || conf == NULL) {
+        goto nomem;
+    }
+
+    conf->spec = strdup(spec);
+    conf->rules = calloc(n, sizeof(target_rule_t));
+
+    if (conf->spec == NULL || conf->rules == NULL) {
+        goto nomem;
+    }
+
+    for (rule = strtok_r(buf, ",", &r); rule; rule = strtok_r(NULL, ",", &r))
+    {
+        tr = &conf->rules[conf->nrules];
+
+        for (cond = strtok_r(rule, " \t", &c); cond;
+             cond = strtok_r(NULL, " \t", &c))
+        {
+            if (*cond == '!') {
+                tr->exclude = 1;
+                cond++;
+
+                if (*cond == '\0') {
+                    continue;
+                }
+            }
+
+            if (strcmp(cond, "accepted") == 0) {
+                tr->direction = FD_TARGET_ACCEPTED;
+
+            } else if (strcmp(cond, "connected") == 0) {
+                tr->direction = FD_TARGET_CONNECTED;
+
+            } else if (strcmp(cond, "inet") == 0) {
+                tr->family = AF_INET;
+
+            } else if (strcmp(cond, "inet6") == 0) {
+                tr->family = AF_INET6;
+
+            } else if (strcmp(cond, "unix") == 0) {
+                tr->family = AF_UNIX;
+
+            } else if (strncmp(cond, "local=", 6) == 0) {
+                if (parse_target_addr(cond + 6, &tr->local) != 0) {
+                    goto invalid;
+                }
+
+                tr->has_local = 1;
+
+            } else if (strncmp(cond, "peer=", 5) == 0) {
+                if (parse_target_addr(cond + 5, &tr->peer) != 0) {
+                    goto invalid;
+                }
+
+                tr->has_peer = 1;
+
+            } else {
+                goto invalid;
+            }
+        }
+
+        if (!tr->exclude) {
+            conf->include = 1;
+        }
+
+        conf->nrules++;
+    }
+
+    free(buf);
+
+    return conf;
+
+invalid:
+
+    fprintf(stderr, "mockeagain: ignoring bad MOCKEAGAIN_TARGET value: %s\n",
+            spec);
+    goto failed;
+
+nomem:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+
+failed:
+
+    if (conf) {
+        free(conf->spec);
+        free(conf->rules);
+        free(conf);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+
+/*
+ * Parses an address like "127.0.0.1", "10.0.0.0/8:80", "[::1]:8080",
+ * "[fd00::/8]" or ":8000-8100", where an empty host or "*" is any host.
+ */
+
+static int
+parse_target_addr(const char *p, target_addr_t *a)
+{
+    int                  max;
+    char                 host[INET6_ADDRSTRLEN + 4], *slash, *end;
+    size_t               len;
+    const char          *e;
+
+    memset(a, 0, sizeof(target_addr_t));
+    a->port_max = 65535;
+
+    if (*p == '[') {
+        e = strchr(p, ']');
+        if (e == NULL) {
+            return -1;
+        }
+
+        p++;
+        a->family = AF_INET6;
+        max = 128;
+
+    } else {
+        e = strchr(p, ':');
+        if (e == NULL) {
+            e = p + strlen(p);
+        }
+
+        a->family = AF_INET;
+        max = 32;
+    }
+
+    len = e - p;
+    if (len >= sizeof(host)) {
+        return -1;
+    }
+
+    memcpy(host, p, len);
+    host[len] = '\0';
+
+    p = *e == ']' ? e + 1 : e;
+
+    if (host[0] == '\0' || strcmp(host, "*") == 0) {
+        a->family = 0;
+
+    } else {
+        a->prefix = max;
+
+        slash = strchr(host, '/');
+        if (slash) {
+            *slash++ = '\0';
+
+            if (*slash < '0' || *slash > '9') {
+                return -1;
+            }
+
+            a->prefix = strtol(slash, &end, 10);
+            if (*end != '\0' || a->prefix > max) {
+                return -1;
+            }
+        }
+
+        if (inet_pton(a->family, host, a->addr) != 1) {
+            return -1;
+        }
+    }
+
+    if (*p == '\0') {
+        return 0;
+    }
+
+    if (*p != ':' || p[1] < '0' || p[1] > '9') {
+        return -1;
+    }
+
+    a->port_min = strtoul(p + 1, &end, 10);
+    a->port_max = a->port_min;
+
+    if (*end == '-') {
+        if (end[1] < '0' || end[1] > '9') {
+            return -1;
+        }
+
+        a->port_max = strtoul(end + 1, &end, 10);
+    }
+
+    if (*end != '\0' || a->port_max > 65535 || a->port_min > a->port_max) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int
+target_addr_match(const target_addr_t *a, const struct sockaddr *sa)
+{
+    int                  family, n, bits;
+    unsigned             port;
+    const u_char        *addr;
+
+    if (sa == NULL) {
+        return 0;
+    }
+
+    if (sa->sa_family == AF_INET) {
+        family = AF_INET;
+        addr = (const u_char *) &((const struct sockaddr_in *) sa)->sin_addr;
+        port = ntohs(((const struct sockaddr_in *) sa)->sin_port);
+
+    } else if (sa->sa_family == AF_INET6) {
+        addr = ((const struct sockaddr_in6 *) sa)->sin6_addr.s6_addr;
+        port = ntohs(((const struct sockaddr_in6 *) sa)->sin6_port);
+
+        /* the IPv4 peers of a dual-stack socket match the IPv4 rules */
+        if (IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *) sa)
+                                 ->sin6_addr))
+        {
+            family = AF_INET;
+            addr += 12;
+
+        } else {
+            family = AF_INET6;
+        }
+
+    } else {
+        /* no addresses for the others */
+        return 0;
+    }
+
+    if (port < a->port_min || port > a->port_max) {
+        return 0;
+    }
+
+    if (a->family == 0) {
+        return 1;
+    }
+
+    if (a->family != family) {
+        return 0;
+    }
+
+    n = a->prefix / 8;
+    bits = a->prefix % 8;
+
+    if (memcmp(addr, a->addr, n) != 0) {
+        return 0;
+    }
+
+    return bits == 0
+           || ((addr[n] ^ a->addr[n]) & (0xff << (8 - bits)) & 0xff) == 0;
+}
+
+
+/*
+ * Matches the fd against the rules and caches the outcome in its state,
+ * returning its new mocking field. The peer is looked up unless given.
+ */
+
+static int
+target_decide(int fd, fd_state_t *st, const struct sockaddr *peer,
+    socklen_t peerlen)
+{
+    int                          i, err, mocking, family, skip;
+    socklen_t                    len;
+    struct sockaddr_storage      local_ss, peer_ss;
+    const struct sockaddr       *local;
+    const target_rule_t         *r;
+    const target_conf_t         *conf;
+
+    conf = get_target_conf();
+    if (conf == NULL) {
+        return __atomic_load_n(&st->mocking, __ATOMIC_RELAXED);
+    }
+
+    err = errno;
+
+    len = sizeof(local_ss);
+    local = getsockname(fd, (struct sockaddr *) &local_ss, &len) == 0
+            ? (const struct sockaddr *) &local_ss : NULL;
+
+    if (peer == NULL || peerlen < sizeof(sa_family_t)) {
+        len = sizeof(peer_ss);
+        peer = getpeername(fd, (struct sockaddr *) &peer_ss, &len) == 0
+               ? (const struct sockaddr *) &peer_ss : NULL;
+    }
+
+    family = local ? local->sa_family : peer ? peer->sa_family : AF_UNSPEC;
+
+    mocking = __atomic_load_n(&st->mocking, __ATOMIC_RELAXED);
+
+    /* with only "!" rules, the fds matching none of them are mocked */
+    skip = conf->include;
+
+    for (i = 0; i < conf->nrules; i++) {
+        r = &conf->rules[i];
+
+        if ((r->direction && !(mocking & r->direction))
+            || (r->family && r->family != family)
+            || (r->has_local && !target_addr_match(&r->local, local))
+            || (r->has_peer && !target_addr_match(&r->peer, peer)))
+        {
+            continue;
+        }
+
+        skip = r->exclude;
+        break;
+    }
+
+    (void) __atomic_fetch_and(&st->mocking, ~FD_TARGET_SKIP,
+                              __ATOMIC_RELAXED);
+    mocking = __atomic_or_fetch(&st->mocking,
+                                FD_TARGET_DONE | (skip ? FD_TARGET_SKIP : 0),
+                                __ATOMIC_RELAXED);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: fd %d is %s by the target rules.\n",
+                fd, skip ? "left alone" : "picked");
+    }
+
+    errno = err;
+
+    return mocking;
+}
+
+
+static void
+load_schedule_conf(int level)
+{
+    const char          *p;
+    schedule_conf_t     *conf;
+
+    p = conf_getenv("MOCKEAGAIN_SCHEDULE");
+    conf = get_schedule_conf();
+
+    if (p == NULL || *p == '\0') {
+        if (conf) {
+            __atomic_store_n(&schedule_conf, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    /* the file is only read again when the path is changed */
+    if (conf && strcmp(conf->path, p) == 0) {
+        return;
+    }
+
+    /* the old one is never freed, since the fds may still follow it */
+    conf = schedule_conf_create(p);
+
+    if (conf) {
+        __atomic_store_n(&fd_mocking, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&schedule_conf, conf, __ATOMIC_RELEASE);
+
+    if (conf && level) {
+        fprintf(stderr, "mockeagain: reading %d schedules from %s\n",
+                conf->nschedules, conf->path);
+    }
+}
+
+
+/*
+ * Every line of the file gives the steps of the nth accepted or connected
+ * fd of the process, like in
+ *
+ *     accepted 1: read all all 7 eagain*2; write 100*3 eagain
+ *
+ * where every step is taken by a single call, or by as many as given
+ * after a "*": a number of bytes to transfer at most, "all" to let the
+ * call through or "eagain" to fail it. The calls after the last step are
+ * let through.
+ */
+
+static schedule_conf_t *
+schedule_conf_create(const char *path)
+{
+    int                  line_no = 0;
+    char                *line = NULL, *p;
+    size_t               size = 0;
+    ssize_t              n;
+    FILE                *f;
+    schedule_conf_t     *conf;
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        fprintf(stderr, "mockeagain: failed to open MOCKEAGAIN_SCHEDULE "
+                "file %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    conf = calloc(1, sizeof(schedule_conf_t));
+    if (conf == NULL || (conf->path = strdup(path)) == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        goto failed;
+    }
+
+    while ((n = getline(&line, &size, f)) != -1) {
+        line_no++;
+
+        p = strchr(line, '#');
+        if (p) {
+            *p = '\0';
+        }
+
+        p = line + strspn(line, " \t\r\n");
+        if (*p == '\0') {
+            continue;
+        }
+
+        if (parse_schedule_line(p, conf) != 0) {
+            fprintf(stderr, "mockeagain: ignoring bad MOCKEAGAIN_SCHEDULE "
+                    "file %s: line %d\n", path, line_no);
+            goto failed;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    return conf;
+
+failed:
+
+    schedule_conf_free(conf);
+
+    free(line);
+    fclose(f);
+
+    return NULL;
+}
+
+
+static int
+parse_schedule_line(char *line, schedule_conf_t *conf)
+{
+    int                  connected;
+    char                *colon, *who, *nth, *step, *end, *r;
+    unsigned long        ordinal;
+    schedule_t           s, **slot;
+
+    memset(&s, 0, sizeof(schedule_t));
+
+    colon = strchr(line, ':');
+    if (colon == NULL) {
+        return -1;
+    }
+
+    *colon = '\0';
+
+    who = strtok_r(line, " \t", &r);
+    nth = strtok_r(NULL, " \t", &r);
+
+    if (who == NULL || nth == NULL || strtok_r(NULL, " \t", &r)) {
+        return -1;
+    }
+
+    if (strcmp(who, "accepted") == 0) {
+        connected = 0;
+
+    } else if (strcmp(who, "connected") == 0) {
+        connected = 1;
+
+    } else {
+        return -1;
+    }
+
+    errno = 0;
+    ordinal = strtoul(nth, &end, 10);
+
+    if (*end != '\0' || errno || ordinal == 0 || *nth == '-'
+        || ordinal >= MOCKEAGAIN_RECORD_CONNECTED)
+    {
+        return -1;
+    }
+
+    for (step = strtok_r(colon + 1, ";", &r); step;
+         step = strtok_r(NULL, ";", &r))
+    {
+        if (parse_schedule_steps(step, &s) != 0) {
+            goto failed;
+        }
+    }
+
+    slot = schedule_slot(conf, connected, ordinal);
+    if (slot == NULL || *slot) {
+        goto failed;
+    }
+
+    *slot = malloc(sizeof(schedule_t));
+    if (*slot == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        goto failed;
+    }
+
+    **slot = s;
+    conf->nschedules++;
+
+    return 0;
+
+failed:
+
+    free(s.steps[0]);
+    free(s.steps[1]);
+
+    return -1;
+}
+
+
+/* the steps of a "read" or "write" clause, separated by spaces */
+
+static int
+parse_schedule_steps(char *p, schedule_t *s)
+{
+    int                  write;
+    char                *word, *star, *end, *r;
+    schedule_step_t     *steps, *st;
+
+    word = strtok_r(p, " \t\r\n", &r);
+    if (word == NULL) {
+        return 0;
+    }
+
+    if (strcmp(word, "write") == 0) {
+        write = 1;
+
+    } else if (strcmp(word, "read") == 0) {
+        write = 0;
+
+    } else {
+        return -1;
+    }
+
+    if (s->steps[write]) {
+        return -1;
+    }
+
+    while ((word = strtok_r(NULL, " \t\r\n", &r)) != NULL) {
+        steps = realloc(s->steps[write],
+                        (s->nsteps[write] + 1) * sizeof(schedule_step_t));
+        if (steps == NULL) {
+            fprintf(stderr, "mockeagain: ERROR: failed to allocate "
+                    "memory.\n");
+            return -1;
+        }
+
+        s->steps[write] = steps;
+        st = &steps[s->nsteps[write]++];
+        st->repeat = 1;
+
+        star = strchr(word, '*');
+        if (star) {
+            *star++ = '\0';
+
+            errno = 0;
+            st->repeat = strtoul(star, &end, 10);
+
+            if (*end != '\0' || errno || st->repeat == 0 || *star == '-') {
+                return -1;
+            }
+        }
+
+        if (strcmp(word, "all") == 0) {
+            st->size = SCHEDULE_ALL;
+
+        } else if (strcmp(word, "eagain") == 0) {
+            st->size = SCHEDULE_EAGAIN;
+
+        } else {
+            errno = 0;
+            st->size = strtoll(word, &end, 10);
+
+            if (*end != '\0' || errno || st->size <= 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/* the schedule of the nth accepted or connected fd, from 1 */
+
+static schedule_t **
+schedule_slot(schedule_conf_t *conf, int connected, unsigned ordinal)
+{
+    unsigned             n;
+    schedule_t         **index;
+
+    if (ordinal < conf->nindex[connected]) {
+        return &conf->index[connected][ordinal];
+    }
+
+    if (ordinal > SCHEDULE_MAX_ORDINAL) {
+        fprintf(stderr, "mockeagain: ERROR: the connection ordinal %u is "
+                "over %d.\n", ordinal, SCHEDULE_MAX_ORDINAL);
+        return NULL;
+    }
+
+    n = conf->nindex[connected] * 2;
+    if (n <= ordinal) {
+        n = ordinal + 1;
+    }
+
+    index = realloc(conf->index[connected], n * sizeof(schedule_t *));
+    if (index == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return NULL;
+    }
+
+    memset(index + conf->nindex[connected], 0,
+           (n - conf->nindex[connected]) * sizeof(schedule_t *));
+
+    conf->index[connected] = index;
+    conf->nindex[connected] = n;
+
+    return &index[ordinal];
+}
+
+
+static void
+schedule_conf_free(schedule_conf_t *conf)
+{
+    int                  c;
+    unsigned             i;
+    schedule_t          *s;
+
+    if (conf == NULL) {
+        return;
+    }
+
+    for (c = 0; c < 2; c++) {
+        for (i = 0; i < conf->nindex[c]; i++) {
+            s = conf->index[c][i];
+
+            if (s) {
+                free(s->steps[0]);
+                free(s->steps[1]);
+                free(s->events);
+                free(s);
+            }
+        }
+
+        free(conf->index[c]);
+    }
+
+    free(conf->path);
+    free(conf);
+}
+
+
+/*
+ * Counts the fds accepted or connected, which are then known by their
+ * ordinals to the recordings and the schedules, and hands the schedule of
+ * its ordinal to the fd, if any. A replay takes over the schedules.
+ */
+
+static void
+conn_assign(int fd, int direction)
+{
+    int                          connected;
+    unsigned                     n;
+    fd_state_t                  *st;
+    const schedule_t            *s = NULL;
+    const schedule_conf_t       *conf;
+
+    connected = (direction == FD_TARGET_CONNECTED);
+
+    n = __atomic_add_fetch(connected ? &connected_seq : &accepted_seq, 1,
+                           __ATOMIC_RELAXED);
+
+    conf = get_replay_conf();
+    if (conf == NULL) {
+        conf = get_schedule_conf();
+    }
+
+    if (conf && n < conf->nindex[connected]) {
+        s = conf->index[connected][n];
+    }
+
+    if (s == NULL && get_record_file() == NULL) {
+        return;
+    }
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        return;
+    }
+
+    st->conn = n | (connected ? MOCKEAGAIN_RECORD_CONNECTED : 0);
+
+    if (s == NULL) {
+        return;
+    }
+
+    st->step[0] = 0;
+    st->step[1] = 0;
+    st->taken[0] = 0;
+    st->taken[1] = 0;
+    st->ncalls = 0;
+    st->event = 0;
+
+    __atomic_store_n(&st->schedule, s, __ATOMIC_RELEASE);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: fd %d is %s fd %u, following its "
+                "%s.\n", fd, connected ? "connected" : "accepted", n,
+                conf == get_replay_conf() ? "recording" : "schedule");
+    }
+}
+
+
+static void
+load_replay_conf(int level)
+{
+    const char          *p;
+    schedule_conf_t     *conf;
+
+    p = conf_getenv("MOCKEAGAIN_REPLAY");
+    conf = get_replay_conf();
+
+    if (p == NULL || *p == '\0') {
+        if (conf) {
+            __atomic_store_n(&replay_conf, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    if (conf && strcmp(conf->path, p) == 0) {
+        return;
+    }
+
+    /* the old one is never freed, since the fds may still follow it */
+    conf = replay_conf_create(p);
+
+    if (conf) {
+        __atomic_store_n(&fd_mocking, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&replay_conf, conf, __ATOMIC_RELEASE);
+
+    if (conf && level) {
+        fprintf(stderr, "mockeagain: replaying %d connections from %s\n",
+                conf->nschedules, conf->path);
+    }
+}
+
+
+/*
+ * Turns a recording into the schedules of its connections: every read or
+ * write recorded is replayed as a step returning at most the bytes it
+ * returned, or EAGAIN if it failed with it, and every withholding of events
+ * is replayed once the same reads and writes are done.
+ */
+
+static schedule_conf_t *
+replay_conf_create(const char *path)
+{
+    int                          fd, c, write;
+    size_t                       size = 0;
+    unsigned                     ordinal, k;
+    uint64_t                     i, n;
+    long long                    step_size;
+    struct stat                  sb;
+    schedule_t                 **slot, *s;
+    schedule_step_t             *step;
+    schedule_conf_t             *conf = NULL;
+    const mockeagain_record_t   *r, *recs;
+    mockeagain_record_header_t  *h = MAP_FAILED;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        goto failed;
+    }
+
+    size = sb.st_size;
+
+    if (size < sizeof(mockeagain_record_header_t)) {
+        goto invalid;
+    }
+
+    h = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto failed;
+    }
+
+    (void) (*orig_close)(fd);
+    fd = -1;
+
+    if (memcmp(h->magic, MOCKEAGAIN_RECORD_MAGIC, sizeof(h->magic)) != 0
+        || h->version != MOCKEAGAIN_RECORD_VERSION
+        || h->rec_size != sizeof(mockeagain_record_t))
+    {
+        goto invalid;
+    }
+
+    n = h->nrecords < h->max_records ? h->nrecords : h->max_records;
+
+    if (n > (size - sizeof(mockeagain_record_header_t))
+            / sizeof(mockeagain_record_t))
+    {
+        n = (size - sizeof(mockeagain_record_header_t))
+            / sizeof(mockeagain_record_t);
+    }
+
+    recs = mockeagain_record_recs(h);
+
+    conf = calloc(1, sizeof(schedule_conf_t));
+    if (conf == NULL || (conf->path = strdup(path)) == NULL) {
+        goto nomem;
+    }
+
+    /* the steps and events of every connection are counted first */
+
+    for (i = 0; i < n; i++) {
+        r = &recs[i];
+        ordinal = r->conn & ~MOCKEAGAIN_RECORD_CONNECTED;
+
+        if (r->op == 0 || r->op > MOCKEAGAIN_RECORD_EVENTS || ordinal == 0) {
+            continue;
+        }
+
+        slot = schedule_slot(conf, !!(r->conn & MOCKEAGAIN_RECORD_CONNECTED),
+                             ordinal);
+        if (slot == NULL) {
+            goto done;
+        }
+
+        if (*slot == NULL) {
+            *slot = calloc(1, sizeof(schedule_t));
+            if (*slot == NULL) {
+                goto nomem;
+            }
+
+            conf->nschedules++;
+        }
+
+        if (r->op == MOCKEAGAIN_RECORD_EVENTS) {
+            (*slot)->nevents++;
+
+        } else {
+            (*slot)->nsteps[r->op == MOCKEAGAIN_RECORD_WRITE]++;
+        }
+    }
+
+    for (c = 0; c < 2; c++) {
+        for (k = 0; k < conf->nindex[c]; k++) {
+            s = conf->index[c][k];
+            if (s == NULL) {
+                continue;
+            }
+
+            for (write = 0; write < 2; write++) {
+                if (s->nsteps[write]) {
+                    s->steps[write] = malloc(s->nsteps[write]
+                                             * sizeof(schedule_step_t));
+                    if (s->steps[write] == NULL) {
+                        goto nomem;
+                    }
+
+                    s->nsteps[write] = 0;
+                }
+            }
+
+            if (s->nevents) {
+                s->events = malloc(s->nevents * sizeof(schedule_event_t));
+                if (s->events == NULL) {
+                    goto nomem;
+                }
+
+                s->nevents = 0;
+            }
+        }
+    }
+
+    /* and then filled in, with the same steps in a row merged */
+
+    for (i = 0; i < n; i++) {
+        r = &recs[i];
+        ordinal = r->conn & ~MOCKEAGAIN_RECORD_CONNECTED;
+
+        if (r->op == 0 || r->op > MOCKEAGAIN_RECORD_EVENTS || ordinal == 0) {
+            continue;
+        }
+
+        s = conf->index[!!(r->conn & MOCKEAGAIN_RECORD_CONNECTED)][ordinal];
+
+        if (r->op == MOCKEAGAIN_RECORD_EVENTS) {
+            s->events[s->nevents].calls = s->ncalls;
+            s->events[s->nevents].events = r->value;
+            s->nevents++;
+            continue;
+        }
+
+        if ((r->flags & MOCKEAGAIN_TRACE_INJECTED) || r->err == EAGAIN) {
+            step_size = SCHEDULE_EAGAIN;
+
+        } else if (r->value > 0) {
+            step_size = r->value;
+
+        } else {
+            step_size = SCHEDULE_ALL;
+        }
+
+        write = (r->op == MOCKEAGAIN_RECORD_WRITE);
+        s->ncalls++;
+
+        step = s->nsteps[write] ? &s->steps[write][s->nsteps[write] - 1]
+                                : NULL;
+
+        if (step && step->size == step_size && step->repeat < UINT32_MAX) {
+            step->repeat++;
+            continue;
+        }
+
+        step = &s->steps[write][s->nsteps[write]++];
+        step->size = step_size;
+        step->repeat = 1;
+    }
+
+    munmap(h, size);
+
+    return conf;
+
+invalid:
+
+    fprintf(stderr, "mockeagain: ignoring MOCKEAGAIN_REPLAY file %s: not a "
+            "recording\n", path);
+    goto done;
+
+nomem:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+    goto done;
+
+failed:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to read the recording %s: "
+            "%s\n", path, strerror(errno));
+
+done:
+
+    if (fd != -1) {
+        (void) (*orig_close)(fd);
+    }
+
+    if (h != MAP_FAILED) {
+        munmap(h, size);
+    }
+
+    schedule_conf_free(conf);
+
+    return NULL;
+}
+
+
+/*
+ * The random seed is taken from MOCKEAGAIN_SEED, or made up at load time
+ * and printed in the verbose mode so that a failing run can be replayed.
+ */
+
+static void
+load_seed(int level)
+{
+    const char          *p;
+    char                *end;
+    uint64_t             seed, old;
+
+    old = get_random_seed();
+
+    p = conf_getenv("MOCKEAGAIN_SEED");
+
+    if (p == NULL || *p == '\0') {
+        if (old) {
+            /* keep the seed of the run */
+            return;
+        }
+
+        seed = now_ns() ^ (uint64_t) getpid() << 32;
+
+    } else {
+        errno = 0;
+        seed = strtoull(p, &end, 0);
+
+        if (errno || end == p || *end != '\0') {
+            fprintf(stderr, "mockeagain: ignoring bad MOCKEAGAIN_SEED "
+                    "value: %s\n", p);
+            return;
+        }
+    }
+
+    if (seed == old) {
+        return;
+    }
+
+    __atomic_store_n(&random_seed, seed, __ATOMIC_RELAXED);
+
+    if (level) {
+        fprintf(stderr, "mockeagain: random seed: %llu\n",
+                (unsigned long long) seed);
+    }
+}
+
+
+/*
+ * The trace file is <MOCKEAGAIN_TRACE>.<pid>, with a ring of
+ * MOCKEAGAIN_TRACE_SIZE bytes for each thread. A file once mapped is
+ * never unmapped, as other threads may still be writing to it.
+ */
+
+static void
+load_trace(int level)
+{
+    const char                  *p;
+    char                        *path = NULL;
+    int                          fd = -1;
+    size_t                       size;
+    long long                    bytes;
+    unsigned                     i;
+    struct timespec              ts;
+    mockeagain_trace_header_t   *h;
+
+    p = conf_getenv("MOCKEAGAIN_TRACE");
+
+    if (p == NULL || *p == '\0') {
+        __atomic_store_n(&trace_file, NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (get_trace_file() && trace_pid == getpid() && trace_path
+        && strcmp(trace_path, p) == 0)
+    {
+        return;
+    }
+
+    bytes = parse_size("MOCKEAGAIN_TRACE_SIZE");
+    if (bytes < (long long) sizeof(mockeagain_trace_rec_t)) {
+        bytes = 1024 * 1024;
+    }
+
+    size = mockeagain_trace_file_size(bytes / sizeof(mockeagain_trace_rec_t));
+
+    path = malloc(strlen(p) + sizeof(".4294967295"));
+    if (path == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    sprintf(path, "%s.%u", p, (unsigned) getpid());
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        goto failed;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        goto failed;
+    }
+
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto failed;
+    }
+
+    (void) (*orig_close)(fd);
+
+    memcpy(h->magic, MOCKEAGAIN_TRACE_MAGIC, sizeof(h->magic));
+    h->version = MOCKEAGAIN_TRACE_VERSION;
+    h->pid = getpid();
+    h->max_rings = MOCKEAGAIN_TRACE_MAX_RINGS;
+    h->ring_size = bytes / sizeof(mockeagain_trace_rec_t);
+    h->rec_size = sizeof(mockeagain_trace_rec_t);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    h->realtime = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    h->monotonic = now_ns();
+
+    for (i = 0; i < sizeof(trace_calls) / sizeof(trace_calls[0]); i++) {
+        strncpy(h->calls[i], trace_calls[i], MOCKEAGAIN_TRACE_NAME_LEN - 1);
+    }
+
+    /* a previous path is leaked along with its file */
+    trace_path = strdup(p);
+    trace_pid = getpid();
+    __atomic_store_n(&trace_file, h, __ATOMIC_RELEASE);
+
+    if (level) {
+        fprintf(stderr, "mockeagain: tracing to %s\n", path);
+    }
+
+    free(path);
+    return;
+
+failed:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to set up the trace file %s: "
+            "%s\n", path, strerror(errno));
+
+    if (fd != -1) {
+        (void) (*orig_close)(fd);
+    }
+
+    free(path);
+}
+
+
+static int
+trace_claim(mockeagain_trace_header_t *h)
+{
+    uint32_t             i;
+
+    trace_owner = h;
+    trace_ring = NULL;
+
+    i = __atomic_fetch_add(&h->nrings, 1, __ATOMIC_RELAXED);
+    if (i >= h->max_rings) {
+        /* the later threads go untraced */
+        return -1;
+    }
+
+    trace_ring = mockeagain_trace_ring(h, i);
+    trace_recs = mockeagain_trace_recs(h, i);
+
+#if __linux__
+    trace_ring->tid = syscall(SYS_gettid);
+#endif
+
+    return 0;
+}
+
+
+/* records a call in the trace file and in the counters of the process */
+static void
+trace(unsigned call, int fd, uint64_t requested, ssize_t returned,
+    int flags)
+{
+    int                          err;
+    uint64_t                     head;
+    mockeagain_trace_rec_t      *rec;
+    mockeagain_stats_call_t     *c;
+    mockeagain_stats_slot_t     *slot;
+    mockeagain_record_header_t  *rf;
+    mockeagain_trace_header_t   *h;
+
+    h = get_trace_file();
+    slot = get_stats_slot();
+    rf = get_record_file();
+
+    if (h == NULL && slot == NULL && rf == NULL) {
+        return;
+    }
+
+    if (slot) {
+        /* only this process updates the slot */
+        c = &slot->calls[call];
+
+        __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+
+        if (flags & MOCKEAGAIN_TRACE_INJECTED) {
+            __atomic_fetch_add(&c->injected, 1, __ATOMIC_RELAXED);
+        }
+
+        if ((flags & MOCKEAGAIN_TRACE_SHORT) && returned >= 0) {
+            __atomic_fetch_add(&c->shorts, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&c->cut, requested - returned,
+                               __ATOMIC_RELAXED);
+        }
+
+        if (flags & MOCKEAGAIN_TRACE_WITHHELD) {
+            __atomic_fetch_add(&c->withheld, 1, __ATOMIC_RELAXED);
+        }
+
+        if (flags & MOCKEAGAIN_TRACE_DROPPED) {
+            __atomic_fetch_add(&c->dropped, 1, __ATOMIC_RELAXED);
+        }
+
+        if (flags & MOCKEAGAIN_TRACE_DUPLICATED) {
+            __atomic_fetch_add(&c->duplicated, 1, __ATOMIC_RELAXED);
+        }
+
+        if (flags & MOCKEAGAIN_TRACE_HELD) {
+            __atomic_fetch_add(&c->held, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    err = errno;
+
+    if (rf) {
+        record(rf, fd, call, requested, returned, flags, err);
+    }
+
+    if (h == NULL) {
+        goto done;
+    }
+
+    if (trace_owner != h) {
+        (void) trace_claim(h);
+    }
+
+    if (trace_ring == NULL) {
+        goto done;
+    }
+
+    /* only this thread writes to the ring */
+    head = trace_ring->head;
+    rec = &trace_recs[head % h->ring_size];
+
+    rec->time = now_ns();
+    rec->requested = requested;
+    rec->returned = returned;
+    rec->fd = fd;
+    rec->call = call;
+    rec->flags = flags;
+    rec->err = returned == -1 ? err : 0;
+
+    __atomic_store_n(&trace_ring->head, head + 1, __ATOMIC_RELEASE);
+
+done:
+
+    errno = err;
+}
+
+
+static void
+trace_iov(unsigned call, int fd, const struct iovec *iov, int iovcnt,
+    ssize_t returned, int flags)
+{
+    if (get_trace_file() == NULL && get_stats_slot() == NULL
+        && get_record_file() == NULL)
+    {
+        return;
+    }
+
+    trace(call, fd, iov_total(iov, iovcnt), returned, flags);
+}
+
+
+/* the mocking type of an fd, which may have been set through the API */
+static int
+fd_mocking_type(int fd)
+{
+    int                  mocking;
+    fd_state_t          *st;
+
+    if (!get_fd_mocking()) {
+        return get_mocking_type();
+    }
+
+    st = get_target_conf() ? fd_state_alloc(fd) : fd_state(fd);
+    if (st == NULL) {
+        return get_mocking_type();
+    }
+
+    mocking = __atomic_load_n(&st->mocking, __ATOMIC_RELAXED);
+
+    if (mocking & FD_MOCKING_SET) {
+        return mocking & (MOCKING_READS | MOCKING_WRITES);
+    }
+
+    /* a schedule is followed whatever the global mocking type */
+    if (fd_scheduled(st)) {
+        return MOCKING_READS | MOCKING_WRITES;
+    }
+
+    if (get_mocking_type() == 0 || get_target_conf() == NULL) {
+        return get_mocking_type();
+    }
+
+    /* the fds are matched against the rules once, when first seen */
+    if (!(mocking & FD_TARGET_DONE)) {
+        mocking = target_decide(fd, st, NULL, 0);
+    }
+
+    return (mocking & FD_TARGET_SKIP) ? 0 : get_mocking_type();
+}
+
+
+/*
+ * The API of mockeagain.h. The settings of an fd last until it is closed,
+ * and should not be changed while another thread does I/O on it.
+ */
+
+static int
+api_set_mocking(int fd, int types)
+{
+    int                  mocking;
+    fd_state_t          *st;
+
+    if (types != MOCKEAGAIN_DEFAULT
+        && (types & ~(MOCKEAGAIN_READS | MOCKEAGAIN_WRITES)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    __atomic_store_n(&fd_mocking, 1, __ATOMIC_RELAXED);
+
+    /* what the target rules made of the fd still holds for the default */
+    mocking = __atomic_load_n(&st->mocking, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&st->mocking, &mocking,
+                                        (mocking & FD_TARGET_BITS)
+                                        | (types == MOCKEAGAIN_DEFAULT
+                                           ? 0 : FD_MOCKING_SET | types),
+                                        1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+    {
+        /* void */
+    }
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: mocking type %d set on fd %d.\n",
+                types, fd);
+    }
+
+    return 0;
+}
+
+
+static int
+api_set_patterns(int fd, const char *patterns, int write)
+{
+    matcher_t           *m = NULL, *old;
+    fd_state_t          *st;
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    if (patterns && *patterns) {
+        m = matcher_create(patterns);
+        if (m == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    /* the fd starts matching from scratch, like for the global ones */
+    old = __atomic_exchange_n(write ? &st->wpatterns : &st->rpatterns, m,
+                              __ATOMIC_ACQ_REL);
+    matcher_free(old);
+
+    return 0;
+}
+
+
+static int
+api_set_write_patterns(int fd, const char *patterns)
+{
+    return api_set_patterns(fd, patterns, 1);
+}
+
+
+static int
+api_set_read_patterns(int fd, const char *patterns)
+{
+    return api_set_patterns(fd, patterns, 0);
+}
+
+
+static int
+api_set_offset(int fd, long long offset, int write)
+{
+    fd_state_t          *st;
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    if (write) {
+        st->woffset = offset < 0 ? 0 : (uint64_t) offset + 1;
+
+    } else {
+        st->roffset = offset < 0 ? 0 : (uint64_t) offset + 1;
+    }
+
+    return 0;
+}
+
+
+static int
+api_set_write_offset(int fd, long long offset)
+{
+    return api_set_offset(fd, offset, 1);
+}
+
+
+static int
+api_set_read_offset(int fd, long long offset)
+{
+    return api_set_offset(fd, offset, 0);
+}
+
+
+static int
+api_get_stats(int fd, mockeagain_fd_stats_t *stats)
+{
+    unsigned short       flags;
+    fd_state_t          *st;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(mockeagain_fd_stats_t));
+
+    st = fd_state(fd);
+    if (st == NULL) {
+        /* never seen by us */
+        return 0;
+    }
+
+    flags = fd_flags(st);
+
+    stats->written = st->nwritten;
+    stats->read = st->nread;
+    stats->injected = st->ninjected;
+    stats->shorts = st->nshort;
+    stats->write_timed_out = !!(flags & FD_SND_TIMEOUT);
+    stats->read_timed_out = !!(flags & FD_RCV_TIMEOUT);
+    stats->write_pattern = st->wmatched;
+    stats->read_pattern = st->rmatched;
+
+    return 0;
+}
+
+
+static int
+api_set_split_hook(int fd, mockeagain_split_hook_handle hook, void *data)
+{
+    fd_state_t          *st;
+
+    st = fd_state_alloc(fd);
+    if (st == NULL) {
+        errno = fd < 0 ? EBADF : ENOMEM;
+        return -1;
+    }
+
+    st->split_data = data;
+
+    __atomic_store_n(&fd_mocking, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->split_hook, hook, __ATOMIC_RELEASE);
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: split hook %s on fd %d.\n",
+                hook ? "set" : "removed", fd);
+    }
+
+    return 0;
+}
+
+
+static const mockeagain_api_t api = {
+    MOCKEAGAIN_API_VERSION,
+    api_set_mocking,
+    api_set_write_patterns,
+    api_set_read_patterns,
+    api_set_write_offset,
+    api_set_read_offset,
+    api_get_stats,
+    api_set_split_hook
+};
+
+
+const mockeagain_api_t *
+mockeagain_api(unsigned version)
+{
+    /* the later versions only ever add to the API */
+    if (version == 0 || version > MOCKEAGAIN_API_VERSION) {
+        return NULL;
+    }
+
+    return &api;
+}
+
+
+/*
+ * The control file MOCKEAGAIN_CONTROL holds MOCKEAGAIN* settings, one
+ * NAME=value per line, which override the environment whenever the file
+ * changes. This lets a test switch the mocking of all the workers of a
+ * running server, which only see their own environment otherwise.
+ *
+ * The file is watched by a thread of our own, so that no mocked call, not
+ * even one made from a signal handler, ever has to read it. Its settings
+ * are kept apart from the environment, and published as a whole.
+ */
+
+static void
+load_control(int level)
+{
+    const char          *p, *old;
+
+    p = getenv("MOCKEAGAIN_CONTROL");
+    old = __atomic_load_n(&control_path, __ATOMIC_ACQUIRE);
+
+    if (p == NULL || *p == '\0') {
+        if (old) {
+            /* the settings are leaked, as other threads may still read them */
+            __atomic_store_n(&control_path, NULL, __ATOMIC_RELEASE);
+            __atomic_store_n(&control_conf, NULL, __ATOMIC_RELEASE);
+        }
+
+        return;
+    }
+
+    if (old && strcmp(old, p) == 0) {
+        return;
+    }
+
+    if (level) {
+        fprintf(stderr, "mockeagain: watching the control file %s\n", p);
+    }
+
+    pthread_mutex_lock(&control_lock);
+
+    /* a previous path is leaked, as the watcher may still read it */
+    p = strdup(p);
+
+    memset(&control_stat, 0, sizeof(control_stat));
+    __atomic_store_n(&control_path, (char *) p, __ATOMIC_RELEASE);
+    __atomic_store_n(&control_conf, NULL, __ATOMIC_RELEASE);
+
+    /* the file in place when the path is set applies right away */
+    if (p) {
+        (void) control_read(p);
+    }
+
+    pthread_mutex_unlock(&control_lock);
+
+    control_watch();
+}
+
+
+/* returns 1 when new settings are published, 0 otherwise */
+static int
+control_read(const char *path)
+{
+    FILE                *f;
+    char                *line = NULL, *p, *eq, *conf, *tmp;
+    size_t               size = 0, len = 0, n;
+    ssize_t              rc;
+    struct stat          sb;
+
+    if (stat(path, &sb) == -1
+        || (sb.st_ino == control_stat.st_ino
+            && sb.st_dev == control_stat.st_dev
+            && sb.st_size == control_stat.st_size
+            && sb.st_mtim.tv_sec == control_stat.st_mtim.tv_sec
+            && sb.st_mtim.tv_nsec == control_stat.st_mtim.tv_nsec))
+    {
+        return 0;
+    }
+
+    f = fopen(path, "re");
+    if (f == NULL) {
+        return 0;
+    }
+
+    control_stat = sb;
+
+    conf = malloc(1);
+    if (conf == NULL) {
+        fclose(f);
+        return 0;
+    }
+
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: applying the control file %s\n", path);
+    }
+
+    while ((rc = getline(&line, &size, f)) != -1) {
+        n = rc;
+
+        while (n && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+            line[--n] = '\0';
+        }
+
+        p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        eq = strchr(p, '=');
+
+        if (eq == NULL || !is_conf_env(p)
+            || strncmp(p, "MOCKEAGAIN_CONTROL=", eq - p + 1) == 0)
+        {
+            fprintf(stderr, "mockeagain: ignoring bad line in the control "
+                    "file %s: %s\n", path, p);
+            continue;
+        }
+
+        /* the lines are kept as NAME=value strings, one after another */
+        n = strlen(p) + 1;
+
+        tmp = realloc(conf, len + n + 1);
+        if (tmp == NULL) {
+            break;
+        }
+
+        conf = tmp;
+        memcpy(conf + len, p, n);
+        len += n;
+    }
+
+    conf[len] = '\0';
+
+    free(line);
+    fclose(f);
+
+    /* the previous settings are leaked, as other threads may read them */
+    __atomic_store_n(&control_conf, conf, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+
+static void
+control_watch()
+{
+    int                  err;
+    sigset_t             set, old;
+    pthread_t            tid;
+    pthread_attr_t       attr;
+
+    if (__atomic_exchange_n(&control_watching, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    /* the signals of the process are left to its own threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &old);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    err = pthread_create(&tid, &attr, control_watcher, NULL);
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err) {
+        fprintf(stderr, "mockeagain: failed to start watching the control "
+                "file: %s\n", strerror(err));
+        __atomic_store_n(&control_watching, 0, __ATOMIC_RELEASE);
+    }
+}
+
+
+static void *
+control_watcher(void *data)
+{
+    int                  changed;
+    const char          *path;
+    struct timespec      ts;
+
+    for ( ;; ) {
+        (void) nanosleep(ms_to_timespec(CONTROL_INTERVAL, &ts), NULL);
+
+        pthread_mutex_lock(&control_lock);
+
+        path = __atomic_load_n(&control_path, __ATOMIC_ACQUIRE);
+        changed = path ? control_read(path) : 0;
+
+        pthread_mutex_unlock(&control_lock);
+
+        if (changed) {
+            load_conf();
+        }
+    }
+
+    return NULL;
+}
+
+
+/* a setting in the control file takes the place of the environment's */
+static const char *
+conf_getenv(const char *name)
+{
+    size_t               len;
+    const char          *p, *value;
+
+    p = __atomic_load_n(&control_conf, __ATOMIC_ACQUIRE);
+    if (p == NULL) {
+        return getenv(name);
+    }
+
+    len = strlen(name);
+    value = NULL;
+
+    /* the last line for a name wins */
+    for ( /* void */ ; *p; p += strlen(p) + 1) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            value = p + len + 1;
+        }
+    }
+
+    return value ? value : getenv(name);
+}
+
+
+/*
+ * The counters file MOCKEAGAIN_STATS is shared by all the processes using
+ * it, like the workers forked by a server. It is created by the first of
+ * them, and every process claims a slot of its own in it.
+ */
+
+static void
+load_stats(int level)
+{
+    const char                  *p;
+    int                          fd = -1;
+    unsigned                     i;
+    uint32_t                     version;
+    struct stat                  sb;
+    mockeagain_stats_header_t   *h;
+
+    p = conf_getenv("MOCKEAGAIN_STATS");
+
+    if (p == NULL || *p == '\0') {
+        __atomic_store_n(&stats_slot, NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (stats_file && stats_path && strcmp(stats_path, p) == 0) {
+        if (get_stats_slot() == NULL) {
+            stats_claim(stats_file, level);
+        }
+
+        return;
+    }
+
+    fd = open(p, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        goto failed;
+    }
+
+    if (sb.st_size < (off_t) mockeagain_stats_file_size
+        && ftruncate(fd, mockeagain_stats_file_size) == -1)
+    {
+        goto failed;
+    }
+
+    h = mmap(NULL, mockeagain_stats_file_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto failed;
+    }
+
+    (void) (*orig_close)(fd);
+
+    version = 0;
+
+    if (__atomic_compare_exchange_n(&h->version, &version,
+                                    MOCKEAGAIN_STATS_VERSION, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        /* we have created the file */
+        h->max_slots = MOCKEAGAIN_STATS_MAX_SLOTS;
+        h->slot_size = sizeof(mockeagain_stats_slot_t);
+
+        for (i = 0; i < sizeof(trace_calls) / sizeof(trace_calls[0]); i++) {
+            strncpy(h->calls[i], trace_calls[i],
+                    MOCKEAGAIN_STATS_NAME_LEN - 1);
+        }
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(h->magic, MOCKEAGAIN_STATS_MAGIC, sizeof(h->magic));
+
+    } else if (version != MOCKEAGAIN_STATS_VERSION) {
+        fprintf(stderr, "mockeagain: ERROR: %s is not a counters file of "
+                "version %d.\n", p, MOCKEAGAIN_STATS_VERSION);
+        munmap(h, mockeagain_stats_file_size);
+        return;
+    }
+
+    /* a previous file stays mapped, as other threads may still use it */
+    stats_path = strdup(p);
+    stats_file = h;
+
+    stats_claim(h, level);
+
+    return;
+
+failed:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to set up the counters file "
+            "%s: %s\n", p, strerror(errno));
+
+    if (fd != -1) {
+        (void) (*orig_close)(fd);
+    }
+}
+
+
+static void
+stats_claim(mockeagain_stats_header_t *h, int level)
+{
+    uint32_t                     i, n;
+    pid_t                        pid;
+    mockeagain_stats_slot_t     *slot;
+
+    if (h == NULL) {
+        return;
+    }
+
+    pid = getpid();
+
+    n = __atomic_load_n(&h->nslots, __ATOMIC_ACQUIRE);
+    if (n > MOCKEAGAIN_STATS_MAX_SLOTS) {
+        n = MOCKEAGAIN_STATS_MAX_SLOTS;
+    }
+
+    /* a process that has exec'ed after a fork keeps the slot of its pid */
+    for (i = 0; i < n; i++) {
+        slot = mockeagain_stats_slot(h, i);
+
+        if (__atomic_load_n(&slot->pid, __ATOMIC_RELAXED) == (uint32_t) pid) {
+            goto done;
+        }
+    }
+
+    i = __atomic_fetch_add(&h->nslots, 1, __ATOMIC_RELAXED);
+    if (i >= MOCKEAGAIN_STATS_MAX_SLOTS) {
+        /* the later processes go uncounted */
+        if (level) {
+            fprintf(stderr, "mockeagain: no more slots in the counters "
+                    "file for process %d.\n", (int) pid);
+        }
+
+        __atomic_store_n(&stats_slot, NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    slot = mockeagain_stats_slot(h, i);
+    __atomic_store_n(&slot->pid, (uint32_t) pid, __ATOMIC_RELEASE);
+
+done:
+
+    if (level) {
+        fprintf(stderr, "mockeagain: counting in slot %u of %s\n",
+                (unsigned) i, stats_path);
+    }
+
+    __atomic_store_n(&stats_slot, slot, __ATOMIC_RELEASE);
+}
+
+
+static void
+load_record(int level)
+{
+    const char                  *p;
+    char                        *path = NULL;
+    int                          fd = -1;
+    size_t                       size;
+    long long                    bytes;
+    uint64_t                     max;
+    mockeagain_record_header_t  *h;
+
+    p = conf_getenv("MOCKEAGAIN_RECORD");
+
+    if (p == NULL || *p == '\0') {
+        __atomic_store_n(&record_file, NULL, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (get_record_file() && record_pid == getpid() && record_path
+        && strcmp(record_path, p) == 0)
+    {
+        return;
+    }
+
+    bytes = parse_size("MOCKEAGAIN_RECORD_SIZE");
+    if (bytes < (long long) sizeof(mockeagain_record_t)) {
+        bytes = 16 * 1024 * 1024;
+    }
+
+    max = bytes / sizeof(mockeagain_record_t);
+    size = mockeagain_record_file_size(max);
+
+    path = malloc(strlen(p) + sizeof(".4294967295"));
+    if (path == NULL) {
+        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
+        return;
+    }
+
+    sprintf(path, "%s.%u", p, (unsigned) getpid());
+
+    /* the file is sparse, so only the records written take disk space */
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        goto failed;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        goto failed;
+    }
+
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        goto failed;
+    }
+
+    (void) (*orig_close)(fd);
+
+    memcpy(h->magic, MOCKEAGAIN_RECORD_MAGIC, sizeof(h->magic));
+    h->version = MOCKEAGAIN_RECORD_VERSION;
+    h->pid = getpid();
+    h->rec_size = sizeof(mockeagain_record_t);
+    h->max_records = max;
+
+    /* a previous path is leaked along with its file */
+    record_path = strdup(p);
+    record_pid = getpid();
+    __atomic_store_n(&record_file, h, __ATOMIC_RELEASE);
+
+    if (level) {
+        fprintf(stderr, "mockeagain: recording to %s\n", path);
+    }
+
+    free(path);
+    return;
+
+failed:
+
+    fprintf(stderr, "mockeagain: ERROR: failed to set up the recording %s: "
+            "%s\n", path, strerror(errno));
+
+    if (fd != -1) {
+        (void) (*orig_close)(fd);
+    }
+
+    free(path);
+}
+
+
+/*
+ * Appends a decision on an accepted or connected fd to the recording. This
+ * costs an atomic increment and a few stores to the mapped file, which the
+ * kernel writes back by itself, even after the process is killed.
+ */
+
+static void
+record(mockeagain_record_header_t *h, int fd, unsigned call,
+    uint64_t requested, ssize_t returned, int flags, int err)
+{
+    uint64_t                 n;
+    fd_state_t              *st;
+    mockeagain_record_t     *r;
+
+    st = fd_state(fd);
+    if (st == NULL || st->conn == 0) {
+        return;
+    }
+
+    n = __atomic_fetch_add(&h->nrecords, 1, __ATOMIC_RELAXED);
+
+    if (n >= h->max_records) {
+        if (n == h->max_records) {
+            fprintf(stderr, "mockeagain: the recording is full, "
+                    "MOCKEAGAIN_RECORD_SIZE is too small\n");
+        }
+
+        return;
+    }
+
+    r = &mockeagain_record_recs(h)[n];
+
+    r->conn = st->conn;
+    r->flags = flags;
+    r->err = 0;
+
+    if (call >= CALL_FIRST_EVENT) {
+        r->value = requested & ~returned;
+
+        __atomic_store_n(&r->op, MOCKEAGAIN_RECORD_EVENTS, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (returned == -1) {
+        r->value = 0;
+        r->err = err;
+
+    } else {
+        r->value = returned < UINT32_MAX ? returned : UINT32_MAX;
+    }
+
+    __atomic_store_n(&r->op, call >= CALL_FIRST_WRITE
+                             ? MOCKEAGAIN_RECORD_WRITE
+                             : MOCKEAGAIN_RECORD_READ, __ATOMIC_RELEASE);
+}
+
+
+static size_t
+iov_total(const struct iovec *iov, int iovcnt)
+{
+    int                  i;
+    size_t               len = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+
+/* the first n bytes of the buffers, as far as head can hold them */
+
+static size_t
+iov_head(const struct iovec *iov, int iovcnt, size_t n, struct iovec *head,
+    int *nhead)
+{
+    int                  i;
+    size_t               size = 0;
+
+    *nhead = 0;
+
+    for (i = 0; i < iovcnt && size < n; i++, iov++) {
+        if (iov->iov_len == 0) {
+            continue;
+        }
+
+        if (*nhead == MAX_CHUNK_IOVS) {
+            break;
+        }
+
+        head[*nhead] = *iov;
+
+        if (iov->iov_len > n - size) {
+            head[*nhead].iov_len = n - size;
         }
 
-        if (retval == 0) {
-            if (get_verbose_level()) {
-                fprintf(stderr, "mockeagain: poll: emulating timeout on "
-                        "fd %d.\n", fd);
-            }
+        size += head[(*nhead)++].iov_len;
+    }
 
-            if (timeout < 0) {
-                tm.tv_sec = 3600 * 24;
-                tm.tv_usec = 0;
+    return size;
+}
 
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: poll: sleeping 1 day "
-                            "on fd %d.\n", fd);
-                }
 
-                select(0, NULL, NULL, NULL, &tm);
+/*
+ * Parses a probability like "0.25" or "25%" into a chance in 1/2^32.
+ */
 
-            } else {
+static uint32_t
+parse_chance(const char *name)
+{
+    const char          *p;
+    char                *end;
+    double               v;
 
-                if (elapsed < timeout) {
-                    int     diff;
+    p = conf_getenv(name);
+    if (p == NULL || *p == '\0') {
+        return 0;
+    }
 
-                    diff = timeout - elapsed;
+    v = strtod(p, &end);
 
-                    tm.tv_sec = diff / 1000;
-                    tm.tv_usec = diff % 1000 * 1000;
+    if (*end == '%') {
+        v /= 100;
+        end++;
+    }
 
-                    if (get_verbose_level()) {
-                        fprintf(stderr, "mockeagain: poll: sleeping %d ms "
-                                "on fd %d.\n", diff, fd);
-                    }
+    if (end == p || *end != '\0' || !(v >= 0 && v <= 1)) {
+        fprintf(stderr, "mockeagain: ignoring bad %s value: %s\n", name, p);
+        return 0;
+    }
 
-                    select(0, NULL, NULL, NULL, &tm);
-                }
-            }
-        }
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: reading %s: %g\n", name, v);
     }
 
-    return retval;
+    return v >= 1 ? 0xffffffff : (uint32_t) (v * 4294967296.0);
 }
 
 
-ssize_t
-writev(int fd, const struct iovec *iov, int iovcnt)
+/*
+ * Parses MOCKEAGAIN_LATENCY, which is either a fixed number of milliseconds
+ * or a range like "50-200" to pick from for every delay.
+ */
+
+static uint64_t
+parse_delay(const char *name)
 {
-    ssize_t                  retval;
-    static writev_handle     orig_writev = NULL;
-    struct iovec             new_iov[1] = { {NULL, 0} };
-    const struct iovec      *p;
-    int                      i;
-    size_t                   len = 0;
+    const char          *p;
+    char                *end;
+    unsigned long        min, max;
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && get_verbose_level()
-        && fd <= MAX_FD)
-    {
-        fprintf(stderr, "mockeagain: writev(%d): polled=%d, written=%d, "
-                "active=%d\n", fd, (int) polled_fds[fd], (int) written_fds[fd],
-                (int) active_fds[fd]);
+    p = conf_getenv(name);
+    if (p == NULL || *p == '\0') {
+        return 0;
     }
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && written_fds[fd]
-        && !(active_fds[fd] & POLLOUT))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"writev\" on fd %d to "
-                    "signal EAGAIN.\n", fd);
-        }
-
-        errno = EAGAIN;
-        return -1;
+    if (*p < '0' || *p > '9') {
+        goto invalid;
     }
 
-    written_fds[fd] = 1;
-
-    init_libc_handle();
+    min = strtoul(p, &end, 10);
+    max = min;
 
-    if (orig_writev == NULL) {
-        orig_writev = dlsym(libc_handle, "writev");
-        if (orig_writev == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying writev: "
-                    "%s\n", dlerror());
-            exit(1);
+    if (*end == '-') {
+        if (end[1] < '0' || end[1] > '9') {
+            goto invalid;
         }
-    }
 
-    if (!(get_mocking_type() & MOCKING_WRITES)) {
-        return (*orig_writev)(fd, iov, iovcnt);
+        max = strtoul(end + 1, &end, 10);
     }
 
-    if (fd <= MAX_FD && polled_fds[fd]) {
-        p = iov;
-        for (i = 0; i < iovcnt; i++, p++) {
-            if (p->iov_base == NULL || p->iov_len == 0) {
-                continue;
-            }
-
-            new_iov[0].iov_base = p->iov_base;
-            new_iov[0].iov_len = 1;
-            break;
-        }
+    if (*end != '\0' || max < min || max > 3600 * 1000) {
+        goto invalid;
+    }
 
-        len = 0;
-        p = iov;
-        for (i = 0; i < iovcnt; i++, p++) {
-            len += p->iov_len;
-        }
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: reading %s: %lu-%lu ms\n", name, min,
+                max);
     }
 
-    if (new_iov[0].iov_base == NULL) {
-        retval = (*orig_writev)(fd, iov, iovcnt);
+    return (uint64_t) min << 32 | max;
 
-    } else {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"writev\" on fd %d to emit "
-                    "1 of %llu bytes.\n", fd, (unsigned long long) len);
-        }
+invalid:
 
-        if (pattern && new_iov[0].iov_len) {
-            char          *p;
-            size_t         len;
-            char           c;
+    fprintf(stderr, "mockeagain: ignoring bad %s value: %s\n", name, p);
+    return 0;
+}
 
-            c = *(char *) new_iov[0].iov_base;
 
-            if (matchbufs[fd] == NULL) {
+/*
+ * Returns the number of bytes in the environment variable name, which may
+ * end with "k" or "m" like the nginx sizes, or -1 if it is not set.
+ */
 
-                matchbufs[fd] = malloc(matchbuf_len);
-                if (matchbufs[fd] == NULL) {
-                    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
-                }
+static long long
+parse_size(const char *name)
+{
+    const char          *p;
+    char                *end;
+    long long            size;
 
-                p = matchbufs[fd];
-                memset(p, 0, matchbuf_len);
+    p = conf_getenv(name);
+    if (p == NULL || *p == '\0') {
+        return -1;
+    }
 
-                p[0] = c;
+    errno = 0;
+    size = strtoll(p, &end, 10);
 
-                len = 1;
+    if (*end == 'k' || *end == 'K') {
+        size *= 1024;
+        end++;
 
-            } else {
-                p = matchbufs[fd];
+    } else if (*end == 'm' || *end == 'M') {
+        size *= 1024 * 1024;
+        end++;
+    }
 
-                len = strlen(p);
+    if (errno || end == p || *end != '\0' || size < 0) {
+        fprintf(stderr, "mockeagain: ignoring bad %s value: %s\n", name, p);
+        return -1;
+    }
 
-                if (len < matchbuf_len - 1) {
-                    p[len] = c;
-                    len++;
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: reading %s: %lld\n", name, size);
+    }
 
-                } else {
-                    memmove(p, p + 1, matchbuf_len - 2);
+    return size;
+}
 
-                    p[matchbuf_len - 2] = c;
-                }
-            }
 
-            /* test if the pattern matches the matchbuf */
+/*
+ * Compiles a list of patterns separated by "|" into a matcher. A literal
+ * "|" or "\" is written as "\|" or "\\" respectively, and any byte at all,
+ * NUL included, can be written as "\xHH".
+ */
 
-            dd("matchbuf: %.*s (len: %d)", (int) len, p,
-                    (int) matchbuf_len - 1);
+static matcher_t *
+matcher_create(const char *spec)
+{
+    int                  i, n, c, s, t, head, tail;
+    int                 *fail = NULL, *queue = NULL;
+    char                *buf = NULL, *start, *q;
+    const char          *p, *src;
+    size_t               total;
+    matcher_t           *m;
+
+    m = calloc(1, sizeof(matcher_t));
+    if (m == NULL) {
+        goto nomem;
+    }
 
-            if (len == matchbuf_len - 1 && strncmp(p, pattern, len) == 0) {
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: \"writev\" has found a match for "
-                            "the timeout pattern \"%s\" on fd %d.\n", pattern, fd);
-                }
+    m->spec = strdup(spec);
+    buf = malloc(strlen(spec) + 1);
 
-                snd_timeout_fds[fd] = 1;
-            }
+    n = 1;
+    for (p = spec; *p; p++) {
+        if (*p == '|') {
+            n++;
         }
-
-        dd("calling the original writev on fd %d", fd);
-        retval = (*orig_writev)(fd, new_iov, 1);
-        active_fds[fd] &= ~POLLOUT;
     }
 
-    return retval;
-}
+    m->patterns = malloc(n * sizeof(char *));
+    m->lens = malloc(n * sizeof(size_t));
+    m->srcs = malloc(n * sizeof(char *));
+    m->src_lens = malloc(n * sizeof(size_t));
 
+    if (m->spec == NULL || buf == NULL || m->patterns == NULL
+        || m->lens == NULL || m->srcs == NULL || m->src_lens == NULL)
+    {
+        goto nomem;
+    }
 
-int
-close(int fd)
-{
-    int                     retval;
-    static close_handle     orig_close = NULL;
+    /* unescape and split the patterns, skipping the empty ones */
 
-    init_libc_handle();
+    total = 0;
+    start = q = buf;
+    src = m->spec;
 
-    if (orig_close == NULL) {
-        orig_close = dlsym(libc_handle, "close");
-        if (orig_close == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying close: "
-                    "%s\n", dlerror());
-            exit(1);
+    for (p = m->spec; /* void */; p++) {
+        c = parse_escape(&p);
+        if (c != -1) {
+            *q++ = (char) c;
+            continue;
         }
-    }
 
-    if (fd <= MAX_FD) {
-#if (DDEBUG)
-        if (polled_fds[fd]) {
-            dd("calling the original close on fd %d", fd);
-        }
-#endif
+        if (*p == '|' || *p == '\0') {
+            if (q > start) {
+                m->patterns[m->npatterns] = start;
+                m->lens[m->npatterns] = q - start;
+                m->srcs[m->npatterns] = (char *) src;
+                m->src_lens[m->npatterns] = p - src;
+                m->npatterns++;
+                total += q - start;
+            }
+
+            if (*p == '\0') {
+                break;
+            }
 
-        if (matchbufs && matchbufs[fd]) {
-            free(matchbufs[fd]);
-            matchbufs[fd] = NULL;
+            start = q;
+            src = p + 1;
+            continue;
         }
 
-        active_fds[fd] = 0;
-        polled_fds[fd] = 0;
-        written_fds[fd] = 0;
-        snd_timeout_fds[fd] = 0;
-        weird_fds[fd] = 0;
-        blacklist_fds[fd] = 0;
+        *q++ = *p;
     }
 
-    retval = (*orig_close)(fd);
+    if (m->npatterns == 0) {
+        goto failed;
+    }
 
-    return retval;
-}
+    /* build the trie; state 0 is the root and is nobody's child */
 
+    m->next = calloc((total + 1) * 256, sizeof(int));
+    m->match = calloc(total + 1, sizeof(int));
+    fail = calloc(total + 1, sizeof(int));
+    queue = malloc((total + 1) * sizeof(int));
 
-ssize_t
-send(int fd, const void *buf, size_t len, int flags)
-{
-    ssize_t                  retval;
-    static send_handle       orig_send = NULL;
+    if (m->next == NULL || m->match == NULL || fail == NULL
+        || queue == NULL)
+    {
+        goto nomem;
+    }
 
-    dd("calling my send");
+    m->nstates = 1;
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && written_fds[fd]
-        && !(active_fds[fd] & POLLOUT))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"send\" on fd %d to "
-                    "signal EAGAIN\n", fd);
+    for (i = 0; i < m->npatterns; i++) {
+        s = 0;
+
+        for (q = m->patterns[i]; q < m->patterns[i] + m->lens[i]; q++) {
+            c = (u_char) *q;
+
+            if (m->next[s * 256 + c] == 0) {
+                m->next[s * 256 + c] = m->nstates++;
+            }
+
+            s = m->next[s * 256 + c];
         }
 
-        errno = EAGAIN;
-        return -1;
+        if (m->match[s] == 0) {
+            m->match[s] = i + 1;
+        }
     }
 
-    written_fds[fd] = 1;
+    /*
+     * Fill in the failure links breadth first, replacing every missing
+     * transition with the one of the failure state, which is complete by
+     * then since it is shallower.
+     */
 
-    init_libc_handle();
+    head = tail = 0;
 
-    if (orig_send == NULL) {
-        orig_send = dlsym(libc_handle, "send");
-        if (orig_send == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying send: "
-                    "%s\n", dlerror());
-            exit(1);
+    for (c = 0; c < 256; c++) {
+        t = m->next[c];
+        if (t) {
+            fail[t] = 0;
+            queue[tail++] = t;
         }
     }
 
-    if ((get_mocking_type() & MOCKING_WRITES)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"send\" on fd %d to emit "
-                    "1 byte data only\n", fd);
+    while (head < tail) {
+        s = queue[head++];
+
+        if (m->match[s] == 0) {
+            /* a shorter pattern may end here as well */
+            m->match[s] = m->match[fail[s]];
         }
 
-        if (pattern && len) {
-            char          *p;
-            size_t         len;
-            char           c;
+        for (c = 0; c < 256; c++) {
+            t = m->next[s * 256 + c];
 
-            c = *(char *) buf;
+            if (t) {
+                fail[t] = m->next[fail[s] * 256 + c];
+                queue[tail++] = t;
 
-            if (matchbufs[fd] == NULL) {
+            } else {
+                m->next[s * 256 + c] = m->next[fail[s] * 256 + c];
+            }
+        }
+    }
 
-                matchbufs[fd] = malloc(matchbuf_len);
-                if (matchbufs[fd] == NULL) {
-                    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
-                }
+    free(fail);
+    free(queue);
 
-                p = matchbufs[fd];
-                memset(p, 0, matchbuf_len);
+    return m;
 
-                p[0] = c;
+nomem:
 
-                len = 1;
+    fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
 
-            } else {
-                p = matchbufs[fd];
+failed:
 
-                len = strlen(p);
+    if (m) {
+        free(m->spec);
+        free(m->patterns);
+        free(m->lens);
+        free(m->srcs);
+        free(m->src_lens);
+        free(m->next);
+        free(m->match);
+        free(m);
+    }
 
-                if (len < matchbuf_len - 1) {
-                    p[len] = c;
-                    len++;
+    free(buf);
+    free(fail);
+    free(queue);
 
-                } else {
-                    memmove(p, p + 1, matchbuf_len - 2);
+    return NULL;
+}
 
-                    p[matchbuf_len - 2] = c;
-                }
-            }
 
-            /* test if the pattern matches the matchbuf */
+/* the patterns all live in the buffer of the first one */
+static void
+matcher_free(matcher_t *m)
+{
+    if (m == NULL) {
+        return;
+    }
 
-            dd("matchbuf: %.*s (len: %d)", (int) len, p,
-                    (int) matchbuf_len - 1);
+    if (m->npatterns) {
+        free(m->patterns[0]);
+    }
 
-            if (len == matchbuf_len - 1 && strncmp(p, pattern, len) == 0) {
-                if (get_verbose_level()) {
-                    fprintf(stderr, "mockeagain: \"writev\" has found a match for "
-                            "the timeout pattern \"%s\" on fd %d.\n", pattern, fd);
-                }
+    free(m->spec);
+    free(m->patterns);
+    free(m->lens);
+    free(m->srcs);
+    free(m->src_lens);
+    free(m->next);
+    free(m->match);
+    free(m);
+}
 
-                snd_timeout_fds[fd] = 1;
-            }
-        }
 
-        retval = (*orig_send)(fd, buf, 1, flags);
-        active_fds[fd] &= ~POLLOUT;
+/*
+ * Parses the escape sequence starting at *p, if any, leaving *p at its last
+ * character, and returns the byte it stands for, or -1 if there is none.
+ */
 
-    } else {
+static int
+parse_escape(const char **p)
+{
+    int                  hi, lo;
+    const char          *s;
 
-        dd("calling the original send on fd %d", fd);
+    s = *p;
 
-        retval = (*orig_send)(fd, buf, len, flags);
+    if (s[0] != '\\') {
+        return -1;
     }
 
-    return retval;
-}
+    switch (s[1]) {
 
+    case '\\':
+    case '|':
+        *p = s + 1;
+        return (u_char) s[1];
 
-ssize_t
-read(int fd, void *buf, size_t len)
-{
-    ssize_t                  retval;
-    static read_handle       orig_read = NULL;
+    case 'r':
+        *p = s + 1;
+        return '\r';
 
-    dd("calling my read");
+    case 'n':
+        *p = s + 1;
+        return '\n';
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & (POLLIN | POLLHUP)))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"read\" on fd %d to "
-                    "signal EAGAIN\n", fd);
+    case 't':
+        *p = s + 1;
+        return '\t';
+
+    case 'x':
+        hi = hex_value(s[2]);
+        lo = hi == -1 ? -1 : hex_value(s[3]);
+
+        if (lo == -1) {
+            return -1;
         }
 
-        errno = EAGAIN;
+        *p = s + 3;
+        return hi << 4 | lo;
+
+    default:
         return -1;
     }
+}
 
-    init_libc_handle();
 
-    if (orig_read == NULL) {
-        orig_read = dlsym(libc_handle, "read");
-        if (orig_read == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying read: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
+static int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
     }
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"read\" on fd %d to read "
-                    "1 byte only\n", fd);
-        }
-
-        dd("calling the original read on fd %d", fd);
+    c |= 0x20;
 
-        retval = (*orig_read)(fd, buf, 1);
-        active_fds[fd] &= ~POLLIN;
-
-    } else {
-        retval = (*orig_read)(fd, buf, len);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
     }
 
-    return retval;
+    return -1;
 }
 
 
-ssize_t
-recv(int fd, void *buf, size_t len, int flags)
+/*
+ * Advances the matcher over the data and returns the number of bytes up to
+ * and including the first match found, or 0 if none.
+ */
+
+static size_t
+matcher_feed(const matcher_t *m, int *state, const u_char *p, size_t len,
+    int *which)
 {
-    ssize_t                  retval;
-    static recv_handle       orig_recv = NULL;
+    int                  s;
+    size_t               i;
 
-    dd("calling my recv");
+    s = *state;
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLIN))
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recv\" on fd %d to "
-                    "signal EAGAIN\n", fd);
-        }
+    for (i = 0; i < len; i++) {
+        s = m->next[s * 256 + p[i]];
 
-        errno = EAGAIN;
-        return -1;
+        if (m->match[s]) {
+            *state = s;
+            *which = m->match[s] - 1;
+            return i + 1;
+        }
     }
 
-    init_libc_handle();
+    *state = s;
 
-    if (orig_recv == NULL) {
-        orig_recv = dlsym(libc_handle, "recv");
-        if (orig_recv == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying recv: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
-    }
+    return 0;
+}
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
-        if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recv\" on fd %d to read "
-                    "1 byte only\n", fd);
-        }
 
-        dd("calling the original recv on fd %d", fd);
+/* counts a timeout seen by the caller only because of the events withheld */
 
-        retval = (*orig_recv)(fd, buf, 1, flags);
-        active_fds[fd] &= ~POLLIN;
+static void
+count_timeout(unsigned call, int fd)
+{
+    mockeagain_stats_slot_t  *slot;
 
-    } else {
-        retval = (*orig_recv)(fd, buf, len, flags);
+    slot = get_stats_slot();
+    if (slot) {
+        __atomic_fetch_add(&slot->timeouts, 1, __ATOMIC_RELAXED);
     }
 
-    return retval;
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: %s: emulating timeout on fd %d.\n",
+                call_name(call), fd);
+    }
 }
 
 
-ssize_t
-recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+static void
+emulate_timeout(unsigned call, int timeout, int elapsed, int fd)
 {
-    ssize_t                  retval;
-    static recvfrom_handle   orig_recvfrom = NULL;
+    struct timespec           ts;
 
-    dd("calling my recvfrom");
+    count_timeout(call, fd);
+
+    /* we cannot use select() here since we are mocking it ourselves */
+
+    if (timeout < 0) {
+        ts.tv_sec = 3600 * 24;
+        ts.tv_nsec = 0;
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && !(active_fds[fd] & POLLIN))
-    {
         if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recvfrom\" on fd %d to "
-                    "signal EAGAIN\n", fd);
+            fprintf(stderr, "mockeagain: %s: sleeping 1 day on fd %d.\n",
+                    call_name(call), fd);
         }
 
-        errno = EAGAIN;
-        return -1;
+        probe3(sleep, call_name(call), fd, -1);
+
+        nanosleep(&ts, NULL);
+        return;
     }
 
-    init_libc_handle();
+    if (elapsed < timeout) {
+        int     diff;
 
-    if (orig_recvfrom == NULL) {
-        orig_recvfrom = dlsym(libc_handle, "recvfrom");
-        if (orig_recvfrom == NULL) {
-            fprintf(stderr, "mockeagain: could not find the underlying recvfrom: "
-                    "%s\n", dlerror());
-            exit(1);
-        }
-    }
+        diff = timeout - elapsed;
+
+        ts.tv_sec = diff / 1000;
+        ts.tv_nsec = diff % 1000 * 1000000;
 
-    if ((get_mocking_type() & MOCKING_READS)
-        && fd <= MAX_FD
-        && polled_fds[fd]
-        && len)
-    {
         if (get_verbose_level()) {
-            fprintf(stderr, "mockeagain: mocking \"recvfrom\" on fd %d to read "
-                    "1 byte only\n", fd);
+            fprintf(stderr, "mockeagain: %s: sleeping %d ms on fd %d.\n",
+                    call_name(call), diff, fd);
         }
 
-        dd("calling the original recvfrom on fd %d", fd);
+        probe3(sleep, call_name(call), fd, diff);
 
-        retval = (*orig_recvfrom)(fd, buf, 1, flags, src_addr, addrlen);
-        active_fds[fd] &= ~POLLIN;
-
-    } else {
-        retval = (*orig_recvfrom)(fd, buf, len, flags, src_addr, addrlen);
+        nanosleep(&ts, NULL);
     }
-
-    return retval;
 }
 
 
-static int
-get_mocking_type() {
-    const char          *p;
+/*
+ * Called when all the events reported by the kernel were withheld. If any
+ * of them can be reported after wait milliseconds, it lowers *due to then,
+ * in milliseconds since begin, and returns 1 for the caller to wait for the
+ * other events in the original call with the withheld ones masked, until
+ * they are due or the timeout expires. The events withheld for good only
+ * wait along with others; otherwise it emulates the timeout and returns 0.
+ */
 
-#if 1
-    if (mocking_type >= 0) {
-        return mocking_type;
-    }
-#endif
+static int
+wait_withheld(unsigned call, int timeout, int begin, int wait, int fd,
+    int *due)
+{
+    int              elapsed;
 
-    mocking_type = 0;
+    elapsed = ms_since(begin);
 
-    p = getenv("MOCKEAGAIN");
-    if (p == NULL || *p == '\0') {
-        dd("MOCKEAGAIN env empty");
-        /* mocking_type = MOCKING_WRITES; */
-        return mocking_type;
+    if (wait < 0 && *due < 0) {
+        emulate_timeout(call, timeout, elapsed, fd);
+        return 0;
     }
 
-    while (*p) {
-        if (*p == 'r' || *p == 'R') {
-            mocking_type |= MOCKING_READS;
+    if (timeout >= 0 && elapsed >= timeout) {
+        count_timeout(call, fd);
+        return 0;
+    }
 
-        } else if (*p == 'w' || *p == 'W') {
-            mocking_type |= MOCKING_WRITES;
-        }
+    if (wait < 0) {
+        return 1;
+    }
 
-        p++;
+    if (*due < 0 || elapsed + wait < *due) {
+        *due = elapsed + wait;
     }
 
-    if (mocking_type == 0) {
-        mocking_type = MOCKING_WRITES;
+    if (get_verbose_level()) {
+        fprintf(stderr, "mockeagain: %s: waiting %d ms for the withheld "
+                "events.\n", call_name(call), wait);
     }
 
-    dd("mocking_type %d", mocking_type);
+    probe3(sleep, call_name(call), fd, wait);
 
-    return mocking_type;
+    return 1;
 }
 
 
+/*
+ * Returns the timeout of the next call of an original event function, cut
+ * short to wake up when the next held datagram is due, or when the events
+ * withheld are, at due milliseconds since begin unless it is -1.
+ */
+
 static int
-get_verbose_level()
+event_timeout(int timeout, int begin, int due)
 {
-    const char          *p;
+    int              left, ms;
 
-    if (verbose >= 0) {
-        return verbose;
-    }
+    left = time_left(timeout, begin);
 
-    p = getenv("MOCKEAGAIN_VERBOSE");
-    if (p == NULL || *p == '\0') {
-        dd("MOCKEAGAIN_VERBOSE env empty");
-        verbose = 0;
-        return verbose;
+    if (due >= 0) {
+        ms = due - ms_since(begin);
+
+        if (ms < 0) {
+            ms = 0;
+        }
+
+        if (left < 0 || ms < left) {
+            left = ms;
+        }
     }
 
-    if (*p >= '0' && *p <= '9') {
-        dd("MOCKEAGAIN_VERBOSE env value: %s", p);
-        verbose = *p - '0';
-        return verbose;
+    ms = dgram_flush();
+
+    if (ms >= 0 && (left < 0 || ms < left)) {
+        return ms;
     }
 
-    dd("bad verbose env value: %s", p);
-    verbose = 0;
-    return verbose;
+    return left;
 }
 
 
-static void
-init_matchbufs()
+/* returns what is left of the poll timeout begun at begin */
+
+static int
+time_left(int timeout, int begin)
 {
-    const char          *p;
-    int                  len;
+    int              elapsed;
 
-    if (matchbufs != NULL) {
-        return;
+    if (timeout < 0) {
+        return -1;
     }
 
-    p = getenv("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN");
-    if (p == NULL || *p == '\0') {
-        dd("write_timeout env empty");
-        matchbuf_len = 0;
-        return;
-    }
+    elapsed = ms_since(begin);
+
+    return elapsed < timeout ? timeout - elapsed : 0;
+}
 
-    len = strlen(p);
 
-    matchbufs = malloc((MAX_FD + 1) * sizeof(char *));
-    if (matchbufs == NULL) {
-        fprintf(stderr, "mockeagain: ERROR: failed to allocate memory.\n");
-        return;
+static struct timespec *
+ms_to_timespec(int ms, struct timespec *ts)
+{
+    if (ms < 0) {
+        return NULL;
     }
 
-    memset(matchbufs, 0, (MAX_FD + 1) * sizeof(char *));
-    matchbuf_len = len + 1;
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = ms % 1000 * 1000000;
 
-    pattern = p;
+    return ts;
+}
 
-    if (get_verbose_level()) {
-        fprintf(stderr, "mockeagain: reading write timeout pattern: %s\n",
-            pattern);
+
+static int
+timespec_to_ms(const struct timespec *ts)
+{
+    if (ts == NULL) {
+        return -1;
     }
+
+    return ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
 }
 
 
-/* returns a time in milliseconds */
+/*
+ * Returns a monotonic time in milliseconds, which wraps around, so that
+ * the timeouts are neither stretched nor cut by the wall clock being set.
+ */
 static int now() {
-   struct timeval tv;
+   return (int) (unsigned) (now_ns() / 1000000);
+}
+
+
+/* returns the milliseconds since a time returned by now() */
+static int
+ms_since(int begin)
+{
+    return (int) ((unsigned) now() - (unsigned) begin);
+}
+
+
+/* returns a monotonic time in nanoseconds */
+static uint64_t
+now_ns()
+{
+    struct timespec  ts;
 
-   gettimeofday(&tv, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-   return tv.tv_sec % (3600 * 24) + tv.tv_usec/1000;
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
@@ -0,0 +1,109 @@
+#ifndef MOCKEAGAIN_H
+#define MOCKEAGAIN_H
+
+
+/*
+ * The API for test harnesses running inside the process that mockeagain.so
+ * is preloaded into, to steer the mocking of single fds instead of all of
+ * them through the environment. Since the library is preloaded rather than
+ * linked against, the API is looked up at run time:
+ *
+ *     mockeagain_api_handle  get_api;
+ *     const mockeagain_api_t *api = NULL;
+ *
+ *     get_api = (mockeagain_api_handle) dlsym(RTLD_DEFAULT,
+ *                                             MOCKEAGAIN_API_SYMBOL);
+ *     if (get_api) {
+ *         api = get_api(MOCKEAGAIN_API_VERSION);
+ *     }
+ *
+ * All the functions return 0 on success, or -1 with errno set.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define MOCKEAGAIN_API_VERSION  2
+#define MOCKEAGAIN_API_SYMBOL   "mockeagain_api"
+
+
+/* the mocking types, as for the MOCKEAGAIN environment */
+enum {
+    MOCKEAGAIN_READS = 0x01,
+    MOCKEAGAIN_WRITES = 0x02,
+    MOCKEAGAIN_DEFAULT = -1     /* back to the global mocking type */
+};
+
+
+typedef struct {
+    uint64_t        written;            /* the bytes written on the fd */
+    uint64_t        read;               /* the bytes read from it */
+    uint64_t        injected;           /* the EAGAINs injected */
+    uint64_t        shorts;             /* the calls cut short */
+    int             write_timed_out;    /* a write timeout was triggered */
+    int             read_timed_out;
+    int             write_pattern;      /* 1 + the write pattern found */
+    int             read_pattern;
+} mockeagain_fd_stats_t;
+
+
+/*
+ * Called before every read or write on an fd with the bytes asked for, to
+ * return the most bytes the call may transfer, 0 for all of them, or -1 to
+ * fail it with EAGAIN.
+ */
+typedef long long (*mockeagain_split_hook_handle)(int fd, int write,
+    size_t len, void *data);
+
+
+typedef struct {
+    unsigned        version;
+
+    /*
+     * Sets the mocking of the fd to a combination of MOCKEAGAIN_READS and
+     * MOCKEAGAIN_WRITES, 0 for none at all, over the global mocking type,
+     * until the fd is closed or MOCKEAGAIN_DEFAULT is set.
+     */
+    int           (*set_mocking)(int fd, int types);
+
+    /*
+     * Arms a write or read timeout on the fd when any of the patterns,
+     * given like for MOCKEAGAIN_WRITE_TIMEOUT_PATTERN, is found in its
+     * stream from now on, over the global patterns. NULL or an empty
+     * string go back to the global patterns.
+     */
+    int           (*set_write_patterns)(int fd, const char *patterns);
+    int           (*set_read_patterns)(int fd, const char *patterns);
+
+    /*
+     * Arms a write or read timeout on the fd when the given number of bytes
+     * in total have been written to or read from it, over the global
+     * offsets. A negative offset goes back to the global offset.
+     */
+    int           (*set_write_offset)(int fd, long long offset);
+    int           (*set_read_offset)(int fd, long long offset);
+
+    int           (*get_stats)(int fd, mockeagain_fd_stats_t *stats);
+
+    /*
+     * Since version 2. Has the hook decide how the reads and writes of the
+     * fd are split, instead of any of the other mocking, until the fd is
+     * closed or the hook is set to NULL.
+     */
+    int           (*set_split_hook)(int fd, mockeagain_split_hook_handle hook,
+                                    void *data);
+} mockeagain_api_t;
+
+
+typedef const mockeagain_api_t *(*mockeagain_api_handle)(unsigned version);
+
+
+/*
+ * Returns the API of the given version, or NULL if the library is too old
+ * for it. A newer library serves the older versions too.
+ */
+const mockeagain_api_t *mockeagain_api(unsigned version);
+
+
+#endif /* !MOCKEAGAIN_H */
@@ -0,0 +1,68 @@
+#ifndef MOCKEAGAIN_RECORD_H
+#define MOCKEAGAIN_RECORD_H
+
+
+/*
+ * The format of the recordings written with MOCKEAGAIN_RECORD set, which
+ * are replayed with MOCKEAGAIN_REPLAY and printed as schedules by the
+ * mockeagain-record tool.
+ *
+ * A recording is a header followed by the records of the decisions taken
+ * on the accepted and connected fds, in the order they were taken. The
+ * records are appended by claiming the next index with an atomic increment
+ * of nrecords, so a record claimed but not filled in yet has an op of 0.
+ */
+
+#include <stdint.h>
+
+
+#define MOCKEAGAIN_RECORD_MAGIC     "MEAGREC1"
+#define MOCKEAGAIN_RECORD_VERSION   1
+
+/* in the conn field, for the fds given to connect() */
+#define MOCKEAGAIN_RECORD_CONNECTED 0x80000000
+
+
+enum {
+    MOCKEAGAIN_RECORD_READ = 1,
+    MOCKEAGAIN_RECORD_WRITE,
+    MOCKEAGAIN_RECORD_EVENTS        /* some events were withheld */
+};
+
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        pid;
+    uint32_t        rec_size;
+    uint32_t        pad;
+    uint64_t        max_records;
+    uint64_t        nrecords;   /* claimed so far, maybe past max_records */
+    uint64_t        reserved[4];
+} mockeagain_record_header_t;
+
+
+/*
+ * The conn field is the ordinal of the fd among the fds accepted, or
+ * connected, by the process, counted from 1. For the reads and writes,
+ * value is the bytes returned, and err the errno when the call failed.
+ * For the events, value is the events withheld from the caller.
+ */
+typedef struct {
+    uint32_t        conn;
+    uint32_t        value;
+    uint8_t         op;
+    uint8_t         flags;      /* MOCKEAGAIN_TRACE_* */
+    uint16_t        err;
+} mockeagain_record_t;
+
+
+#define mockeagain_record_recs(h)                                            \
+    ((mockeagain_record_t *) ((mockeagain_record_header_t *) (h) + 1))
+
+#define mockeagain_record_file_size(max_records)                             \
+    (sizeof(mockeagain_record_header_t)                                      \
+     + (size_t) (max_records) * sizeof(mockeagain_record_t))
+
+
+#endif /* !MOCKEAGAIN_RECORD_H */
@@ -0,0 +1,67 @@
+#ifndef MOCKEAGAIN_STATS_H
+#define MOCKEAGAIN_STATS_H
+
+
+/*
+ * The format of the counters file shared with MOCKEAGAIN_STATS set, which
+ * is read by the mockeagain-stats tool.
+ *
+ * The file starts with a header page, followed by a slot of counters for
+ * every process using it. A process only ever updates its own slot, and a
+ * forked child claims a slot of its own, so the counters of the workers
+ * of a server never share a cache line.
+ */
+
+#include <stdint.h>
+
+
+#define MOCKEAGAIN_STATS_MAGIC      "MEAGSTA1"
+#define MOCKEAGAIN_STATS_VERSION    1
+#define MOCKEAGAIN_STATS_PAGE_SIZE  4096
+#define MOCKEAGAIN_STATS_MAX_SLOTS  256
+#define MOCKEAGAIN_STATS_NCALLS     32
+#define MOCKEAGAIN_STATS_NAME_LEN   16
+
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;    /* set by the process creating the file */
+    uint32_t        nslots;     /* claimed by the processes so far */
+    uint32_t        max_slots;
+    uint32_t        slot_size;
+    char            calls[MOCKEAGAIN_STATS_NCALLS][MOCKEAGAIN_STATS_NAME_LEN];
+} mockeagain_stats_header_t;
+
+
+/* the counters of a call, a cache line of them */
+typedef struct {
+    uint64_t        calls;
+    uint64_t        injected;   /* the EAGAINs injected */
+    uint64_t        shorts;     /* the calls cut short */
+    uint64_t        cut;        /* the bytes they were cut short by */
+    uint64_t        withheld;   /* the events withheld from the caller */
+    uint64_t        dropped;    /* the datagrams dropped */
+    uint64_t        duplicated;
+    uint64_t        held;
+} mockeagain_stats_call_t;
+
+
+typedef struct {
+    uint32_t        pid;
+    uint32_t        pad1;
+    uint64_t        timeouts;   /* the timeouts emulated */
+    uint64_t        pad2[6];
+    mockeagain_stats_call_t  calls[MOCKEAGAIN_STATS_NCALLS];
+} mockeagain_stats_slot_t;
+
+
+#define mockeagain_stats_slot(h, i)                                          \
+    ((mockeagain_stats_slot_t *) ((char *) (h)                               \
+                                  + MOCKEAGAIN_STATS_PAGE_SIZE) + (i))
+
+#define mockeagain_stats_file_size                                           \
+    (MOCKEAGAIN_STATS_PAGE_SIZE                                              \
+     + MOCKEAGAIN_STATS_MAX_SLOTS * sizeof(mockeagain_stats_slot_t))
+
+
+#endif /* !MOCKEAGAIN_STATS_H */
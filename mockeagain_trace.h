@@ -0,0 +1,90 @@
+#ifndef MOCKEAGAIN_TRACE_H
+#define MOCKEAGAIN_TRACE_H
+
+
+/*
+ * The format of the trace files written with MOCKEAGAIN_TRACE set, which
+ * are read by the mockeagain-trace tool.
+ *
+ * A trace file starts with a header page, followed by a page of ring
+ * descriptors and then the rings of records themselves, one per thread.
+ * Every ring is only ever written by its own thread, which publishes a
+ * record by bumping the head of the ring after filling it in, so a ring
+ * holds the last ring_size records of its thread.
+ */
+
+#include <stdint.h>
+
+
+#define MOCKEAGAIN_TRACE_MAGIC      "MEAGTRC1"
+#define MOCKEAGAIN_TRACE_VERSION    1
+#define MOCKEAGAIN_TRACE_PAGE_SIZE  4096
+#define MOCKEAGAIN_TRACE_MAX_RINGS  64
+#define MOCKEAGAIN_TRACE_NCALLS     32
+#define MOCKEAGAIN_TRACE_NAME_LEN   16
+
+
+/* the record flags */
+enum {
+    MOCKEAGAIN_TRACE_INJECTED = 0x01,   /* the errno was injected */
+    MOCKEAGAIN_TRACE_SHORT = 0x02,      /* the call was cut short */
+    MOCKEAGAIN_TRACE_WITHHELD = 0x04,   /* some events were withheld */
+    MOCKEAGAIN_TRACE_DROPPED = 0x08,    /* the datagram was dropped */
+    MOCKEAGAIN_TRACE_DUPLICATED = 0x10, /* the datagram was sent twice */
+    MOCKEAGAIN_TRACE_HELD = 0x20        /* the datagram was held back */
+};
+
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        pid;
+    uint32_t        nrings;     /* claimed by the threads so far */
+    uint32_t        max_rings;
+    uint32_t        ring_size;  /* in records */
+    uint32_t        rec_size;
+    uint64_t        monotonic;  /* the record time at the start, in ns */
+    uint64_t        realtime;   /* the wall clock time at the same time */
+    char            calls[MOCKEAGAIN_TRACE_NCALLS][MOCKEAGAIN_TRACE_NAME_LEN];
+} mockeagain_trace_header_t;
+
+
+typedef struct {
+    uint64_t        head;       /* the records written so far */
+    uint32_t        tid;
+    uint32_t        pad[13];
+} mockeagain_trace_ring_t;
+
+
+/*
+ * For the I/O calls, requested and returned are byte counts, or message
+ * counts for the batched ones. For the event calls, they are the events
+ * reported by the kernel and the ones passed on to the caller.
+ */
+typedef struct {
+    uint64_t        time;       /* CLOCK_MONOTONIC, in ns */
+    uint64_t        requested;
+    int64_t         returned;
+    int32_t         fd;
+    uint8_t         call;       /* an index into the calls of the header */
+    uint8_t         flags;
+    uint16_t        err;        /* the errno when returned is -1 */
+} mockeagain_trace_rec_t;
+
+
+#define mockeagain_trace_ring(h, i)                                          \
+    ((mockeagain_trace_ring_t *) ((char *) (h)                               \
+                                  + MOCKEAGAIN_TRACE_PAGE_SIZE) + (i))
+
+#define mockeagain_trace_recs(h, i)                                          \
+    ((mockeagain_trace_rec_t *) ((char *) (h)                                \
+                                 + 2 * MOCKEAGAIN_TRACE_PAGE_SIZE)           \
+     + (size_t) (i) * (h)->ring_size)
+
+#define mockeagain_trace_file_size(ring_size)                                \
+    (2 * MOCKEAGAIN_TRACE_PAGE_SIZE                                          \
+     + (size_t) MOCKEAGAIN_TRACE_MAX_RINGS * (ring_size)                     \
+       * sizeof(mockeagain_trace_rec_t))
+
+
+#endif /* !MOCKEAGAIN_TRACE_H */
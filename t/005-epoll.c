@@ -0,0 +1,138 @@
+#include "test_case.h"
+#if __linux__
+#include <sys/epoll.h>
+#endif
+
+int run_test(int fd) {
+#if __linux__
+    int n, i, epfd, epfd2, dupfd;
+    int sv[2];
+    const char  *buf = "test";
+    const int    len = sizeof("test") - 1;
+    char         rcvbuf[len];
+    struct epoll_event ev, events[4];
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+
+    epfd = epoll_create1(0);
+    assert(epfd != -1);
+
+    /* level-triggered writes */
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &ev;
+    assert(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.ptr == &ev);
+    assert(events[0].events & EPOLLOUT);
+
+    n = send(fd, buf, len, 0);
+    assert(n == 1);
+
+    n = send(fd, buf, len, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.ptr == &ev);
+
+    n = send(fd, buf + 1, len - 1, 0);
+    assert(n == 1);
+
+    /* edge-triggered writes */
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.u64 = 12345;
+    assert(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.u64 == 12345);
+
+    n = send(fd, buf + 2, len - 2, 0);
+    assert(n == 1);
+
+    /* the mocked EAGAIN re-arms the edge-triggered fd */
+    n = send(fd, buf + 3, len - 3, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.u64 == 12345);
+    assert(events[0].events & EPOLLOUT);
+
+    n = send(fd, buf + 3, len - 3, 0);
+    assert(n == 1);
+
+    /* edge-triggered reads; wait until "test" is echoed back */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = fd;
+    assert(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+
+    usleep(100 * 1000);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.fd == fd);
+    assert(events[0].events & EPOLLIN);
+
+    n = read(fd, rcvbuf, len);
+    assert(n == 1);
+
+    /* the readiness is consumed and not re-armed yet */
+    assert(epoll_wait(epfd, events, 4, 100) == 0);
+
+    for (i = 1; i < len; i++) {
+        n = read(fd, rcvbuf, len);
+        assert(n == -1);
+        assert(errno == EAGAIN);
+
+        assert(epoll_wait(epfd, events, 4, -1) == 1);
+        assert(events[0].data.fd == fd);
+
+        n = read(fd, rcvbuf, len);
+        assert(n == 1);
+    }
+
+    /* an fd can be in several epoll instances, each with its own data */
+    epfd2 = epoll_create1(0);
+    assert(epfd2 != -1);
+
+    ev.events = EPOLLOUT;
+    ev.data.u64 = 67890;
+    assert(epoll_ctl(epfd2, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+    ev.data.u64 = 12345;
+    assert(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0);
+
+    assert(epoll_wait(epfd2, events, 4, -1) == 1);
+    assert(events[0].data.u64 == 67890);
+
+    assert(epoll_wait(epfd, events, 4, -1) == 1);
+    assert(events[0].data.u64 == 12345);
+
+    assert(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == 0);
+    assert(epoll_ctl(epfd2, EPOLL_CTL_DEL, fd, NULL) == 0);
+
+    /* the file of a closed fd stays registered through a dup of it */
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &ev;
+    assert(epoll_ctl(epfd2, EPOLL_CTL_ADD, sv[0], &ev) == 0);
+
+    dupfd = dup(sv[0]);
+    assert(dupfd != -1);
+    close(sv[0]);
+
+    assert(epoll_wait(epfd2, events, 4, -1) == 1);
+    assert(events[0].data.ptr == &ev);
+
+    close(dupfd);
+    close(sv[1]);
+
+    close(epfd2);
+    close(epfd);
+#endif
+
+    (void) fd;
+
+    return EXIT_SUCCESS;
+}
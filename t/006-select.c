@@ -0,0 +1,96 @@
+#include "test_case.h"
+#include <sys/select.h>
+
+int run_test(int fd) {
+    int n;
+    const char  *buf = "test";
+    const int    len = sizeof("test") - 1;
+    char         rcvbuf[len];
+    fd_set       rfds, wfds;
+    struct timeval tv;
+    struct timespec ts;
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(!set_write_timeout_pattern("es"));
+
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    assert(select(fd + 1, NULL, &wfds, NULL, NULL) == 1);
+    assert(FD_ISSET(fd, &wfds));
+
+    /* t */
+    n = send(fd, buf, len, 0);
+    assert(n == 1);
+
+    n = send(fd, buf + 1, len - 1, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    assert(pselect(fd + 1, NULL, &wfds, NULL, NULL, NULL) == 1);
+
+    /* e */
+    n = send(fd, buf + 1, len - 1, 0);
+    assert(n == 1);
+
+    /* wait until "te" is echoed back from server */
+    usleep(100 * 1000);
+
+#if __linux__
+    {
+        struct pollfd pfd;
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        assert(ppoll(&pfd, 1, NULL, NULL) == 1);
+    }
+#else
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    assert(select(fd + 1, &rfds, NULL, NULL, NULL) == 1);
+#endif
+
+    n = read(fd, rcvbuf, len);
+    assert(n == 1);
+
+    n = read(fd, rcvbuf, len);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    FD_ZERO(&rfds);
+    FD_SET(fd, &rfds);
+    assert(select(fd + 1, &rfds, NULL, NULL, NULL) == 1);
+
+    n = read(fd, rcvbuf, len);
+    assert(n == 1);
+
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    assert(select(fd + 1, NULL, &wfds, NULL, NULL) == 1);
+
+    /* s, which completes the timeout pattern */
+    n = send(fd, buf + 2, len - 2, 0);
+    assert(n == 1);
+
+    /* the write event is suppressed from now on */
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 100 * 1000;
+    assert(select(fd + 1, NULL, &wfds, NULL, &tv) == 0);
+    assert(!FD_ISSET(fd, &wfds));
+
+    FD_ZERO(&wfds);
+    FD_SET(fd, &wfds);
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100 * 1000 * 1000;
+    assert(pselect(fd + 1, NULL, &wfds, NULL, &ts, NULL) == 0);
+
+    n = send(fd, buf + 3, len - 3, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    return EXIT_SUCCESS;
+}
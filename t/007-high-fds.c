@@ -0,0 +1,49 @@
+#include "test_case.h"
+#include <sys/resource.h>
+
+int run_test(int fd) {
+    int n, hfd;
+    const char  *buf = "test";
+    const int    len = sizeof("test") - 1;
+    struct pollfd pfd;
+    struct rlimit rlim;
+
+    assert(getrlimit(RLIMIT_NOFILE, &rlim) == 0);
+
+    if (rlim.rlim_cur < 5001) {
+        rlim.rlim_cur = rlim.rlim_max < 5001 ? rlim.rlim_max : 5001;
+        assert(setrlimit(RLIMIT_NOFILE, &rlim) == 0);
+    }
+
+    if (rlim.rlim_cur < 5001) {
+        /* cannot get such a high fd here */
+        return EXIT_SUCCESS;
+    }
+
+    /* well beyond the old limit of 1024 fds */
+    hfd = dup2(fd, 5000);
+    assert(hfd == 5000);
+
+    pfd.fd = hfd;
+    pfd.events = POLLOUT;
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(hfd, buf, len, 0);
+    assert(n == 1);
+
+    n = send(hfd, buf, len, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(hfd, buf, len, 0);
+    assert(n == 1);
+
+    close(hfd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+#include "test_case.h"
+#include <pthread.h>
+
+#define NTHREADS    8
+#define NBYTES      4096
+
+
+static void *
+run_loop(void *data) {
+    int n, i, sent = 0, received = 0;
+    int fds[2];
+    char sndbuf[NBYTES];
+    char rcvbuf[NBYTES];
+    struct pollfd pfds[2];
+
+    for (i = 0; i < NBYTES; i++) {
+        sndbuf[i] = (char) (i * 7 + (long) data);
+    }
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfds[0].fd = fds[0];
+    pfds[0].events = POLLOUT;
+    pfds[1].fd = fds[1];
+    pfds[1].events = POLLIN;
+
+    /* every thread runs its own event loop on its own pair of fds */
+    while (received < NBYTES) {
+        assert(poll(pfds, 2, -1) > 0);
+
+        if (sent < NBYTES) {
+            for ( ;; ) {
+                n = send(fds[0], sndbuf + sent, NBYTES - sent, 0);
+                if (n == -1) {
+                    assert(errno == EAGAIN);
+                    break;
+                }
+
+                /* never more than 1 byte per poll */
+                assert(n == 1);
+                sent += n;
+            }
+        }
+
+        for ( ;; ) {
+            n = recv(fds[1], rcvbuf + received, NBYTES - received, 0);
+            if (n == -1) {
+                assert(errno == EAGAIN);
+                break;
+            }
+
+            assert(n == 1);
+            received += n;
+        }
+    }
+
+    assert(memcmp(sndbuf, rcvbuf, NBYTES) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return NULL;
+}
+
+
+int run_test(int fd) {
+    int i;
+    pthread_t tids[NTHREADS];
+
+    (void) fd;
+
+    /* keep the output of so many loops readable */
+    assert(!setenv("MOCKEAGAIN_VERBOSE", "0", 1));
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+
+    for (i = 0; i < NTHREADS; i++) {
+        assert(pthread_create(&tids[i], NULL, run_loop,
+                              (void *) (long) i) == 0);
+    }
+
+    for (i = 0; i < NTHREADS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    return EXIT_SUCCESS;
+}
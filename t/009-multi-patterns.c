@@ -0,0 +1,35 @@
+#include "test_case.h"
+
+int run_test(int fd) {
+    int n;
+    const char  *buf = "tests";
+    const int    len = sizeof("tests") - 1;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    /* "st" is found long before "tests" could be, "s|t" never is */
+    assert(!set_write_timeout_pattern("xyz|tests|s\\|t|st|ts"));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, buf, len, 0);
+    assert(n == 1);
+
+    for (n = 1; n < 4; n++) {
+        assert(poll(&pfd, 1, -1) == 1);
+        assert(send(fd, buf + n, len - n, 0) == 1);
+    }
+
+    /* the write event is suppressed after "test" */
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = send(fd, buf + 4, len - 4, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    return EXIT_SUCCESS;
+}
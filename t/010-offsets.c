@@ -0,0 +1,71 @@
+#include "test_case.h"
+
+int run_test(int fd) {
+    int n, i;
+    int fds[2];
+    const char  *buf = "xa\0b";
+    const int    len = 4;
+    char         rcvbuf[4];
+    struct pollfd pfd;
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+
+    /* binary patterns */
+    assert(!set_write_timeout_pattern("\\x00\\x00|a\\x00b"));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < len; i++) {
+        assert(poll(&pfd, 1, -1) == 1);
+        assert(send(fds[0], buf + i, len - i, 0) == 1);
+    }
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    /* byte offsets */
+    assert(!setenv("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET", "2", 1));
+    assert(!setenv("MOCKEAGAIN_READ_TIMEOUT_OFFSET", "1", 1));
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < 2; i++) {
+        assert(poll(&pfd, 1, -1) == 1);
+        assert(send(fd, "te" + i, 2 - i, 0) == 1);
+    }
+
+    /* the write event is suppressed after 2 bytes */
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = send(fd, "st", 2, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* wait until "te" is echoed back from server */
+    usleep(100 * 1000);
+
+    pfd.events = POLLIN;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+    assert(rcvbuf[0] == 't');
+
+    /* the read event is suppressed after 1 byte */
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = recv(fd, rcvbuf, sizeof(rcvbuf), 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(!unsetenv("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET"));
+    assert(!unsetenv("MOCKEAGAIN_READ_TIMEOUT_OFFSET"));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,49 @@
+#include "test_case.h"
+
+int run_test(int fd) {
+    int n;
+    const char  *buf = "test";
+    const int    len = sizeof("test") - 1;
+    char         rcvbuf[len];
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    assert(!set_mocking(MOCKING_READS));
+    assert(!set_read_timeout_pattern("xyz|es"));
+
+    n = send(fd, buf, len, 0);
+    assert(n == len);
+
+    /* wait until "test" is echoed back from server */
+    usleep(100 * 1000);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* t */
+    n = recv(fd, rcvbuf, len, 0);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* e */
+    n = read(fd, rcvbuf, len);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* s, which completes the timeout pattern but is still returned */
+    n = read(fd, rcvbuf, len);
+    assert(n == 1);
+    assert(rcvbuf[0] == 's');
+
+    /* the read event is suppressed from now on */
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = read(fd, rcvbuf, len);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    return EXIT_SUCCESS;
+}
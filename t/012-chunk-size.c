@@ -0,0 +1,96 @@
+#include "test_case.h"
+#include <sys/uio.h>
+
+int run_test(int fd) {
+    int n, i;
+    int fds[2];
+    char         rcvbuf[64];
+    struct pollfd pfd;
+    struct iovec iov[3] = {
+        { "ab", 2 }, { "cd", 2 }, { "ef", 2 }
+    };
+
+    (void) fd;
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(!setenv("MOCKEAGAIN_CHUNK_SIZE", "3", 1));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* ab c */
+    n = writev(fds[0], iov, 3);
+    assert(n == 3);
+
+    n = writev(fds[0], iov, 3);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fds[0], "def", 3, 0);
+    assert(n == 3);
+
+    pfd.fd = fds[1];
+    pfd.events = POLLIN;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = read(fds[1], rcvbuf, sizeof(rcvbuf));
+    assert(n == 3);
+    assert(memcmp(rcvbuf, "abc", 3) == 0);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = recv(fds[1], rcvbuf, sizeof(rcvbuf), 0);
+    assert(n == 3);
+    assert(memcmp(rcvbuf, "def", 3) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    /* weighted ranges */
+    assert(!setenv("MOCKEAGAIN_CHUNK_SIZE", "2-4:3,10:1", 1));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < 100; i++) {
+        assert(poll(&pfd, 1, -1) == 1);
+
+        n = send(fds[0], "0123456789abcdef", 16, 0);
+        assert((n >= 2 && n <= 4) || n == 10);
+
+        assert(recv(fds[1], rcvbuf, sizeof(rcvbuf), 0) == n);
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+
+    /* the chunks stop right at the end of a write timeout pattern */
+    assert(!setenv("MOCKEAGAIN_CHUNK_SIZE", "100", 1));
+    assert(!set_write_timeout_pattern("cd"));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fds[0], "abcdef", 6, 0);
+    assert(n == 4);
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return EXIT_SUCCESS;
+}
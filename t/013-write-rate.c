@@ -0,0 +1,80 @@
+#include "test_case.h"
+#include <sys/time.h>
+
+#define NBYTES  5048
+
+
+static int
+elapsed_ms(struct timeval *begin) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (tv.tv_sec - begin->tv_sec) * 1000
+           + (tv.tv_usec - begin->tv_usec) / 1000;
+}
+
+
+int run_test(int fd) {
+    int n, sent, ms;
+    int fds[2];
+    char         buf[NBYTES];
+    struct pollfd pfd;
+    struct timeval begin;
+
+    (void) fd;
+
+    memset(buf, 'a', NBYTES);
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    /* 10 KB/s through a 3000 byte buffer */
+    assert(!setenv("MOCKEAGAIN_WRITE_BUFFER", "3000", 1));
+    assert(!setenv("MOCKEAGAIN_WRITE_RATE", "10k", 1));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    gettimeofday(&begin, NULL);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* the whole buffer goes out at once */
+    n = send(fds[0], buf, NBYTES, 0);
+    assert(n == 3000);
+
+    n = send(fds[0], buf, NBYTES, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(elapsed_ms(&begin) < 50);
+
+    /* a third of the buffer takes about 100 ms to refill */
+    gettimeofday(&begin, NULL);
+
+    assert(poll(&pfd, 1, 30) == 0);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 25 && ms < 80);
+
+    sent = 3000;
+
+    while (sent < NBYTES) {
+        assert(poll(&pfd, 1, -1) == 1);
+
+        n = send(fds[0], buf, NBYTES - sent, 0);
+        assert(n >= 1000 || n == NBYTES - sent);
+
+        sent += n;
+    }
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 150 && ms < 1000);
+
+    close(fds[0]);
+    close(fds[1]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,254 @@
+#include "test_case.h"
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#if __linux__
+#include <sys/epoll.h>
+#endif
+
+
+static int
+elapsed_ms(struct timeval *begin) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (tv.tv_sec - begin->tv_sec) * 1000
+           + (tv.tv_usec - begin->tv_usec) / 1000;
+}
+
+
+/* sends a datagram to the address given after 30 ms */
+static void *
+send_later(void *data) {
+    int s;
+    struct sockaddr_in *sin = data;
+
+    usleep(30000);
+
+    s = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(s != -1);
+
+    assert(sendto(s, "u", 1, 0, (struct sockaddr *) sin, sizeof(*sin)) == 1);
+
+    close(s);
+
+    return NULL;
+}
+
+
+int run_test(int fd) {
+    int n, ms, cfd;
+#if __linux__
+    int epfd;
+    struct epoll_event ev;
+#endif
+    int udp;
+    char         rcvbuf[4];
+    struct pollfd pfd, pfds[2];
+    pthread_t tid;
+    struct sockaddr_in sin;
+    socklen_t    sinlen = sizeof(sin);
+    struct timeval begin;
+    struct sockaddr_storage addr;
+    socklen_t    addrlen = sizeof(addr);
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(!setenv("MOCKEAGAIN_LATENCY", "100", 1));
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    /* not mocked, the fd has not been polled yet */
+    n = send(fd, "te", 2, 0);
+    assert(n == 2);
+
+    gettimeofday(&begin, NULL);
+
+    /* the timeout budget is kept */
+    assert(poll(&pfd, 1, 50) == 0);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 45 && ms < 90);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    /* the rest of the data pending is not delayed again */
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+    gettimeofday(&begin, NULL);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+    assert(elapsed_ms(&begin) < 50);
+
+    /* new data is */
+    pfd.events = POLLOUT;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "s", 1, 0);
+    assert(n == 1);
+
+    gettimeofday(&begin, NULL);
+
+    pfd.events = POLLIN;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+    /* connects take a round trip too */
+    assert(getpeername(fd, (struct sockaddr *) &addr, &addrlen) == 0);
+
+    cfd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+
+    gettimeofday(&begin, NULL);
+
+    n = connect(cfd, (struct sockaddr *) &addr, addrlen);
+    assert(n == 0 || errno == EINPROGRESS);
+
+    pfd.fd = cfd;
+    pfd.events = POLLOUT;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    close(cfd);
+
+    /* an fd not delayed is reported as soon as it is ready meanwhile */
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(udp != -1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(udp, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    assert(getsockname(udp, (struct sockaddr *) &sin, &sinlen) == 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "u", 1, 0);
+    assert(n == 1);
+
+    gettimeofday(&begin, NULL);
+
+    assert(pthread_create(&tid, NULL, send_later, &sin) == 0);
+
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = udp;
+    pfds[1].events = POLLIN;
+    assert(poll(pfds, 2, 1000) == 1);
+    assert(pfds[0].revents == 0 && pfds[1].revents == POLLIN);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 20 && ms < 90);
+
+    assert(pthread_join(tid, NULL) == 0);
+
+    n = recv(udp, rcvbuf, sizeof(rcvbuf), 0);
+    assert(n == 1);
+
+    /* while the delayed one still waits for its due time */
+    assert(poll(pfds, 2, 1000) == 1);
+    assert(pfds[0].revents == POLLIN && pfds[1].revents == 0);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+#if __linux__
+    /* a oneshot fd gets the read event once it is due */
+    epfd = epoll_create1(0);
+    assert(epfd != -1);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+    assert(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "t", 1, 0);
+    assert(n == 1);
+
+    gettimeofday(&begin, NULL);
+
+    assert(epoll_wait(epfd, &ev, 1, 1000) == 1);
+    assert(ev.data.fd == fd && (ev.events & EPOLLIN));
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+    close(epfd);
+
+    /* so does a level-triggered one in epoll */
+    epfd = epoll_create1(0);
+    assert(epfd != -1);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    assert(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = udp;
+    assert(epoll_ctl(epfd, EPOLL_CTL_ADD, udp, &ev) == 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "e", 1, 0);
+    assert(n == 1);
+
+    gettimeofday(&begin, NULL);
+
+    assert(pthread_create(&tid, NULL, send_later, &sin) == 0);
+
+    assert(epoll_wait(epfd, &ev, 1, 1000) == 1);
+    assert(ev.data.fd == udp && ev.events == EPOLLIN);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 20 && ms < 90);
+
+    assert(pthread_join(tid, NULL) == 0);
+
+    n = recv(udp, rcvbuf, sizeof(rcvbuf), 0);
+    assert(n == 1);
+
+    assert(epoll_wait(epfd, &ev, 1, 1000) == 1);
+    assert(ev.data.fd == fd && ev.events == EPOLLIN);
+
+    ms = elapsed_ms(&begin);
+    assert(ms >= 90 && ms < 300);
+
+    n = read(fd, rcvbuf, sizeof(rcvbuf));
+    assert(n == 1);
+
+    close(epfd);
+#endif
+
+    close(udp);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include "test_case.h"
+#include <sys/wait.h>
+
+#define NCALLS  200
+
+
+/* returns the outcomes of the mocked writes as a string */
+static void
+run_writes(char *out) {
+    int n, i;
+    int fds[2];
+    char         buf[64];
+    struct pollfd pfd;
+
+    memset(buf, 'a', sizeof(buf));
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fds[0];
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    for (i = 0; i < NCALLS; i++) {
+        n = send(fds[0], buf, sizeof(buf), 0);
+
+        if (n == -1) {
+            assert(errno == EAGAIN);
+            assert(poll(&pfd, 1, -1) == 1);
+            out[i] = 'E';
+
+        } else if (n < (int) sizeof(buf)) {
+            assert(n == 1);
+            assert(poll(&pfd, 1, -1) == 1);
+            out[i] = 's';
+
+        } else {
+            out[i] = '.';
+        }
+
+        /* keep the socket buffer empty */
+        while (recv(fds[1], buf, sizeof(buf), 0) > 0) { /* void */ }
+    }
+
+    out[NCALLS] = '\0';
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+
+int run_test(int fd) {
+    int status;
+    int pfds[2];
+    pid_t pid;
+    char parent[NCALLS + 1], child[NCALLS + 1];
+
+    (void) fd;
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(!setenv("MOCKEAGAIN_SEED", "12345", 1));
+    assert(!setenv("MOCKEAGAIN_EAGAIN_PROBABILITY", "0.2", 1));
+    assert(!setenv("MOCKEAGAIN_SHORT_PROBABILITY", "10%", 1));
+
+    assert(pipe(pfds) == 0);
+
+    /* the same fds are created in the same order in both processes */
+    pid = fork();
+    assert(pid != -1);
+
+    if (pid == 0) {
+        run_writes(child);
+        assert(write(pfds[1], child, sizeof(child)) == sizeof(child));
+        _exit(0);
+    }
+
+    run_writes(parent);
+
+    assert(read(pfds[0], child, sizeof(child)) == sizeof(child));
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    /* the same seed gives the same run */
+    assert(strcmp(parent, child) == 0);
+
+    /* with bursts of full writes as well as both kinds of failures */
+    assert(strstr(parent, "...") != NULL);
+    assert(strchr(parent, 'E') != NULL);
+    assert(strchr(parent, 's') != NULL);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#include "test_case.h"
+#include <sys/uio.h>
+
+int run_test(int fd) {
+    int n;
+    char         buf[4];
+    struct iovec iov[3];
+    struct msghdr msg;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(!set_mocking(MOCKING_WRITES));
+    assert(!set_write_timeout_pattern("cd"));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "ab", 2);
+    assert(n == 1);
+
+    n = write(fd, "b", 1);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = sendto(fd, "b", 1, 0, NULL, 0);
+    assert(n == 1);
+
+    n = sendto(fd, "c", 1, 0, NULL, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* the pattern spans the iovecs, which are truncated like for writev */
+
+    iov[0].iov_base = "";
+    iov[0].iov_len = 0;
+    iov[1].iov_base = "c";
+    iov[1].iov_len = 1;
+    iov[2].iov_base = "de";
+    iov[2].iov_len = 2;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = sendmsg(fd, &msg, 0);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* d, which completes the timeout pattern */
+    msg.msg_iov = iov + 2;
+    msg.msg_iovlen = 1;
+
+    n = sendmsg(fd, &msg, 0);
+    assert(n == 1);
+
+    /* the write event is suppressed from now on */
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = write(fd, "e", 1);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* all of it went out in order */
+    usleep(100 * 1000);
+
+    n = recv(fd, buf, sizeof(buf), 0);
+    assert(n == 4);
+    assert(memcmp(buf, "abcd", 4) == 0);
+
+    return EXIT_SUCCESS;
+}
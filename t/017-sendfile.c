@@ -0,0 +1,88 @@
+#include "test_case.h"
+#include <stdio.h>
+
+#if __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+int run_test(int fd) {
+#if __linux__
+    int n, ffd;
+    int pfds[2];
+    off_t off;
+    char         buf[8];
+    FILE        *f;
+    struct pollfd pfd;
+
+    f = tmpfile();
+    assert(f != NULL);
+    assert(fwrite("abcdef", 1, 6, f) == 6);
+    assert(fflush(f) == 0);
+
+    ffd = fileno(f);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(!set_mocking(MOCKING_WRITES));
+    assert(!setenv("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET", "4", 1));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* a short count, which advances the file offset by as much */
+    off = 0;
+    n = sendfile(fd, ffd, &off, 6);
+    assert(n == 1);
+    assert(off == 1);
+
+    n = sendfile(fd, ffd, &off, 5);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+    assert(off == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = sendfile(fd, ffd, &off, 5);
+    assert(n == 1);
+    assert(off == 2);
+
+    /* the same for splice from a pipe */
+    assert(pipe(pfds) == 0);
+    assert(write(pfds[1], "xy", 2) == 2);
+
+    n = splice(pfds[0], NULL, fd, NULL, 2, SPLICE_F_NONBLOCK);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = splice(pfds[0], NULL, fd, NULL, 2, SPLICE_F_NONBLOCK);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* y, which reaches the write timeout offset */
+    n = splice(pfds[0], NULL, fd, NULL, 2, SPLICE_F_NONBLOCK);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    n = sendfile(fd, ffd, &off, 4);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+    assert(off == 2);
+
+    usleep(100 * 1000);
+
+    n = recv(fd, buf, sizeof(buf), 0);
+    assert(n == 4);
+    assert(memcmp(buf, "abxy", 4) == 0);
+
+    close(pfds[0]);
+    close(pfds[1]);
+    fclose(f);
+#endif
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,176 @@
+#include "test_case.h"
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define NMSGS   4
+
+
+static void
+test_batches() {
+#if __linux__
+    int n, i, sent, received;
+    int ufds[2];
+    char         bufs[NMSGS][4];
+    socklen_t    len;
+    struct iovec iovs[NMSGS];
+    struct mmsghdr msgs[NMSGS];
+    struct sockaddr_in sin;
+
+    /* the datagram sockets only ever get their batches cut short */
+
+    for (i = 0; i < 2; i++) {
+        ufds[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        assert(ufds[i] != -1);
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        assert(bind(ufds[i], (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    }
+
+    len = sizeof(sin);
+    assert(getsockname(ufds[1], (struct sockaddr *) &sin, &len) == 0);
+    assert(connect(ufds[0], (struct sockaddr *) &sin, len) == 0);
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < NMSGS; i++) {
+        bufs[i][0] = 'a' + i;
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (sent = 0; sent < NMSGS; sent += n) {
+        n = sendmmsg(ufds[0], msgs + sent, NMSGS - sent, 0);
+        assert(n == 1);
+    }
+
+    usleep(100 * 1000);
+
+    for (i = 0; i < NMSGS; i++) {
+        iovs[i].iov_len = sizeof(bufs[i]);
+    }
+
+    for (received = 0; received < NMSGS; received += n) {
+        n = recvmmsg(ufds[1], msgs + received, NMSGS - received, 0, NULL);
+        assert(n == 1);
+        assert(msgs[received].msg_len == 1);
+        assert(bufs[received][0] == 'a' + received);
+    }
+
+    close(ufds[0]);
+    close(ufds[1]);
+#endif
+}
+
+
+int run_test(int fd) {
+    int n;
+    char         a[2], b[2];
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct pollfd pfd;
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+
+    test_batches();
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    /* t */
+    iov[0].iov_base = "te";
+    iov[0].iov_len = 2;
+    iov[1].iov_base = "st";
+    iov[1].iov_len = 2;
+
+    n = writev(fd, iov, 2);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "est", 3, 0);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "st", 2, 0);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = send(fd, "t", 1, 0);
+    assert(n == 1);
+
+    /* wait until "test" is echoed back from server */
+    usleep(100 * 1000);
+
+    pfd.events = POLLIN;
+
+    /* the scatter reads are filled a byte at a time across the buffers */
+
+    iov[0].iov_base = a;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = b;
+    iov[1].iov_len = 2;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = readv(fd, iov, 2);
+    assert(n == 1);
+    assert(a[0] == 't');
+
+    n = readv(fd, iov, 2);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov + 1;
+    msg.msg_iovlen = 1;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = recvmsg(fd, &msg, 0);
+    assert(n == 1);
+    assert(b[0] == 'e');
+
+    n = recvmsg(fd, &msg, 0);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = recvmsg(fd, &msg, 0);
+    assert(n == 1);
+    assert(b[0] == 's');
+
+#if __linux__
+    {
+        struct mmsghdr mmsg[2];
+
+        memset(mmsg, 0, sizeof(mmsg));
+        mmsg[0].msg_hdr.msg_iov = iov + 1;
+        mmsg[0].msg_hdr.msg_iovlen = 1;
+        mmsg[1] = mmsg[0];
+
+        assert(poll(&pfd, 1, -1) == 1);
+
+        /* a single message with a partial fill on a polled fd */
+        n = recvmmsg(fd, mmsg, 2, 0, NULL);
+        assert(n == 1);
+        assert(mmsg[0].msg_len == 1);
+        assert(b[0] == 't');
+
+        n = recvmmsg(fd, mmsg, 2, 0, NULL);
+        assert(n == -1);
+        assert(errno == EAGAIN);
+    }
+#endif
+
+    return EXIT_SUCCESS;
+}
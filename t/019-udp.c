@@ -0,0 +1,148 @@
+#include "test_case.h"
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define NDGRAMS     20
+
+
+static int
+elapsed_ms(struct timeval *begin) {
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+
+    return (tv.tv_sec - begin->tv_sec) * 1000
+           + (tv.tv_usec - begin->tv_usec) / 1000;
+}
+
+
+int run_test(int fd) {
+    int n, i, reordered;
+    int ufds[2];
+    char         seen[NDGRAMS];
+    char         buf[4];
+    socklen_t    len;
+    struct sockaddr_in sin;
+    struct pollfd pfd;
+    struct timeval begin;
+    struct iovec iov[2];
+
+    (void) fd;
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    for (i = 0; i < 2; i++) {
+        ufds[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        assert(ufds[i] != -1);
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        assert(bind(ufds[i], (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    }
+
+    len = sizeof(sin);
+    assert(getsockname(ufds[1], (struct sockaddr *) &sin, &len) == 0);
+
+    pfd.fd = ufds[1];
+    pfd.events = POLLIN;
+
+    /* loss */
+    assert(!setenv("MOCKEAGAIN_UDP_LOSS", "100%", 1));
+
+    n = sendto(ufds[0], "a", 1, 0, (struct sockaddr *) &sin, len);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    /* and on a connected socket */
+    assert(connect(ufds[0], (struct sockaddr *) &sin, len) == 0);
+
+    assert(write(ufds[0], "a", 1) == 1);
+    assert(poll(&pfd, 1, 100) == 0);
+
+    assert(!unsetenv("MOCKEAGAIN_UDP_LOSS"));
+
+    /* duplication */
+    assert(!setenv("MOCKEAGAIN_UDP_DUPLICATE", "1", 1));
+
+    n = sendto(ufds[0], "b", 1, 0, (struct sockaddr *) &sin, len);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, 1000) == 1);
+
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'b');
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'b');
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == -1 && errno == EAGAIN);
+
+    iov[0].iov_base = "c";
+    iov[0].iov_len = 1;
+    iov[1].iov_base = "d";
+    iov[1].iov_len = 1;
+
+    assert(writev(ufds[0], iov, 2) == 2);
+    assert(poll(&pfd, 1, 1000) == 1);
+
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 2 && buf[0] == 'c');
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 2 && buf[1] == 'd');
+
+    assert(!unsetenv("MOCKEAGAIN_UDP_DUPLICATE"));
+
+    /* reordering, where every datagram arrives but not in order */
+    assert(!setenv("MOCKEAGAIN_SEED", "1", 1));
+    assert(!setenv("MOCKEAGAIN_UDP_REORDER", "0.3", 1));
+
+    for (i = 0; i < NDGRAMS; i++) {
+        buf[0] = 'A' + i;
+        n = sendto(ufds[0], buf, 1, 0, (struct sockaddr *) &sin, len);
+        assert(n == 1);
+    }
+
+    memset(seen, 0, sizeof(seen));
+    reordered = 0;
+
+    for (i = 0; i < NDGRAMS; i++) {
+        assert(poll(&pfd, 1, 1000) == 1);
+
+        n = recv(ufds[1], buf, sizeof(buf), 0);
+        assert(n == 1);
+
+        assert(!seen[buf[0] - 'A']);
+        seen[buf[0] - 'A'] = 1;
+
+        if (buf[0] != 'A' + i) {
+            reordered = 1;
+        }
+    }
+
+    assert(reordered);
+
+    assert(!unsetenv("MOCKEAGAIN_UDP_REORDER"));
+
+    /* delay, where the poll wakes up to send the datagram when due */
+    assert(!setenv("MOCKEAGAIN_UDP_DELAY", "100", 1));
+
+    gettimeofday(&begin, NULL);
+
+    n = sendto(ufds[0], "e", 1, 0, (struct sockaddr *) &sin, len);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, 1000) == 1);
+    assert(elapsed_ms(&begin) >= 90);
+
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'e');
+
+    /* the ones still held when the fd is closed go out right away */
+    n = sendto(ufds[0], "f", 1, 0, (struct sockaddr *) &sin, len);
+    assert(n == 1);
+
+    close(ufds[0]);
+
+    assert(recv(ufds[1], buf, sizeof(buf), 0) == 1 && buf[0] == 'f');
+
+    close(ufds[1]);
+
+    return EXIT_SUCCESS;
+}
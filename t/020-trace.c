@@ -0,0 +1,89 @@
+#include "test_case.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "../mockeagain_trace.h"
+
+#define TRACE_PREFIX    "/tmp/mockeagain-test-trace"
+
+
+int run_test(int fd) {
+    int n, tfd, shorts = 0, injected = 0;
+    uint64_t i;
+    char path[64];
+    struct stat sb;
+    struct pollfd pfd;
+    mockeagain_trace_header_t *h;
+    mockeagain_trace_ring_t *ring;
+    mockeagain_trace_rec_t *rec;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    /* the size is only read when the trace file is opened */
+    assert(!setenv("MOCKEAGAIN_TRACE_SIZE", "4k", 1));
+    assert(!setenv("MOCKEAGAIN_TRACE", TRACE_PREFIX, 1));
+    assert(!set_mocking(MOCKING_WRITES));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "ab", 2);
+    assert(n == 1);
+
+    n = write(fd, "b", 1);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* the trace file is there while the process is still running */
+    snprintf(path, sizeof(path), "%s.%u", TRACE_PREFIX, (unsigned) getpid());
+
+    tfd = open(path, O_RDONLY);
+    assert(tfd != -1);
+    assert(fstat(tfd, &sb) == 0);
+
+    h = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, tfd, 0);
+    assert(h != MAP_FAILED);
+    close(tfd);
+    unlink(path);
+
+    assert(memcmp(h->magic, MOCKEAGAIN_TRACE_MAGIC, 8) == 0);
+    assert(h->pid == (uint32_t) getpid());
+    assert(h->ring_size == 4096 / sizeof(mockeagain_trace_rec_t));
+    assert(h->nrings == 1);
+
+    ring = mockeagain_trace_ring(h, 0);
+    assert(ring->tid != 0);
+    assert(ring->head >= 2);
+
+    for (i = 0; i < ring->head; i++) {
+        rec = mockeagain_trace_recs(h, 0) + i;
+
+        assert(rec->fd == fd);
+        assert(strcmp(h->calls[rec->call], "write") == 0
+               || strcmp(h->calls[rec->call], "poll") == 0);
+
+        if (rec->flags & MOCKEAGAIN_TRACE_SHORT) {
+            assert(rec->requested == 2 && rec->returned == 1);
+            shorts++;
+        }
+
+        if (rec->flags & MOCKEAGAIN_TRACE_INJECTED) {
+            assert(rec->returned == -1 && rec->err == EAGAIN);
+            injected++;
+        }
+    }
+
+    assert(shorts == 1);
+    assert(injected == 1);
+
+    /* tracing stops with MOCKEAGAIN_TRACE unset */
+    assert(!unsetenv("MOCKEAGAIN_TRACE"));
+
+    n = write(fd, "b", 1);
+    assert(n == -1);
+
+    assert(ring->head == i);
+
+    return EXIT_SUCCESS;
+}
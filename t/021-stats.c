@@ -0,0 +1,105 @@
+#include "test_case.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "../mockeagain_stats.h"
+
+#define STATS_PATH  "/tmp/mockeagain-test-stats"
+
+
+/* one short write and one EAGAIN per round */
+static void
+run_writes(int fd, int rounds) {
+    int n, i;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    for (i = 0; i < rounds; i++) {
+        assert(poll(&pfd, 1, -1) == 1);
+
+        n = write(fd, "abcd", 4);
+        assert(n == 1);
+
+        n = write(fd, "bcd", 3);
+        assert(n == -1);
+        assert(errno == EAGAIN);
+    }
+}
+
+
+static mockeagain_stats_call_t *
+find_call(mockeagain_stats_header_t *h, pid_t pid, const char *name) {
+    unsigned s, c;
+    mockeagain_stats_slot_t *slot;
+
+    for (s = 0; s < h->nslots; s++) {
+        slot = mockeagain_stats_slot(h, s);
+        if (slot->pid != (uint32_t) pid) {
+            continue;
+        }
+
+        for (c = 0; c < MOCKEAGAIN_STATS_NCALLS; c++) {
+            if (strcmp(h->calls[c], name) == 0) {
+                return &slot->calls[c];
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+int run_test(int fd) {
+    int status, sfd;
+    pid_t pid;
+    mockeagain_stats_header_t *h;
+    mockeagain_stats_call_t *c;
+
+    unlink(STATS_PATH);
+
+    assert(!setenv("MOCKEAGAIN_STATS", STATS_PATH, 1));
+    assert(!set_mocking(MOCKING_WRITES));
+
+    run_writes(fd, 3);
+
+    /* a forked worker counts into a slot of its own */
+    pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        run_writes(fd, 5);
+        _exit(0);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    sfd = open(STATS_PATH, O_RDONLY);
+    assert(sfd != -1);
+
+    h = mmap(NULL, mockeagain_stats_file_size, PROT_READ, MAP_SHARED, sfd, 0);
+    assert(h != MAP_FAILED);
+    close(sfd);
+    unlink(STATS_PATH);
+
+    assert(memcmp(h->magic, MOCKEAGAIN_STATS_MAGIC, 8) == 0);
+    assert(h->nslots == 2);
+
+    c = find_call(h, getpid(), "write");
+    assert(c != NULL);
+    assert(c->calls == 6);
+    assert(c->injected == 3);
+    assert(c->shorts == 3);
+    assert(c->cut == 9);
+
+    c = find_call(h, pid, "write");
+    assert(c != NULL);
+    assert(c->calls == 10);
+    assert(c->injected == 5);
+    assert(c->shorts == 5);
+    assert(c->cut == 15);
+
+    return EXIT_SUCCESS;
+}
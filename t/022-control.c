@@ -0,0 +1,72 @@
+#include "test_case.h"
+#include <stdio.h>
+
+#define CONTROL_PATH    "/tmp/mockeagain-test-control"
+
+
+static void
+write_control(const char *conf) {
+    FILE *f;
+
+    f = fopen(CONTROL_PATH, "w");
+    assert(f != NULL);
+    assert(fputs(conf, f) >= 0);
+    assert(fclose(f) == 0);
+
+    /* let the next check of the control file come */
+    usleep(200 * 1000);
+}
+
+
+int run_test(int fd) {
+    int n;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    /* a worker of a server only sees the control file change */
+    write_control("# turned off\nMOCKEAGAIN=\n");
+    assert(!setenv("MOCKEAGAIN_CONTROL", CONTROL_PATH, 1));
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "abcd", 4);
+    assert(n == 4);
+
+    n = write(fd, "efgh", 4);
+    assert(n == 4);
+
+    write_control("MOCKEAGAIN=w\nMOCKEAGAIN_CHUNK_SIZE=2\n");
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "ijkl", 4);
+    assert(n == 2);
+
+    n = write(fd, "kl", 2);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* the environment itself is left alone */
+    assert(getenv("MOCKEAGAIN_CHUNK_SIZE") == NULL);
+
+    /* the lines not for us are ignored */
+    write_control("OTHER=1\nMOCKEAGAIN_CONTROL=/nowhere\n"
+                  "MOCKEAGAIN=r\n");
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "klmnop", 6);
+    assert(n == 6);
+
+    assert(strcmp(getenv("MOCKEAGAIN_CONTROL"), CONTROL_PATH) == 0);
+    assert(getenv("OTHER") == NULL);
+
+    unlink(CONTROL_PATH);
+    assert(!unsetenv("MOCKEAGAIN_CONTROL"));
+
+    return EXIT_SUCCESS;
+}
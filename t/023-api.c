@@ -0,0 +1,122 @@
+#include "test_case.h"
+#include <dlfcn.h>
+#include "../mockeagain.h"
+
+
+int run_test(int fd) {
+    int n;
+    int fds[2];
+    struct pollfd pfd;
+    mockeagain_fd_stats_t stats;
+    mockeagain_api_handle get_api;
+    const mockeagain_api_t *api;
+
+    get_api = (mockeagain_api_handle) dlsym(RTLD_DEFAULT,
+                                            MOCKEAGAIN_API_SYMBOL);
+    assert(get_api != NULL);
+
+    assert(get_api(MOCKEAGAIN_API_VERSION + 1) == NULL);
+
+    api = get_api(MOCKEAGAIN_API_VERSION);
+    assert(api != NULL);
+    assert(api->version == MOCKEAGAIN_API_VERSION);
+
+    /* no global mocking, only that of the fd */
+    assert(!set_mocking(0));
+    assert(api->set_mocking(fd, MOCKEAGAIN_WRITES) == 0);
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    n = write(fd, "abc", 3);
+    assert(n == 1);
+
+    n = write(fd, "bc", 2);
+    assert(n == -1);
+    assert(errno == EAGAIN);
+
+    /* the other fds are left alone */
+    n = write(fds[0], "abc", 3);
+    assert(n == 3);
+
+    assert(api->get_stats(fd, &stats) == 0);
+    assert(stats.written == 1);
+    assert(stats.injected == 1);
+    assert(stats.shorts == 1);
+    assert(!stats.write_timed_out);
+
+    /* a pattern trigger on the fd alone */
+    assert(api->set_write_patterns(fd, "x|c") == 0);
+    assert(api->set_write_patterns(fds[0], "|") == -1);
+    assert(errno == EINVAL);
+
+    assert(poll(&pfd, 1, -1) == 1);
+    n = write(fd, "bc", 2);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, -1) == 1);
+    n = write(fd, "c", 1);
+    assert(n == 1);
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    assert(api->get_stats(fd, &stats) == 0);
+    assert(stats.written == 3);
+    assert(stats.write_timed_out);
+    assert(stats.write_pattern == 2);
+
+    /* an offset trigger on the other fd, not mocked so far */
+    assert(api->set_mocking(fds[0], MOCKEAGAIN_WRITES) == 0);
+    assert(api->set_write_offset(fds[0], 5) == 0);
+
+    pfd.fd = fds[0];
+
+    for (n = 0; n < 5; n++) {
+        assert(poll(&pfd, 1, -1) == 1);
+        assert(write(fds[0], "defg", 4) == 1);
+    }
+
+    assert(poll(&pfd, 1, 100) == 0);
+
+    assert(api->get_stats(fds[0], &stats) == 0);
+    assert(stats.written == 5);
+    assert(stats.write_timed_out);
+    assert(stats.write_pattern == 0);
+
+    /* the settings go with the fd */
+    close(fds[0]);
+    close(fds[1]);
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+
+    assert(api->get_stats(fds[0], &stats) == 0);
+    assert(stats.written == 0 && !stats.write_timed_out);
+
+    pfd.fd = fds[0];
+    assert(poll(&pfd, 1, -1) == 1);
+    assert(write(fds[0], "defg", 4) == 4);
+
+    /* a failed call is no short one */
+    assert(api->set_mocking(fds[0], MOCKEAGAIN_WRITES) == 0);
+    close(fds[1]);
+
+    assert(poll(&pfd, 1, -1) == 1);
+    n = send(fds[0], "defg", 4, MSG_NOSIGNAL);
+    assert(n == -1);
+    assert(errno == EPIPE);
+
+    assert(api->get_stats(fds[0], &stats) == 0);
+    assert(stats.shorts == 0);
+
+    close(fds[0]);
+
+    assert(api->set_mocking(fd, MOCKEAGAIN_DEFAULT) == 0);
+    assert(api->set_mocking(fd, 0x10) == -1);
+    assert(errno == EINVAL);
+
+    return EXIT_SUCCESS;
+}
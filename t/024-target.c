@@ -0,0 +1,115 @@
+#include "test_case.h"
+#include <stdio.h>
+#include <dlfcn.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../mockeagain.h"
+
+
+static int
+write_once(int fd, const char *data) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    assert(poll(&pfd, 1, -1) == 1);
+
+    return write(fd, data, strlen(data));
+}
+
+
+int run_test(int fd) {
+    int lfd, cfd, afd;
+    int fds[2];
+    char rules[64];
+    socklen_t len;
+    struct sockaddr_in sin;
+    mockeagain_api_handle get_api;
+    const mockeagain_api_t *api;
+
+    get_api = (mockeagain_api_handle) dlsym(RTLD_DEFAULT,
+                                            MOCKEAGAIN_API_SYMBOL);
+    assert(get_api != NULL);
+
+    assert(!set_mocking(MOCKING_WRITES));
+
+    /* the connection to the echo server matches, the socketpair does not */
+    assert(!setenv("MOCKEAGAIN_TARGET", "inet peer=127.0.0.1/8", 1));
+
+    assert(write_once(fd, "abc") == 1);
+
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    assert(write_once(fds[0], "abc") == 3);
+
+    /* only the accepted side of a connection */
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd != -1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    assert(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    assert(listen(lfd, 4) == 0);
+
+    len = sizeof(sin);
+    assert(getsockname(lfd, (struct sockaddr *) &sin, &len) == 0);
+
+    snprintf(rules, sizeof(rules), "!unix, accepted local=:%d",
+             ntohs(sin.sin_port));
+    assert(!setenv("MOCKEAGAIN_TARGET", rules, 1));
+
+    cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+    assert(connect(cfd, (struct sockaddr *) &sin, sizeof(sin)) == 0
+           || errno == EINPROGRESS);
+
+    afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(afd != -1);
+
+    assert(write_once(afd, "abc") == 1);
+    assert(write_once(cfd, "abc") == 3);
+
+    /* and get it back from the API */
+    api = get_api(MOCKEAGAIN_API_VERSION);
+    assert(api != NULL);
+
+    assert(api->set_mocking(afd, 0) == 0);
+    assert(write_once(afd, "bc") == 2);
+    assert(api->set_mocking(afd, MOCKEAGAIN_DEFAULT) == 0);
+    assert(write_once(afd, "abc") == 1);
+
+    /* the fds already seen keep their lot */
+    assert(write_once(fd, "bc") == 1);
+    assert(write_once(fds[1], "abc") == 3);
+
+    close(afd);
+    close(cfd);
+
+    /* with only "!" rules the others are all mocked */
+    snprintf(rules, sizeof(rules), "!connected peer=:%d",
+             ntohs(sin.sin_port));
+    assert(!setenv("MOCKEAGAIN_TARGET", rules, 1));
+
+    cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+    assert(connect(cfd, (struct sockaddr *) &sin, sizeof(sin)) == 0
+           || errno == EINPROGRESS);
+
+    afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(afd != -1);
+
+    assert(write_once(afd, "abc") == 1);
+    assert(write_once(cfd, "abc") == 3);
+
+    close(afd);
+    close(cfd);
+    close(lfd);
+    close(fds[0]);
+    close(fds[1]);
+
+    assert(!unsetenv("MOCKEAGAIN_TARGET"));
+
+    return EXIT_SUCCESS;
+}
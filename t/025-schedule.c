@@ -0,0 +1,136 @@
+#include "test_case.h"
+#include <stdio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define SCHEDULE_PATH   "/tmp/mockeagain-test-schedule"
+
+
+static void
+wait_readable(int fd) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    assert(poll(&pfd, 1, -1) == 1);
+}
+
+
+int run_test(int fd) {
+    int lfd, cfd, afd;
+    char buf[16];
+    FILE *f;
+    socklen_t len;
+    struct sockaddr_in sin;
+
+    /* the schedules go without any global mocking */
+    assert(!set_mocking(0));
+
+    f = fopen(SCHEDULE_PATH, "w");
+    assert(f != NULL);
+
+    /* the connection to the echo server is the first one connected */
+    assert(fputs("# the server side\n"
+                 "accepted 1: read all 2 eagain*2; write 3 eagain\n"
+                 "connected 2: write 1*2\n", f) >= 0);
+    assert(fclose(f) == 0);
+
+    assert(!setenv("MOCKEAGAIN_SCHEDULE", SCHEDULE_PATH, 1));
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd != -1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    assert(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    assert(listen(lfd, 4) == 0);
+
+    len = sizeof(sin);
+    assert(getsockname(lfd, (struct sockaddr *) &sin, &len) == 0);
+
+    cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+    assert(connect(cfd, (struct sockaddr *) &sin, sizeof(sin)) == 0
+           || errno == EINPROGRESS);
+
+    afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(afd != -1);
+
+    assert(write(cfd, "abcdef", 6) == 1);
+    assert(write(cfd, "bcdef", 5) == 1);
+    assert(write(cfd, "cdef", 4) == 4);
+
+    wait_readable(afd);
+
+    assert(read(afd, buf, 1) == 1 && buf[0] == 'a');
+    assert(read(afd, buf, sizeof(buf)) == 2 && memcmp(buf, "bc", 2) == 0);
+
+    assert(read(afd, buf, sizeof(buf)) == -1);
+    assert(errno == EAGAIN);
+    assert(recv(afd, buf, sizeof(buf), 0) == -1);
+    assert(errno == EAGAIN);
+
+    assert(recv(afd, buf, sizeof(buf), 0) == 3
+           && memcmp(buf, "def", 3) == 0);
+
+    assert(write(afd, "hello", 5) == 3);
+    assert(send(afd, "lo", 2, 0) == -1);
+    assert(errno == EAGAIN);
+    assert(send(afd, "lo", 2, 0) == 2);
+
+    /* the fds without a schedule are left alone */
+    assert(write(fd, "abc", 3) == 3);
+
+    close(afd);
+    close(cfd);
+
+    cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+    assert(connect(cfd, (struct sockaddr *) &sin, sizeof(sin)) == 0
+           || errno == EINPROGRESS);
+
+    afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(afd != -1);
+
+    assert(write(cfd, "abcdef", 6) == 6);
+
+    wait_readable(afd);
+
+    assert(read(afd, buf, sizeof(buf)) == 6);
+    assert(write(afd, "hello", 5) == 5);
+
+    close(afd);
+    close(cfd);
+
+    /* a file asking for too high an ordinal is ignored */
+    f = fopen(SCHEDULE_PATH ".big", "w");
+    assert(f != NULL);
+    assert(fputs("accepted 3: write 1\n"
+                 "connected 2000000000: write 1\n", f) >= 0);
+    assert(fclose(f) == 0);
+
+    assert(!setenv("MOCKEAGAIN_SCHEDULE", SCHEDULE_PATH ".big", 1));
+
+    cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(cfd != -1);
+    assert(connect(cfd, (struct sockaddr *) &sin, sizeof(sin)) == 0
+           || errno == EINPROGRESS);
+
+    afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(afd != -1);
+
+    assert(write(afd, "hello", 5) == 5);
+
+    close(afd);
+    close(cfd);
+    close(lfd);
+
+    unlink(SCHEDULE_PATH ".big");
+    unlink(SCHEDULE_PATH);
+    assert(!unsetenv("MOCKEAGAIN_SCHEDULE"));
+
+    return EXIT_SUCCESS;
+}
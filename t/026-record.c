@@ -0,0 +1,136 @@
+#include "test_case.h"
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../mockeagain_record.h"
+
+#define RECORD_PREFIX   "/tmp/mockeagain-test-record"
+
+
+static void
+wait_for(int fd, short events) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    assert(poll(&pfd, 1, -1) == 1);
+}
+
+
+static void
+open_pair(int lfd, struct sockaddr_in *sin, int *cfd, int *afd) {
+    *cfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(*cfd != -1);
+    assert(connect(*cfd, (struct sockaddr *) sin, sizeof(*sin)) == 0
+           || errno == EINPROGRESS);
+
+    *afd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+    assert(*afd != -1);
+}
+
+
+int run_test(int fd) {
+    int lfd, cfd, afd, rfd, status;
+    char buf[16], path[64];
+    pid_t pid;
+    socklen_t len;
+    struct sockaddr_in sin;
+    mockeagain_record_header_t *h;
+    mockeagain_record_t *r;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(lfd != -1);
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    assert(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    assert(listen(lfd, 4) == 0);
+
+    len = sizeof(sin);
+    assert(getsockname(lfd, (struct sockaddr *) &sin, &len) == 0);
+
+    /* the recorded run, in a child counting the connections like us */
+    pid = fork();
+    assert(pid >= 0);
+
+    if (pid == 0) {
+        assert(!setenv("MOCKEAGAIN_RECORD", RECORD_PREFIX, 1));
+        assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+
+        open_pair(lfd, &sin, &cfd, &afd);
+
+        wait_for(cfd, POLLOUT);
+        assert(write(cfd, "abcd", 4) == 1);
+        assert(write(cfd, "bcd", 3) == -1 && errno == EAGAIN);
+
+        wait_for(cfd, POLLOUT);
+        assert(write(cfd, "bcd", 3) == 1);
+
+        wait_for(afd, POLLIN);
+        assert(read(afd, buf, sizeof(buf)) == 1 && buf[0] == 'a');
+        assert(read(afd, buf, sizeof(buf)) == -1 && errno == EAGAIN);
+
+        _exit(0);
+    }
+
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    snprintf(path, sizeof(path), "%s.%u", RECORD_PREFIX, (unsigned) pid);
+
+    rfd = open(path, O_RDONLY);
+    assert(rfd != -1);
+
+    h = mmap(NULL, mockeagain_record_file_size(1), PROT_READ, MAP_SHARED,
+             rfd, 0);
+    assert(h != MAP_FAILED);
+    close(rfd);
+
+    assert(memcmp(h->magic, MOCKEAGAIN_RECORD_MAGIC, 8) == 0);
+    assert(h->pid == (uint32_t) pid);
+    assert(h->nrecords == 5);
+
+    /* the runner made the first connection */
+    r = mockeagain_record_recs(h);
+    assert(r->conn == (2 | MOCKEAGAIN_RECORD_CONNECTED));
+    assert(r->op == MOCKEAGAIN_RECORD_WRITE);
+    assert(r->value == 1);
+
+    munmap(h, mockeagain_record_file_size(1));
+
+    /* the replay, without any mocking of its own */
+    assert(!set_mocking(0));
+    assert(!setenv("MOCKEAGAIN_REPLAY", path, 1));
+
+    open_pair(lfd, &sin, &cfd, &afd);
+
+    assert(write(cfd, "abcd", 4) == 1);
+    assert(write(cfd, "bcd", 3) == -1 && errno == EAGAIN);
+    assert(write(cfd, "bcd", 3) == 1);
+
+    /* past the recording */
+    assert(write(cfd, "cd", 2) == 2);
+
+    wait_for(afd, POLLIN);
+    assert(read(afd, buf, sizeof(buf)) == 1 && buf[0] == 'a');
+    assert(recv(afd, buf, sizeof(buf), 0) == -1 && errno == EAGAIN);
+    assert(read(afd, buf, sizeof(buf)) == 3 && memcmp(buf, "bcd", 3) == 0);
+
+    /* the other connections are left alone */
+    assert(write(fd, "abc", 3) == 3);
+
+    close(afd);
+    close(cfd);
+    close(lfd);
+
+    unlink(path);
+    assert(!unsetenv("MOCKEAGAIN_REPLAY"));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#include "test_case.h"
+#include <dlfcn.h>
+#include "../mockeagain.h"
+
+
+static long long
+cut(int fd, int write, size_t len, void *data) {
+    int *calls = data;
+
+    (*calls)++;
+
+    if (write) {
+        return *calls == 2 ? -1 : 2;
+    }
+
+    return len > 3 ? 3 : 0;
+}
+
+
+static void
+wait_for(int fd, short events) {
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    assert(poll(&pfd, 1, -1) == 1);
+}
+
+
+int run_test(int fd) {
+    int calls = 0;
+    char buf[16];
+    size_t got;
+    ssize_t n;
+    mockeagain_fd_stats_t stats;
+    mockeagain_api_handle get_api;
+    const mockeagain_api_t *api;
+
+    get_api = (mockeagain_api_handle) dlsym(RTLD_DEFAULT,
+                                            MOCKEAGAIN_API_SYMBOL);
+    assert(get_api != NULL);
+
+    api = get_api(2);
+    assert(api != NULL);
+
+    /* the hook has the last word over the global mocking */
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(api->set_split_hook(fd, cut, &calls) == 0);
+
+    assert(write(fd, "abcd", 4) == 2);
+    assert(write(fd, "cd", 2) == -1 && errno == EAGAIN);
+    assert(send(fd, "cd", 2, 0) == 2);
+    assert(calls == 3);
+
+    /* at most 3 bytes at a time, however many are ready */
+    for (got = 0; got < 4; got += n) {
+        wait_for(fd, POLLIN);
+
+        n = read(fd, buf + got, sizeof(buf) - got);
+        assert(n > 0 && n <= 3);
+    }
+
+    assert(memcmp(buf, "abcd", 4) == 0);
+
+    assert(api->get_stats(fd, &stats) == 0);
+    assert(stats.injected == 1);
+    assert(stats.written == 4);
+    assert(stats.read == 4);
+
+    /* back to the global mocking */
+    assert(api->set_split_hook(fd, NULL, NULL) == 0);
+    calls = 0;
+
+    wait_for(fd, POLLOUT);
+    assert(write(fd, "abc", 3) == 1);
+    assert(calls == 0);
+
+    return EXIT_SUCCESS;
+}
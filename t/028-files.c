@@ -0,0 +1,40 @@
+#include "test_case.h"
+#include <stdio.h>
+#include <fcntl.h>
+
+#define FILE_PATH   "/tmp/mockeagain-test-file"
+
+
+int run_test(int fd) {
+    int ffd, i;
+    char buf[16];
+
+    assert(!set_mocking(MOCKING_READS | MOCKING_WRITES));
+    assert(!setenv("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET", "5", 1));
+    assert(!setenv("MOCKEAGAIN_READ_TIMEOUT_OFFSET", "5", 1));
+    assert(!set_write_timeout_pattern("world"));
+
+    ffd = open(FILE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    assert(ffd != -1);
+
+    /* past the offsets and the pattern, the file is never polled */
+    for (i = 0; i < 3; i++) {
+        assert(write(ffd, "world", 5) == 5);
+    }
+
+    assert(lseek(ffd, 0, SEEK_SET) == 0);
+
+    for (i = 0; i < 3; i++) {
+        assert(read(ffd, buf, 5) == 5);
+        assert(memcmp(buf, "world", 5) == 0);
+    }
+
+    close(ffd);
+    unlink(FILE_PATH);
+
+    assert(!unsetenv("MOCKEAGAIN_WRITE_TIMEOUT_OFFSET"));
+    assert(!unsetenv("MOCKEAGAIN_READ_TIMEOUT_OFFSET"));
+    assert(!unsetenv("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN"));
+
+    return EXIT_SUCCESS;
+}
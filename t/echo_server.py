@@ -7,6 +7,7 @@ import threading
 import SocketServer
 import subprocess
 import sys
+import os
 
 class ThreadedTCPRequestHandler(SocketServer.BaseRequestHandler):
 
@@ -40,6 +41,10 @@ if __name__ == "__main__":
               "MOCKEAGAIN_VERBOSE": "1",
           }
 
+    # the split explorer of the runner
+    if os.environ.get("MOCKEAGAIN_EXPLORE"):
+        env["MOCKEAGAIN_EXPLORE"] = os.environ["MOCKEAGAIN_EXPLORE"]
+
     if len(sys.argv) == 4 and sys.argv[2] == '1': # valgrind
         ret = subprocess.call(['valgrind', '--leak-check=full',
                                sys.argv[1], server.server_address[0],
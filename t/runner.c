@@ -1,31 +1,638 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <dlfcn.h>
+#include <semaphore.h>
+#include <linux/sockios.h>
 #include "test_case.h"
+#include "../mockeagain.h"
 
-int main(int argc, char *argv[])
+
+/*
+ * The split explorer. With MOCKEAGAIN_EXPLORE set to "calls[:bytes]", the
+ * first reads and writes of the test connection, as many as calls, are each
+ * cut after 1 to bytes bytes, or not at all, in every combination. Right
+ * before every call, the runner forks a branch for every cut of it, so that
+ * whatever the test does before is only done once, and runs as many
+ * branches at a time as there are CPUs.
+ *
+ * The test connection is then made to the runner itself instead of to the
+ * echo server, which echoes the same, so that every branch can be given a
+ * connection of its own with the same data pending.
+ */
+
+#define EXPLORE_MAX_CALLS   64
+#define EXPLORE_BYTES       3
+
+
+typedef struct {
+    int                  write;
+    long long            size;      /* of the cut, 0 for none */
+} explore_step_t;
+
+
+/* shared by all the branches */
+typedef struct {
+    sem_t                cpus;      /* left for the branches to run on */
+    char                 lock;
+    unsigned             branches;  /* run to their end */
+    unsigned             failures;
+    int                  nbest;     /* steps of the minimal failure, or -1 */
+    explore_step_t       best[EXPLORE_MAX_CALLS];
+} explore_t;
+
+
+static explore_t       *explore = NULL;
+static int              explore_calls;
+static long long        explore_bytes = EXPLORE_BYTES;
+static int              explore_root = 1;   /* the process run first */
+static int              report_fd = -1;     /* stderr of the branches */
+static explore_step_t   path[EXPLORE_MAX_CALLS];   /* of this branch */
+static int              npath = 0;
+
+
+static void
+explore_die(const char *what)
 {
-    struct addrinfo  hints;
-    struct addrinfo *result;
-    int              fd, s;
+    dprintf(report_fd, "explore: %s failed: %s\n", what, strerror(errno));
 
-    if (argc != 3) {
-        fprintf(stderr, "expect two cmdline arguments\n");
+    /* the branch has the CPU it runs on to give back */
+    sem_post(&explore->cpus);
+    _exit(EXIT_FAILURE);
+}
+
+
+/* a TCP connection to itself, which echoes what is written to it */
+static int
+self_connect(void)
+{
+    int                  fd, on = 1;
+    socklen_t            len;
+    struct linger        lg;
+    struct sockaddr_in   sin;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    len = sizeof(sin);
+
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1
+        || getsockname(fd, (struct sockaddr *) &sin, &len) == -1
+        || connect(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    /* no TIME_WAIT for the thousands of branches */
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    (void) setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    /* nor any wait for the delayed acks of the cut writes */
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+
+/*
+ * Waits for the data written to the connection to be readable from it,
+ * which it is as soon as it is sent on the loopback.
+ */
+static void
+explore_settle(int fd)
+{
+    int                  i, n;
+
+    for (i = 0; i < 1000; i++) {
+        if (ioctl(fd, SIOCOUTQNSD, &n) == -1) {
+            explore_die("ioctl");
+        }
+
+        if (n == 0) {
+            return;
+        }
+
+        usleep(1000);
+    }
+
+    errno = ETIMEDOUT;
+    explore_die("settling the connection");
+}
+
+
+/*
+ * Gives the branch a connection of its own in place of fd, with the data
+ * that was pending on it. The data goes around the mocking.
+ */
+static void
+explore_own(int fd, const char *buf, size_t n)
+{
+    int                  s;
+    ssize_t              rc;
+
+    s = self_connect();
+    if (s == -1) {
+        explore_die("connect");
+    }
+
+    while (n) {
+        rc = syscall(SYS_sendto, s, buf, n, 0, NULL, 0);
+        if (rc == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            explore_die("send");
+        }
+
+        buf += rc;
+        n -= rc;
+    }
+
+    explore_settle(s);
+
+    if (fcntl(s, F_SETFL, fcntl(fd, F_GETFL, 0)) == -1
+        || dup2(s, fd) == -1)
+    {
+        explore_die("dup2");
+    }
+
+    close(s);
+}
+
+
+/* waits for a child, and gives back the CPU of one that was killed */
+static int
+explore_reap(void)
+{
+    int                  status;
+    pid_t                pid;
+
+    do {
+        pid = waitpid(-1, &status, 0);
+    } while (pid == -1 && errno == EINTR);
+
+    if (pid == -1) {
+        return -1;
+    }
+
+    if (WIFSIGNALED(status)) {
+        sem_post(&explore->cpus);
+    }
+
+    return 0;
+}
+
+
+static void
+explore_acquire(void)
+{
+    while (sem_trywait(&explore->cpus) == -1) {
+        if (explore_reap() == -1) {
+            /* the CPUs are all taken by the branches of others */
+            while (sem_wait(&explore->cpus) == -1 && errno == EINTR) {
+                /* void */
+            }
+
+            return;
+        }
+    }
+}
+
+
+static int
+explore_cuts(const explore_step_t *steps, int n, int *last)
+{
+    int                  i, cuts = 0;
+
+    *last = 0;
+
+    for (i = 0; i < n; i++) {
+        if (steps[i].size) {
+            cuts++;
+            *last = i + 1;
+        }
+    }
+
+    return cuts;
+}
+
+
+/*
+ * The fewest cuts come first, then the ones done the earliest, then the
+ * smallest ones.
+ */
+static int
+explore_cmp(const explore_step_t *a, int na, const explore_step_t *b, int nb)
+{
+    int                  i, ca, cb, la, lb;
+    long long            x, y;
+
+    ca = explore_cuts(a, na, &la);
+    cb = explore_cuts(b, nb, &lb);
+
+    if (ca != cb) {
+        return ca - cb;
+    }
+
+    if (la != lb) {
+        return la - lb;
+    }
+
+    for (i = 0; i < la; i++) {
+        x = a[i].size ? a[i].size : LLONG_MAX;
+        y = b[i].size ? b[i].size : LLONG_MAX;
+
+        if (x != y) {
+            return x < y ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+print_steps(const explore_step_t *steps, int n, int write, const char *sep)
+{
+    int                  i, last = -1, first = 1, repeat = 0;
+    long long            size = 0;
+
+    for (i = 0; i < n; i++) {
+        if (steps[i].write == write && steps[i].size) {
+            last = i;
+        }
+    }
+
+    for (i = 0; i <= last; i++) {
+        if (steps[i].write != write) {
+            continue;
+        }
+
+        if (repeat && steps[i].size == size) {
+            repeat++;
+            continue;
+        }
+
+        if (first) {
+            dprintf(report_fd, "%s %s", sep, write ? "write" : "read");
+            first = 0;
+
+        } else {
+            dprintf(report_fd, size ? " %lld" : " all", size);
+            if (repeat > 1) {
+                dprintf(report_fd, "*%d", repeat);
+            }
+        }
+
+        size = steps[i].size;
+        repeat = 1;
+    }
+
+    if (repeat) {
+        dprintf(report_fd, size ? " %lld" : " all", size);
+        if (repeat > 1) {
+            dprintf(report_fd, "*%d", repeat);
+        }
+    }
+}
+
+
+static void
+explore_report(void)
+{
+    int                  last, reads = 0, i;
+
+    dprintf(report_fd, "explore: %u branches run, %u failed\n",
+            explore->branches, explore->failures);
+
+    if (explore->nbest == -1) {
+        return;
+    }
+
+    if (explore_cuts(explore->best, explore->nbest, &last) == 0) {
+        dprintf(report_fd, "explore: the test fails without any cut\n");
+        return;
+    }
+
+    for (i = 0; i < last; i++) {
+        if (!explore->best[i].write && explore->best[i].size) {
+            reads = 1;
+        }
+    }
+
+    /* the test connection is the first connected by the process */
+    dprintf(report_fd, "explore: the minimal failing schedule is\n"
+            "connected 1:");
+
+    print_steps(explore->best, last, 0, "");
+    print_steps(explore->best, last, 1, reads ? ";" : "");
+
+    dprintf(report_fd, "\n");
+}
+
+
+/* counts the end of a branch, which may also be a signal handler */
+static void
+explore_end(int failed)
+{
+    while (__atomic_test_and_set(&explore->lock, __ATOMIC_ACQUIRE)) {
+        /* void */
+    }
+
+    explore->branches++;
+
+    if (failed) {
+        explore->failures++;
+
+        if (explore->nbest == -1
+            || explore_cmp(path, npath, explore->best, explore->nbest) < 0)
+        {
+            memcpy(explore->best, path, npath * sizeof(explore_step_t));
+            explore->nbest = npath;
+        }
+    }
+
+    __atomic_clear(&explore->lock, __ATOMIC_RELEASE);
+}
+
+
+static void
+explore_crash(int signo)
+{
+    explore_end(1);
+
+    if (explore_root) {
+        explore_report();
+    }
+
+    signal(signo, SIG_DFL);
+    raise(signo);
+}
+
+
+static int
+explore_done(int s)
+{
+    explore_end(s != EXIT_SUCCESS);
+
+    if (!explore_root) {
+        sem_post(&explore->cpus);
+        return s;
+    }
+
+    /* nothing to cut at all */
+    explore_report();
+
+    return explore->failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+/*
+ * Forks a branch for every cut of the call and for the whole call, and
+ * leaves the rest to them.
+ */
+static long long
+explore_fork(int fd, explore_step_t *step, long long ncuts)
+{
+    int                  n;
+    char                *buf;
+    ssize_t              rc;
+    size_t               got = 0;
+    pid_t                pid;
+    long long            i, cut;
+
+    explore_settle(fd);
+
+    if (ioctl(fd, FIONREAD, &n) == -1) {
+        explore_die("ioctl");
+    }
+
+    buf = malloc(n ? n : 1);
+    if (buf == NULL) {
+        explore_die("malloc");
+    }
+
+    /* the pending data goes to the branches rather than staying shared */
+    while (got < (size_t) n) {
+        rc = syscall(SYS_recvfrom, fd, buf + got, n - got, MSG_DONTWAIT,
+                     NULL, NULL);
+        if (rc <= 0) {
+            if (rc == -1 && errno == EINTR) {
+                continue;
+            }
+
+            explore_die("recv");
+        }
+
+        got += rc;
+    }
+
+    for (i = 0; i <= ncuts; i++) {
+        cut = i < ncuts ? i + 1 : 0;
+
+        /* the first branch runs on the CPU of this process */
+        if (i) {
+            explore_acquire();
+        }
+
+        pid = fork();
+        if (pid == -1) {
+            explore_die("fork");
+        }
+
+        if (pid == 0) {
+            explore_root = 0;
+            explore_own(fd, buf, n);
+            free(buf);
+
+            step->size = cut;
+            return cut;
+        }
+    }
+
+    free(buf);
+
+    while (explore_reap() == 0) {
+        /* void */
+    }
+
+    if (!explore_root) {
+        _exit(EXIT_SUCCESS);
+    }
+
+    explore_report();
+
+    exit(explore->failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+static long long
+explore_split(int fd, int write, size_t len, void *data)
+{
+    int                  n;
+    size_t               max = len;
+    explore_step_t      *step;
+
+    if (npath == explore_calls) {
+        return 0;
+    }
+
+    step = &path[npath++];
+    step->write = write;
+    step->size = 0;
+
+    if (!write) {
+        explore_settle(fd);
+
+        if (ioctl(fd, FIONREAD, &n) == -1) {
+            explore_die("ioctl");
+        }
+
+        if ((size_t) n < max) {
+            max = n;
+        }
+    }
+
+    if (max <= 1) {
+        /* nothing to cut */
+        return 0;
+    }
+
+    return explore_fork(fd, step, (long long) max - 1 < explore_bytes
+                                  ? (long long) max - 1 : explore_bytes);
+}
+
+
+static int
+explore_init(const char *conf)
+{
+    int                      fd, i, null;
+    long                     ncpus;
+    char                    *p;
+    struct sigaction         sa;
+    mockeagain_api_handle    get_api;
+    const mockeagain_api_t  *api = NULL;
+    static const int         signals[] = { SIGABRT, SIGSEGV, SIGBUS,
+                                           SIGFPE, SIGILL };
+
+    explore_calls = strtol(conf, &p, 10);
+
+    if (*p == ':') {
+        explore_bytes = strtoll(p + 1, &p, 10);
+    }
+
+    if (*p || explore_calls < 1 || explore_calls > EXPLORE_MAX_CALLS
+        || explore_bytes < 1)
+    {
+        fprintf(stderr, "bad MOCKEAGAIN_EXPLORE \"%s\", expecting "
+                "calls[:bytes] with at most %d calls\n", conf,
+                EXPLORE_MAX_CALLS);
+        exit(EXIT_FAILURE);
+    }
+
+    get_api = (mockeagain_api_handle) dlsym(RTLD_DEFAULT,
+                                            MOCKEAGAIN_API_SYMBOL);
+    if (get_api) {
+        api = get_api(2);
+    }
+
+    if (api == NULL) {
+        fprintf(stderr, "mockeagain.so is not preloaded or too old\n");
+        exit(EXIT_FAILURE);
+    }
+
+    explore = mmap(NULL, sizeof(explore_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (explore == MAP_FAILED) {
+        perror("mmap failed");
+        exit(EXIT_FAILURE);
+    }
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* this process holds one of them */
+    if (sem_init(&explore->cpus, 1, ncpus > 1 ? ncpus - 1 : 0) == -1) {
+        perror("sem_init failed");
+        exit(EXIT_FAILURE);
+    }
+
+    explore->nbest = -1;
+
+    fd = self_connect();
+    if (fd == -1) {
+        perror("connect failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        perror("fcntl failed");
+    }
+
+    if (api->set_split_hook(fd, explore_split, NULL) == -1) {
+        perror("set_split_hook failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the output of thousands of branches would only be noise */
+    unsetenv("MOCKEAGAIN_VERBOSE");
+
+    report_fd = dup(STDERR_FILENO);
+    null = open("/dev/null", O_WRONLY);
+
+    if (report_fd == -1 || null == -1 || dup2(null, STDERR_FILENO) == -1) {
+        perror("redirecting stderr failed");
         exit(EXIT_FAILURE);
     }
 
+    close(null);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = explore_crash;
+
+    for (i = 0; i < (int) (sizeof(signals) / sizeof(signals[0])); i++) {
+        sigaction(signals[i], &sa, NULL);
+    }
+
+    return fd;
+}
+
+
+static int
+connect_server(const char *host, const char *port)
+{
+    struct addrinfo  hints;
+    struct addrinfo *result;
+    int              fd, s;
+
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = 0;
     hints.ai_protocol = IPPROTO_TCP;
 
-    s = getaddrinfo(argv[1], argv[2], &hints, &result);
+    s = getaddrinfo(host, port, &hints, &result);
     if (s) {
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(s));
         exit(EXIT_FAILURE);
@@ -52,8 +659,35 @@ int main(int argc, char *argv[])
 
     freeaddrinfo(result);
 
+    return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int              fd, s;
+    const char      *conf;
+
+    if (argc != 3) {
+        fprintf(stderr, "expect two cmdline arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    conf = getenv("MOCKEAGAIN_EXPLORE");
+
+    if (conf && *conf) {
+        fd = explore_init(conf);
+
+    } else {
+        fd = connect_server(argv[1], argv[2]);
+    }
+
     s = run_test(fd);
 
+    if (explore) {
+        s = explore_done(s);
+    }
+
     /* we are terminating anyway, don't bother with errors */
     shutdown(fd, SHUT_WR);
     close(fd);
@@ -22,3 +22,11 @@ int set_write_timeout_pattern(const char *pattern) {
 
     return setenv("MOCKEAGAIN_WRITE_TIMEOUT_PATTERN", pattern, 1);
 }
+
+int set_read_timeout_pattern(const char *pattern) {
+    if (!strlen(pattern)) {
+        return 0;
+    }
+
+    return setenv("MOCKEAGAIN_READ_TIMEOUT_PATTERN", pattern, 1);
+}
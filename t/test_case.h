@@ -23,4 +23,6 @@ int set_mocking(int types);
 
 int set_write_timeout_pattern(const char *pattern);
 
+int set_read_timeout_pattern(const char *pattern);
+
 #endif /* !TEST_CASE_H */